@@ -3,12 +3,38 @@
 
 #include "qmic.h"
 
-static void qmi_struct_header(FILE *fp, const char *package)
+static const char *span_types[] = {
+	[TYPE_U8] = "qmi_span_u8",
+	[TYPE_U16] = "qmi_span_u16",
+	[TYPE_U32] = "qmi_span_u32",
+	[TYPE_U64] = "qmi_span_u64",
+};
+
+/*
+ * With ACCESSOR_INLINE the accessors are static inline functions in the
+ * header, finding items through the inline lookups emitted along with them
+ */
+static const char *accessor_storage(unsigned flags)
+{
+	return flags & ACCESSOR_INLINE ? "static inline " : "";
+}
+
+static const char *accessor_get(unsigned flags)
+{
+	return flags & ACCESSOR_INLINE ? "qmi_tlv_get_inline" : "qmi_tlv_get";
+}
+
+static const char *accessor_get_array(unsigned flags)
+{
+	return flags & ACCESSOR_INLINE ? "qmi_tlv_get_array_inline" : "qmi_tlv_get_array";
+}
+
+static void qmi_struct_header(struct qmi_ctx *ctx, FILE *fp, const char *package)
 {
 	struct qmi_struct_member *qsm;
 	struct qmi_struct *qs;
 
-	list_for_each_entry(qs, &qmi_structs, node) {
+	list_for_each_entry(qs, &ctx->structs, node) {
 		fprintf(fp, "struct %s_%s {\n",
 			    package, qs->name);
 		list_for_each_entry(qsm, &qs->members, node) {
@@ -17,21 +43,41 @@ static void qmi_struct_header(FILE *fp, const char *package)
 		}
 		fprintf(fp, "};\n"
 			    "\n");
+
+		/* Like the integer spans, elements may be unaligned */
+		fprintf(fp, "struct %1$s_%2$s_span {\n"
+			    "	const uint8_t *ptr;\n"
+			    "	size_t len;\n"
+			    "};\n"
+			    "\n"
+			    "static inline struct %1$s_%2$s %1$s_%2$s_span_at(struct %1$s_%2$s_span span, size_t i)\n"
+			    "{\n"
+			    "	struct %1$s_%2$s v;\n"
+			    "\n"
+			    "	memcpy(&v, span.ptr + i * sizeof(v), sizeof(v));\n"
+			    "	return v;\n"
+			    "}\n"
+			    "\n",
+			    package, qs->name);
 	}
 }
 
 static void qmi_struct_emit_prototype(FILE *fp,
 			       const char *package,
 			       const char *message,
-			       const char *member,
-			       unsigned array_size,
-			       struct qmi_struct *qs)
+			       struct qmi_message_member *qmm)
 {
-	if (array_size) {
+	const char *member = qmm->name;
+	struct qmi_struct *qs = qmm->qmi_struct;
+
+	if (qmm->array_size) {
 		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, struct %1$s_%4$s *val, size_t count);\n",
 			    package, message, member, qs->name);
 
-		fprintf(fp, "struct %1$s_%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, size_t *count);\n\n",
+		fprintf(fp, "struct %1$s_%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, size_t *count);\n",
+			    package, message, member, qs->name);
+
+		fprintf(fp, "struct %1$s_%4$s_span %1$s_%2$s_get_%3$s_view(struct %1$s_%2$s *%2$s);\n\n",
 			    package, message, member, qs->name);
 	} else {
 		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, struct %1$s_%4$s *val);\n",
@@ -45,25 +91,31 @@ static void qmi_struct_emit_prototype(FILE *fp,
 static void qmi_struct_emit_accessors(FILE *fp,
 			       const char *package,
 			       const char *message,
-			       const char *member,
-			       int member_id,
-			       unsigned array_size,
-			       struct qmi_struct *qs)
+			       struct qmi_message_member *qmm,
+			       unsigned flags)
 {
-	if (array_size) {
-		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, struct %1$s_%4$s *val, size_t count)\n"
+	const char *storage = accessor_storage(flags);
+	const char *get_array = accessor_get_array(flags);
+	const char *get = accessor_get(flags);
+	const char *member = qmm->name;
+	struct qmi_struct *qs = qmm->qmi_struct;
+	unsigned len_size = message_array_len_size(qmm);
+	int member_id = qmm->id;
+
+	if (qmm->array_size) {
+		fprintf(fp, "%7$sint %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, struct %1$s_%4$s *val, size_t count)\n"
 			    "{\n"
 			    "	return qmi_tlv_set_array((struct qmi_tlv*)%2$s, %5$d, %6$d, val, count, sizeof(struct %1$s_%4$s));\n"
 			    "}\n\n",
-			    package, message, member, qs->name, member_id, array_size);
+			    package, message, member, qs->name, member_id, len_size, storage);
 
-		fprintf(fp, "struct %1$s_%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, size_t *count)\n"
+		fprintf(fp, "%7$sstruct %1$s_%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, size_t *count)\n"
 			    "{\n"
 			    "	size_t size;\n"
 			    "	size_t len;\n"
 			    "	void *ptr;\n"
 			    "\n"
-			    "	ptr = qmi_tlv_get_array((struct qmi_tlv*)%2$s, %5$d, %6$d, &len, &size);\n"
+			    "	ptr = %8$s((struct qmi_tlv*)%2$s, %5$d, %6$d, &len, &size);\n"
 			    "	if (!ptr)\n"
 			    "		return NULL;\n"
 			    "\n"
@@ -73,20 +125,37 @@ static void qmi_struct_emit_accessors(FILE *fp,
 			    "	*count = len;\n"
 			    "	return ptr;\n"
 			    "}\n\n",
-			    package, message, member, qs->name, member_id, array_size);
+			    package, message, member, qs->name, member_id, len_size, storage, get_array);
+
+		fprintf(fp, "%7$sstruct %1$s_%4$s_span %1$s_%2$s_get_%3$s_view(struct %1$s_%2$s *%2$s)\n"
+			    "{\n"
+			    "	struct %1$s_%4$s_span span = {};\n"
+			    "	size_t size;\n"
+			    "	size_t len;\n"
+			    "	void *ptr;\n"
+			    "\n"
+			    "	ptr = %8$s((struct qmi_tlv*)%2$s, %5$d, %6$d, &len, &size);\n"
+			    "	if (ptr && (!len || size == sizeof(struct %1$s_%4$s))) {\n"
+			    "		span.ptr = ptr;\n"
+			    "		span.len = len;\n"
+			    "	}\n"
+			    "\n"
+			    "	return span;\n"
+			    "}\n\n",
+			    package, message, member, qs->name, member_id, len_size, storage, get_array);
 	} else {
-		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, struct %1$s_%4$s *val)\n"
+		fprintf(fp, "%6$sint %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, struct %1$s_%4$s *val)\n"
 			    "{\n"
 			    "	return qmi_tlv_set((struct qmi_tlv*)%2$s, %5$d, val, sizeof(struct %1$s_%4$s));\n"
 			    "}\n\n",
-			    package, message, member, qs->name, member_id);
+			    package, message, member, qs->name, member_id, storage);
 
-		fprintf(fp, "struct %1$s_%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s)\n"
+		fprintf(fp, "%6$sstruct %1$s_%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s)\n"
 			    "{\n"
 			    "	size_t len;\n"
 			    "	void *ptr;\n"
 			    "\n"
-			    "	ptr = qmi_tlv_get((struct qmi_tlv*)%2$s, %5$d, &len);\n"
+			    "	ptr = %7$s((struct qmi_tlv*)%2$s, %5$d, &len);\n"
 			    "	if (!ptr)\n"
 			    "		return NULL;\n"
 			    "\n"
@@ -95,7 +164,7 @@ static void qmi_struct_emit_accessors(FILE *fp,
 			    "\n"
 			    "	return ptr;\n"
 			    "}\n\n",
-			    package, message, member, qs->name, member_id);
+			    package, message, member, qs->name, member_id, storage, get);
 	}
 }
 
@@ -106,6 +175,16 @@ static void qmi_message_emit_message_type(FILE *fp,
 	fprintf(fp, "struct %s_%s;\n", package, message);
 }
 
+static void qmi_message_emit_view_type(FILE *fp,
+				       const char *package,
+				       const char *message)
+{
+	fprintf(fp, "struct %1$s_%2$s_view {\n"
+		    "	struct qmi_tlv tlv;\n"
+		    "};\n\n",
+		    package, message);
+}
+
 static void qmi_message_emit_message_prototype(FILE *fp,
 					       const char *package,
 					       const char *message)
@@ -118,9 +197,15 @@ static void qmi_message_emit_message_prototype(FILE *fp,
 	fprintf(fp, "struct %1$s_%2$s *%1$s_%2$s_alloc(unsigned txn);\n",
 		    package, message);
 
+	fprintf(fp, "struct %1$s_%2$s *%1$s_%2$s_init_buf(void *buf, size_t cap, unsigned txn);\n",
+		    package, message);
+
 	fprintf(fp, "struct %1$s_%2$s *%1$s_%2$s_parse(void *buf, size_t len, unsigned *txn);\n",
 		    package, message);
 
+	fprintf(fp, "struct %1$s_%2$s *%1$s_%2$s_parse_into(struct %1$s_%2$s_view *view, const void *buf, size_t len, unsigned *txn);\n",
+		    package, message);
+
 	fprintf(fp, "void *%1$s_%2$s_encode(struct %1$s_%2$s *%2$s, size_t *len);\n",
 		    package, message);
 
@@ -130,31 +215,46 @@ static void qmi_message_emit_message_prototype(FILE *fp,
 
 static void qmi_message_emit_message(FILE *fp,
 				     const char *package,
-				     struct qmi_message *qm)
+				     struct qmi_message *qm,
+				     unsigned flags)
 {
-	fprintf(fp, "struct %1$s_%2$s *%1$s_%2$s_alloc(unsigned txn)\n"
+	const char *storage = accessor_storage(flags);
+
+	fprintf(fp, "%5$sstruct %1$s_%2$s *%1$s_%2$s_alloc(unsigned txn)\n"
 		    "{\n"
 		    "	return (struct %1$s_%2$s*)qmi_tlv_init(txn, %3$d, %4$d);\n"
 		    "}\n\n",
-		    package, qm->name, qm->msg_id, qm->type);
+		    package, qm->name, qm->msg_id, qm->type, storage);
 
-	fprintf(fp, "struct %1$s_%2$s *%1$s_%2$s_parse(void *buf, size_t len, unsigned *txn)\n"
+	fprintf(fp, "%5$sstruct %1$s_%2$s *%1$s_%2$s_init_buf(void *buf, size_t cap, unsigned txn)\n"
+		    "{\n"
+		    "	return (struct %1$s_%2$s*)qmi_tlv_init_buf(buf, cap, txn, %3$d, %4$d);\n"
+		    "}\n\n",
+		    package, qm->name, qm->msg_id, qm->type, storage);
+
+	fprintf(fp, "%4$sstruct %1$s_%2$s *%1$s_%2$s_parse(void *buf, size_t len, unsigned *txn)\n"
 		    "{\n"
 		    "	return (struct %1$s_%2$s*)qmi_tlv_decode(buf, len, txn, %3$d);\n"
 		    "}\n\n",
-		    package, qm->name, qm->type);
+		    package, qm->name, qm->type, storage);
+
+	fprintf(fp, "%4$sstruct %1$s_%2$s *%1$s_%2$s_parse_into(struct %1$s_%2$s_view *view, const void *buf, size_t len, unsigned *txn)\n"
+		    "{\n"
+		    "	return (struct %1$s_%2$s*)qmi_tlv_decode_into(&view->tlv, buf, len, txn, %3$d);\n"
+		    "}\n\n",
+		    package, qm->name, qm->type, storage);
 
-	fprintf(fp, "void *%1$s_%2$s_encode(struct %1$s_%2$s *%2$s, size_t *len)\n"
+	fprintf(fp, "%3$svoid *%1$s_%2$s_encode(struct %1$s_%2$s *%2$s, size_t *len)\n"
 		    "{\n"
 		    "	return qmi_tlv_encode((struct qmi_tlv*)%2$s, len);\n"
 		    "}\n\n",
-		    package, qm->name);
+		    package, qm->name, storage);
 
-	fprintf(fp, "void %1$s_%2$s_free(struct %1$s_%2$s *%2$s)\n"
+	fprintf(fp, "%3$svoid %1$s_%2$s_free(struct %1$s_%2$s *%2$s)\n"
 		    "{\n"
 		    "	qmi_tlv_free((struct qmi_tlv*)%2$s);\n"
 		    "}\n\n",
-		    package, qm->name);
+		    package, qm->name, storage);
 }
 
 static void qmi_message_emit_simple_prototype(FILE *fp,
@@ -166,8 +266,11 @@ static void qmi_message_emit_simple_prototype(FILE *fp,
 		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, %4$s *val, size_t count);\n",
 			    package, message, qmm->name, sz_simple_types[qmm->type]);
 
-		fprintf(fp, "%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, size_t *count);\n\n",
+		fprintf(fp, "%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, size_t *count);\n",
 			    package, message, qmm->name, sz_simple_types[qmm->type]);
+
+		fprintf(fp, "struct %4$s %1$s_%2$s_get_%3$s_view(struct %1$s_%2$s *%2$s);\n\n",
+			    package, message, qmm->name, span_types[qmm->type]);
 	} else {
 		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, %4$s val);\n",
 			    package, message, qmm->name, sz_simple_types[qmm->type]);
@@ -181,22 +284,29 @@ static void qmi_message_emit_simple_prototype(FILE *fp,
 static void qmi_message_emit_simple_accessors(FILE *fp,
 					      const char *package,
 					      const char *message,
-					      struct qmi_message_member *qmm)
+					      struct qmi_message_member *qmm,
+					      unsigned flags)
 {
+	const char *storage = accessor_storage(flags);
+	const char *get_array = accessor_get_array(flags);
+	const char *get = accessor_get(flags);
+	unsigned len_size = message_array_len_size(qmm);
+
 	if (qmm->array_size) {
-		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, %4$s *val, size_t count)\n"
+		fprintf(fp, "%7$sint %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, %4$s *val, size_t count)\n"
 			    "{\n"
 			    "	return qmi_tlv_set_array((struct qmi_tlv*)%2$s, %5$d, %6$d, val, count, sizeof(%4$s));\n"
 			    "}\n\n",
-			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id, qmm->array_size);
+			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id, len_size,
+			    storage);
 
-		fprintf(fp, "%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, size_t *count)\n"
+		fprintf(fp, "%7$s%4$s *%1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, size_t *count)\n"
 			    "{\n"
 			    "	%4$s *ptr;\n"
 			    "	size_t size;\n"
 			    "	size_t len;\n"
 			    "\n"
-			    "	ptr = qmi_tlv_get_array((struct qmi_tlv*)%2$s, %5$d, %6$d, &len, &size);\n"
+			    "	ptr = %8$s((struct qmi_tlv*)%2$s, %5$d, %6$d, &len, &size);\n"
 			    "	if (!ptr)\n"
 			    "		return NULL;\n"
 			    "\n"
@@ -206,30 +316,51 @@ static void qmi_message_emit_simple_accessors(FILE *fp,
 			    "	*count = len;\n"
 			    "	return ptr;\n"
 			    "}\n\n",
-			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id, qmm->array_size);
+			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id, len_size,
+			    storage, get_array);
+
+		fprintf(fp, "%8$sstruct %7$s %1$s_%2$s_get_%3$s_view(struct %1$s_%2$s *%2$s)\n"
+			    "{\n"
+			    "	struct %7$s span = {};\n"
+			    "	size_t size;\n"
+			    "	size_t len;\n"
+			    "	void *ptr;\n"
+			    "\n"
+			    "	ptr = %9$s((struct qmi_tlv*)%2$s, %5$d, %6$d, &len, &size);\n"
+			    "	if (ptr && (!len || size == sizeof(%4$s))) {\n"
+			    "		span.ptr = ptr;\n"
+			    "		span.len = len;\n"
+			    "	}\n"
+			    "\n"
+			    "	return span;\n"
+			    "}\n\n",
+			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id, len_size,
+			    span_types[qmm->type], storage, get_array);
 	} else {
-		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, %4$s val)\n"
+		fprintf(fp, "%6$sint %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, %4$s val)\n"
 			    "{\n"
 			    "	return qmi_tlv_set((struct qmi_tlv*)%2$s, %5$d, &val, sizeof(%4$s));\n"
 			    "}\n\n",
-			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id);
+			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id, storage);
 
-		fprintf(fp, "int %1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, %4$s *val)\n"
+		fprintf(fp, "%6$sint %1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, %4$s *val)\n"
 			    "{\n"
 			    "	%4$s *ptr;\n"
 			    "	size_t len;\n"
 			    "\n"
-			    "	ptr = qmi_tlv_get((struct qmi_tlv*)%2$s, %5$d, &len);\n"
+			    "	ptr = %7$s((struct qmi_tlv*)%2$s, %5$d, &len);\n"
 			    "	if (!ptr)\n"
 			    "		return -ENOENT;\n"
 			    "\n"
 			    "	if (len != sizeof(%4$s))\n"
 			    "		return -EINVAL;\n"
 			    "\n"
-			    "	*val = *(%4$s*)ptr;\n"
+			    "	/* Items aren't aligned in the message */\n"
+			    "	memcpy(val, ptr, sizeof(*val));\n"
 			    "	return 0;\n"
 			    "}\n\n",
-			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id);
+			    package, message, qmm->name, sz_simple_types[qmm->type], qmm->id,
+			    storage, get);
 	}
 }
 
@@ -238,35 +369,46 @@ static void qmi_message_emit_string_prototype(FILE *fp,
 					      const char *message,
 					      struct qmi_message_member *qmm)
 {
-	if (qmm->array_size) {
-		fprintf(stderr, "Dont' know how to encode string arrays yet");
-		exit(1);
-	} else {
-		fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, char *buf, size_t len);\n",
-			    package, message, qmm->name);
+	fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, char *buf, size_t len);\n",
+		    package, message, qmm->name);
 
-		fprintf(fp, "int %1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, char *buf, size_t buflen);\n\n",
-			    package, message, qmm->name);
-	}
+	fprintf(fp, "int %1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, char *buf, size_t buflen);\n",
+		    package, message, qmm->name);
+
+	fprintf(fp, "struct qmi_strview %1$s_%2$s_get_%3$s_view(struct %1$s_%2$s *%2$s);\n\n",
+		    package, message, qmm->name);
 }
 
 static void qmi_message_emit_string_accessors(FILE *fp,
 					      const char *package,
 					      const char *message,
-					      struct qmi_message_member *qmm)
+					      struct qmi_message_member *qmm,
+					      unsigned flags)
 {
-	fprintf(fp, "int %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, char *buf, size_t len)\n"
-		    "{\n"
-		    "	return qmi_tlv_set((struct qmi_tlv*)%2$s, %4$d, buf, len);\n"
+	const char *storage = accessor_storage(flags);
+	const char *get = accessor_get(flags);
+
+	fprintf(fp, "%4$sint %1$s_%2$s_set_%3$s(struct %1$s_%2$s *%2$s, char *buf, size_t len)\n"
+		    "{\n",
+		    package, message, qmm->name, storage);
+
+	/* Enforce the declared maximum length, if any */
+	if (qmm->array_size)
+		fprintf(fp, "	if (len > %u)\n"
+			    "		return -EINVAL;\n"
+			    "\n",
+			    qmm->array_size);
+
+	fprintf(fp, "	return qmi_tlv_set((struct qmi_tlv*)%1$s, %2$d, buf, len);\n"
 		    "}\n\n",
-		    package, message, qmm->name, qmm->id);
+		    message, qmm->id);
 
-	fprintf(fp, "int %1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, char *buf, size_t buflen)\n"
+	fprintf(fp, "%5$sint %1$s_%2$s_get_%3$s(struct %1$s_%2$s *%2$s, char *buf, size_t buflen)\n"
 		    "{\n"
 		    "	size_t len;\n"
 		    "	char *ptr;\n"
 		    "\n"
-		    "	ptr = qmi_tlv_get((struct qmi_tlv*)%2$s, %4$d, &len);\n"
+		    "	ptr = %6$s((struct qmi_tlv*)%2$s, %4$d, &len);\n"
 		    "	if (!ptr)\n"
 		    "		return -ENOENT;\n"
 		    "\n"
@@ -277,17 +419,40 @@ static void qmi_message_emit_string_accessors(FILE *fp,
 		    "	buf[len] = '\\0';\n"
 		    "	return len;\n"
 		    "}\n\n",
-		    package, message, qmm->name, qmm->id);
+		    package, message, qmm->name, qmm->id, storage, get);
+
+	fprintf(fp, "%5$sstruct qmi_strview %1$s_%2$s_get_%3$s_view(struct %1$s_%2$s *%2$s)\n"
+		    "{\n"
+		    "	struct qmi_strview view = {};\n"
+		    "	size_t len;\n"
+		    "	char *ptr;\n"
+		    "\n"
+		    "	ptr = %6$s((struct qmi_tlv*)%2$s, %4$d, &len);\n"
+		    "	if (ptr) {\n"
+		    "		view.ptr = ptr;\n"
+		    "		view.len = len;\n"
+		    "	}\n"
+		    "\n"
+		    "	return view;\n"
+		    "}\n\n",
+		    package, message, qmm->name, qmm->id, storage, get);
 
 }
 
-static void qmi_message_source(FILE *fp, const char *package)
+static void qmi_message_source(struct qmi_ctx *ctx, FILE *fp, const char *package,
+			       unsigned flags)
 {
 	struct qmi_message_member *qmm;
 	struct qmi_message *qm;
 
-	list_for_each_entry(qm, &qmi_messages, node) {
-		qmi_message_emit_message(fp, package, qm);
+	fprintf(fp, "%2$svoid %1$s_pool_init(void)\n"
+		    "{\n"
+		    "	qmi_tlv_pool_init();\n"
+		    "}\n\n",
+		    package, accessor_storage(flags));
+
+	list_for_each_entry(qm, &ctx->messages, node) {
+		qmi_message_emit_message(fp, package, qm, flags);
 
 		list_for_each_entry(qmm, &qm->members, node) {
 			switch (qmm->type) {
@@ -295,30 +460,54 @@ static void qmi_message_source(FILE *fp, const char *package)
 			case TYPE_U16:
 			case TYPE_U32:
 			case TYPE_U64:
-				qmi_message_emit_simple_accessors(fp, package, qm->name, qmm);
+				qmi_message_emit_simple_accessors(fp, package, qm->name, qmm, flags);
 				break;
 			case TYPE_STRING:
-				qmi_message_emit_string_accessors(fp, package, qm->name, qmm);
+				qmi_message_emit_string_accessors(fp, package, qm->name, qmm, flags);
 				break;
 			case TYPE_STRUCT:
-				qmi_struct_emit_accessors(fp, package, qm->name, qmm->name, qmm->id, qmm->array_size, qmm->qmi_struct);
+				qmi_struct_emit_accessors(fp, package, qm->name, qmm, flags);
 				break;
 			};
 		}
 	}
 }
 
-static void qmi_message_header(FILE *fp, const char *package)
+static void qmi_message_header(struct qmi_ctx *ctx, FILE *fp, const char *package,
+			       unsigned flags)
 {
 	struct qmi_message_member *qmm;
 	struct qmi_message *qm;
 
-	list_for_each_entry(qm, &qmi_messages, node)
+	list_for_each_entry(qm, &ctx->messages, node)
 		qmi_message_emit_message_type(fp, package, qm->name);
 
 	fprintf(fp, "\n");
 
-	list_for_each_entry(qm, &qmi_messages, node) {
+	fprintf(fp, "/*\n"
+		    " * Caller provided storage for parsing a message with _parse_into(), which\n"
+		    " * does not allocate. The parsed message refers to the received buffer and\n"
+		    " * can't be modified; freeing it is a no-op.\n"
+		    " */\n");
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		qmi_message_emit_view_type(fp, package, qm->name);
+
+	fprintf(fp, "/*\n"
+		    " * Recycle messages and their buffers through per-thread pools. The pools\n"
+		    " * are shared by all packages, so this enables them for the whole process;\n"
+		    " * each thread's cache is released when it exits or by qmi_tlv_pool_flush().\n"
+		    " */\n");
+
+	/* The accessors themselves, rather than their prototypes */
+	if (flags & ACCESSOR_INLINE) {
+		qmi_message_source(ctx, fp, package, flags);
+		return;
+	}
+
+	fprintf(fp, "void %s_pool_init(void);\n\n", package);
+
+	list_for_each_entry(qm, &ctx->messages, node) {
 		qmi_message_emit_message_prototype(fp, package, qm->name);
 
 		list_for_each_entry(qmm, &qm->members, node) {
@@ -333,43 +522,97 @@ static void qmi_message_header(FILE *fp, const char *package)
 				qmi_message_emit_string_prototype(fp, package, qm->name, qmm);
 				break;
 			case TYPE_STRUCT:
-				qmi_struct_emit_prototype(fp, package, qm->name, qmm->name, qmm->array_size, qmm->qmi_struct);
+				qmi_struct_emit_prototype(fp, package, qm->name, qmm);
 				break;
 			};
 		}
 	}
 }
 
-static void emit_header_file_header(FILE *fp)
+/*
+ * qmi_tlv_get() and qmi_tlv_get_array() for the static inline accessors, so
+ * that looking up an item of a known type compiles down to a few loads
+ */
+static void emit_tlv_inline(FILE *fp)
 {
-	fprintf(fp, "#include <stdint.h>\n"
-		    "#include <stdlib.h>\n\n");
-	fprintf(fp, "struct qmi_tlv;\n"
+	fprintf(fp, "#ifndef QMI_TLV_INLINE_DEFINED\n"
+		    "#define QMI_TLV_INLINE_DEFINED\n"
+		    "static inline void *qmi_tlv_get_inline(struct qmi_tlv *tlv, unsigned id, size_t *len)\n"
+		    "{\n"
+		    "	struct qmi_tlv_header *hdr;\n"
+		    "\n"
+		    "	if (id > UINT8_MAX || !tlv->index[id])\n"
+		    "		return NULL;\n"
 		    "\n"
-		    "struct qmi_tlv *qmi_tlv_init(unsigned txn, unsigned msg_id, unsigned type);\n"
-		    "struct qmi_tlv *qmi_tlv_decode(void *buf, size_t len, unsigned *txn, unsigned type);\n"
-		    "void *qmi_tlv_encode(struct qmi_tlv *tlv, size_t *len);\n"
-		    "void qmi_tlv_free(struct qmi_tlv *tlv);\n"
+		    "	hdr = (void *)((uint8_t *)tlv->buf + sizeof(struct qmi_header) + tlv->index[id] - 1);\n"
+		    "\n"
+		    "	*len = hdr->len;\n"
+		    "	return hdr->data;\n"
+		    "}\n"
+		    "\n"
+		    "static inline void *qmi_tlv_get_array_inline(struct qmi_tlv *tlv, unsigned id, unsigned len_size, size_t *len, size_t *size)\n"
+		    "{\n"
+		    "	uint16_t count16;\n"
+		    "	size_t item_len;\n"
+		    "	unsigned count;\n"
+		    "	uint8_t *ptr;\n"
 		    "\n"
-		    "void *qmi_tlv_get(struct qmi_tlv *tlv, unsigned id, size_t *len);\n"
-		    "void *qmi_tlv_get_array(struct qmi_tlv *tlv, unsigned id, unsigned len_size, size_t *len, size_t *size);\n"
-		    "int qmi_tlv_set(struct qmi_tlv *tlv, unsigned id, void *buf, size_t len);\n"
-		    "int qmi_tlv_set_array(struct qmi_tlv *tlv, unsigned id, unsigned len_size, void *buf, size_t len, size_t size);\n"
+		    "	ptr = qmi_tlv_get_inline(tlv, id, &item_len);\n"
+		    "	if (!ptr)\n"
+		    "		return NULL;\n"
+		    "\n"
+		    "	if (len_size == 2) {\n"
+		    "		if (item_len < sizeof(uint16_t))\n"
+		    "			return NULL;\n"
+		    "		memcpy(&count16, ptr, sizeof(count16));\n"
+		    "		count = count16;\n"
+		    "	} else {\n"
+		    "		if (item_len < sizeof(uint8_t))\n"
+		    "			return NULL;\n"
+		    "		count = *ptr;\n"
+		    "		len_size = 1;\n"
+		    "	}\n"
+		    "\n"
+		    "	*len = count;\n"
+		    "	*size = count ? (item_len - len_size) / count : 0;\n"
+		    "\n"
+		    "	return ptr + len_size;\n"
+		    "}\n"
+		    "#endif\n"
+		    "\n");
+}
+
+static void emit_header_file_header(FILE *fp, unsigned flags)
+{
+	if (flags & ACCESSOR_INLINE)
+		fprintf(fp, "#include <errno.h>\n");
+	fprintf(fp, "#include <stdint.h>\n"
+		    "#include <stdlib.h>\n"
+		    "#include <string.h>\n\n");
+
+	/* struct qmi_tlv and its runtime are shared by all packages */
+	fprintf(fp, "#include \"qmi_tlv.h\"\n"
 		    "\n");
+
+	if (flags & ACCESSOR_INLINE)
+		emit_tlv_inline(fp);
 }
 
-void accessor_emit_c(FILE *fp, const char *package)
+void accessor_emit_c(struct qmi_ctx *ctx, FILE *fp, const char *package, unsigned flags)
 {
 	emit_source_includes(fp, package);
-	qmi_message_source(fp, package);
+
+	/* Everything is in the header */
+	if (!(flags & ACCESSOR_INLINE))
+		qmi_message_source(ctx, fp, package, flags);
 }
 	
-void accessor_emit_h(FILE *fp, const char *package)
+void accessor_emit_h(struct qmi_ctx *ctx, FILE *fp, const char *package, unsigned flags)
 {
-	guard_header(fp, qmi_package.name);
-	emit_header_file_header(fp);
-	qmi_const_header(fp);
-	qmi_struct_header(fp, qmi_package.name);
-	qmi_message_header(fp, qmi_package.name);
+	guard_header(fp, ctx->package.name);
+	emit_header_file_header(fp, flags);
+	qmi_const_header(ctx, fp);
+	qmi_struct_header(ctx, fp, ctx->package.name);
+	qmi_message_header(ctx, fp, ctx->package.name, flags);
 	guard_footer(fp);
 }
@@ -0,0 +1,74 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qmic.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+/*
+ * Hand out @size bytes of zeroed memory from the arena, which lives until
+ * arena_free(). Allocations are carved sequentially out of large chunks;
+ * requests which wouldn't leave much of a chunk for others get a chunk of
+ * their own.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	size_t chunk_size;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk_size = ARENA_CHUNK_SIZE - sizeof(struct arena_chunk);
+		if (size > chunk_size / 4)
+			chunk_size = size;
+
+		chunk = memalloc(sizeof(struct arena_chunk) + chunk_size);
+		chunk->size = chunk_size;
+
+		/* Keep filling the current chunk if the new one is dedicated */
+		if (chunk_size == size && arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+
+	p = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+
+	return p;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return memcpy(arena_alloc(arena, len), str, len);
+}
+
+void arena_free(struct arena *arena)
+{
+	struct arena_chunk *next;
+	struct arena_chunk *chunk;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	arena->chunks = NULL;
+}
@@ -0,0 +1,680 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qmic.h"
+
+/*
+ * Micro-benchmark harness for the generated code
+ *
+ * qmi_<pkg>_bench.c fills every message of the package with random, but
+ * valid, data and times the steps of building and taking apart each of
+ * them, reporting the average cost of each step and the size of the encoded
+ * message. It takes the number of iterations and a random seed as optional
+ * arguments. For the accessor style a third argument of "pool" enables the
+ * message pools of the runtime.
+ */
+
+#define BENCH_ITERATIONS 100000
+
+static void emit_bench_helpers(FILE *fp, const char *package)
+{
+	fprintf(fp, "#include <errno.h>\n"
+		    "#include <stdint.h>\n"
+		    "#include <stdio.h>\n"
+		    "#include <stdlib.h>\n"
+		    "#include <string.h>\n"
+		    "#include <time.h>\n"
+		    "#include \"qmi_%1$s.h\"\n"
+		    "\n",
+		    package);
+
+	fprintf(fp, "static uint64_t bench_state = 0x9e3779b97f4a7c15ull;\n"
+		    "static volatile size_t bench_sink;\n"
+		    "\n"
+		    "/* xorshift64, good enough for test data */\n"
+		    "static uint64_t bench_rand(void)\n"
+		    "{\n"
+		    "	bench_state ^= bench_state << 13;\n"
+		    "	bench_state ^= bench_state >> 7;\n"
+		    "	bench_state ^= bench_state << 17;\n"
+		    "\n"
+		    "	return bench_state;\n"
+		    "}\n"
+		    "\n"
+		    "static void bench_fill(void *buf, size_t len)\n"
+		    "{\n"
+		    "	uint8_t *p = buf;\n"
+		    "\n"
+		    "	while (len--)\n"
+		    "		*p++ = bench_rand();\n"
+		    "}\n"
+		    "\n"
+		    "/*\n"
+		    " * Fill @buf with a random string shorter than @size, returning its length;\n"
+		    " * not every IDL has strings\n"
+		    " */\n"
+		    "static __attribute__((unused)) size_t bench_fill_string(char *buf, size_t size)\n"
+		    "{\n"
+		    "	size_t len = bench_rand() %% size;\n"
+		    "	size_t i;\n"
+		    "\n"
+		    "	for (i = 0; i < len; i++)\n"
+		    "		buf[i] = 'a' + bench_rand() %% 26;\n"
+		    "	buf[len] = '\\0';\n"
+		    "\n"
+		    "	return len;\n"
+		    "}\n"
+		    "\n"
+		    "static uint64_t bench_now(void)\n"
+		    "{\n"
+		    "	struct timespec ts;\n"
+		    "\n"
+		    "	clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+		    "\n"
+		    "	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;\n"
+		    "}\n"
+		    "\n"
+		    "static void bench_fail(const char *message, const char *step)\n"
+		    "{\n"
+		    "	fprintf(stderr, \"%%s: %%s failed\\n\", message, step);\n"
+		    "	exit(1);\n"
+		    "}\n"
+		    "\n");
+}
+
+static void emit_bench_main(struct qmi_ctx *ctx, FILE *fp, const char *columns,
+			    bool pool)
+{
+	struct qmi_message *qm;
+
+	fprintf(fp, "int main(int argc, char **argv)\n"
+		    "{\n"
+		    "	unsigned iterations = %1$u;\n"
+		    "\n"
+		    "	if (argc > 1)\n"
+		    "		iterations = strtoul(argv[1], NULL, 0);\n"
+		    "	if (argc > 2)\n"
+		    "		bench_state = strtoull(argv[2], NULL, 0) | 1;\n"
+		    "	if (!iterations)\n"
+		    "		iterations = 1;\n",
+		    BENCH_ITERATIONS);
+
+	if (pool)
+		fprintf(fp, "	if (argc > 3 && !strcmp(argv[3], \"pool\"))\n"
+			    "		%s_pool_init();\n",
+			    ctx->package.name);
+
+	fprintf(fp, "\n"
+		    "	printf(\"%s\\n\");\n",
+		    columns);
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		fprintf(fp, "	bench_%s_%s(iterations);\n", ctx->package.name, qm->name);
+
+	fprintf(fp, "\n"
+		    "	return 0;\n"
+		    "}\n");
+}
+
+/*
+ * Accessor style
+ *
+ * There's no C representation of the messages, so the values to set are
+ * generated up front into static variables named after the members. The
+ * steps are timed over batches of messages, so that each timed loop only
+ * does the one step.
+ */
+
+#define BENCH_BATCH 64
+
+static bool accessor_member_supported(struct qmi_message_member *qmm)
+{
+	switch (qmm->type) {
+	case TYPE_U8:
+	case TYPE_U16:
+	case TYPE_U32:
+	case TYPE_U64:
+	case TYPE_STRUCT:
+		return true;
+	case TYPE_STRING:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void accessor_member_type(struct qmi_ctx *ctx, char *buf, size_t len,
+				 struct qmi_message_member *qmm)
+{
+	if (qmm->type == TYPE_STRUCT)
+		snprintf(buf, len, "struct %s_%s", ctx->package.name, qmm->qmi_struct->name);
+	else
+		snprintf(buf, len, "%s", sz_simple_types[qmm->type]);
+}
+
+static void emit_accessor_values(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+	unsigned count;
+	char type[256];
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		if (!accessor_member_supported(qmm))
+			continue;
+
+		accessor_member_type(ctx, type, sizeof(type), qmm);
+		if (qmm->type == TYPE_STRING)
+			fprintf(fp, "	static char v_%1$s[%2$u];\n"
+				    "	static char o_%1$s[%2$u];\n"
+				    "	static size_t v_%1$s_len;\n",
+				    qmm->name, message_string_elem_len(qmm));
+		else if (qmm->array_size)
+			fprintf(fp, "	static %2$s v_%1$s[%3$u];\n"
+				    "	static size_t v_%1$s_len;\n",
+				    qmm->name, type, qmm->array_size);
+		else
+			fprintf(fp, "	static %2$s v_%1$s;\n", qmm->name, type);
+	}
+
+	fprintf(fp, "	static struct %1$s_%2$s *msgs[%3$u];\n"
+		    "	static struct %1$s_%2$s *parsed[%3$u];\n"
+		    "	static struct %1$s_%2$s_view views[%3$u];\n"
+		    "	static void *bufs[%3$u];\n"
+		    "	static size_t lens[%3$u];\n"
+		    "	uint64_t t[6] = {};\n"
+		    "	uint64_t start;\n"
+		    "	unsigned txn;\n"
+		    "	unsigned n;\n"
+		    "	unsigned i;\n",
+		    ctx->package.name, qm->name, BENCH_BATCH);
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		if (accessor_member_supported(qmm) &&
+		    qmm->type != TYPE_STRING && qmm->array_size) {
+			fprintf(fp, "	size_t len;\n"
+				    "	void *ptr;\n");
+			break;
+		}
+	}
+	fprintf(fp, "\n");
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		if (!accessor_member_supported(qmm))
+			continue;
+
+		if (qmm->type == TYPE_STRING) {
+			fprintf(fp, "	v_%1$s_len = bench_fill_string(v_%1$s, sizeof(v_%1$s));\n",
+				qmm->name);
+		} else if (qmm->array_size) {
+			/* The element count is encoded in a single byte */
+			count = qmm->array_size < 255 ? qmm->array_size : 255;
+			fprintf(fp, "	v_%1$s_len = bench_rand() %% %2$u;\n"
+				    "	bench_fill(v_%1$s, sizeof(v_%1$s));\n",
+				    qmm->name, count + 1);
+		} else {
+			fprintf(fp, "	bench_fill(&v_%1$s, sizeof(v_%1$s));\n", qmm->name);
+		}
+	}
+	fprintf(fp, "\n");
+}
+
+/* Each step is timed separately, over the whole batch of messages */
+static void emit_accessor_step_begin(FILE *fp)
+{
+	fprintf(fp, "		start = bench_now();\n"
+		    "		for (i = 0; i < %u; i++) {\n",
+		    BENCH_BATCH);
+}
+
+static void emit_accessor_step_end(FILE *fp, int step)
+{
+	fprintf(fp, "		}\n"
+		    "		t[%d] += bench_now() - start;\n"
+		    "\n",
+		    step);
+}
+
+static void emit_accessor_bench(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+	const char *package = ctx->package.name;
+
+	fprintf(fp, "static void bench_%1$s_%2$s(unsigned iterations)\n"
+		    "{\n",
+		    package, qm->name);
+
+	emit_accessor_values(ctx, fp, qm);
+
+	fprintf(fp, "	for (n = 0; n < iterations; n += %u) {\n", BENCH_BATCH);
+
+	/* alloc */
+	emit_accessor_step_begin(fp);
+	fprintf(fp, "			msgs[i] = %1$s_%2$s_alloc(i);\n"
+		    "			if (!msgs[i])\n"
+		    "				bench_fail(\"%2$s\", \"alloc\");\n",
+		    package, qm->name);
+	emit_accessor_step_end(fp, 0);
+
+	/* set */
+	emit_accessor_step_begin(fp);
+	list_for_each_entry(qmm, &qm->members, node) {
+		if (!accessor_member_supported(qmm))
+			continue;
+
+		if (qmm->type == TYPE_STRING || qmm->array_size)
+			fprintf(fp, "			if (%1$s_%2$s_set_%3$s(msgs[i], v_%3$s, v_%3$s_len) < 0)\n",
+				package, qm->name, qmm->name);
+		else if (qmm->type == TYPE_STRUCT)
+			fprintf(fp, "			if (%1$s_%2$s_set_%3$s(msgs[i], &v_%3$s) < 0)\n",
+				package, qm->name, qmm->name);
+		else
+			fprintf(fp, "			if (%1$s_%2$s_set_%3$s(msgs[i], v_%3$s) < 0)\n",
+				package, qm->name, qmm->name);
+		fprintf(fp, "				bench_fail(\"%s\", \"set_%s\");\n",
+			qm->name, qmm->name);
+	}
+	emit_accessor_step_end(fp, 1);
+
+	/* encode */
+	emit_accessor_step_begin(fp);
+	fprintf(fp, "			bufs[i] = %1$s_%2$s_encode(msgs[i], &lens[i]);\n"
+		    "			if (!bufs[i])\n"
+		    "				bench_fail(\"%2$s\", \"encode\");\n",
+		    package, qm->name);
+	emit_accessor_step_end(fp, 2);
+
+	/* parse */
+	emit_accessor_step_begin(fp);
+	fprintf(fp, "			parsed[i] = %1$s_%2$s_parse(bufs[i], lens[i], &txn);\n"
+		    "			if (!parsed[i])\n"
+		    "				bench_fail(\"%2$s\", \"parse\");\n",
+		    package, qm->name);
+	emit_accessor_step_end(fp, 3);
+
+	/* parse_into */
+	emit_accessor_step_begin(fp);
+	fprintf(fp, "			if (!%1$s_%2$s_parse_into(&views[i], bufs[i], lens[i], &txn))\n"
+		    "				bench_fail(\"%2$s\", \"parse_into\");\n",
+		    package, qm->name);
+	emit_accessor_step_end(fp, 5);
+
+	/* get */
+	emit_accessor_step_begin(fp);
+	list_for_each_entry(qmm, &qm->members, node) {
+		if (!accessor_member_supported(qmm))
+			continue;
+
+		if (qmm->type == TYPE_STRING)
+			fprintf(fp, "			bench_sink += %1$s_%2$s_get_%3$s(parsed[i], o_%3$s, sizeof(o_%3$s));\n",
+				package, qm->name, qmm->name);
+		else if (qmm->array_size)
+			fprintf(fp, "			ptr = %1$s_%2$s_get_%3$s(parsed[i], &len);\n"
+				    "			bench_sink += ptr ? len : 0;\n",
+				package, qm->name, qmm->name);
+		else if (qmm->type == TYPE_STRUCT)
+			fprintf(fp, "			bench_sink += !!%1$s_%2$s_get_%3$s(parsed[i]);\n",
+				package, qm->name, qmm->name);
+		else
+			fprintf(fp, "			bench_sink += !%1$s_%2$s_get_%3$s(parsed[i], &v_%3$s);\n",
+				package, qm->name, qmm->name);
+	}
+	emit_accessor_step_end(fp, 4);
+
+	fprintf(fp, "		for (i = 0; i < %3$u; i++) {\n"
+		    "			%1$s_%2$s_free(parsed[i]);\n"
+		    "			%1$s_%2$s_free(msgs[i]);\n"
+		    "		}\n"
+		    "	}\n"
+		    "\n"
+		    "	printf(\"%%-32s %%8.1f %%8.1f %%8.1f %%8.1f %%8.1f %%8.1f %%8zu\\n\", \"%2$s\",\n"
+		    "	       (double)t[0] / n, (double)t[1] / n, (double)t[2] / n,\n"
+		    "	       (double)t[3] / n, (double)t[5] / n, (double)t[4] / n, lens[0]);\n"
+		    "}\n"
+		    "\n",
+		    package, qm->name, BENCH_BATCH);
+}
+
+void bench_emit_accessor(struct qmi_ctx *ctx, FILE *fp)
+{
+	struct qmi_message *qm;
+
+	emit_bench_helpers(fp, ctx->package.name);
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		emit_accessor_bench(ctx, fp, qm);
+
+	emit_bench_main(ctx, fp, "message                             alloc      set   encode    parse     into      get    bytes (ns/op)",
+			true);
+}
+
+/*
+ * Kernel style
+ *
+ * Each message is filled once and then encoded and decoded repeatedly,
+ * through libqrtr and the qmi_elem_info tables and, when they're emitted,
+ * through the compiled encoders and decoders and the view decoders as well.
+ * The paths are checked against each other first, see tests/codec.sh.
+ */
+
+static void emit_fill_elements(struct qmi_ctx *ctx, FILE *fp, const char *expr,
+			       int type, struct qmi_struct *qs, const char *count)
+{
+	char name[256];
+
+	if (type != TYPE_STRUCT) {
+		if (count)
+			fprintf(fp, "	bench_fill(%1$s, %2$s * sizeof(%1$s[0]));\n",
+				expr, count);
+		else
+			fprintf(fp, "	bench_fill(&%1$s, sizeof(%1$s));\n", expr);
+		return;
+	}
+
+	struct_name(ctx, name, sizeof(name), qs);
+	if (count)
+		fprintf(fp, "	for (i = 0; i < %3$s; i++)\n"
+			    "		%2$s_fill(&%1$s[i]);\n",
+			expr, name, count);
+	else
+		fprintf(fp, "	%2$s_fill(&%1$s);\n", expr, name);
+}
+
+static void emit_struct_fill(struct qmi_ctx *ctx, FILE *fp, struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	bool needs_index = false;
+	char count[300];
+	char expr[256];
+	char name[256];
+
+	struct_name(ctx, name, sizeof(name), qs);
+
+	list_for_each_entry(qsm, &qs->members, node)
+		if (qsm->type == TYPE_STRUCT && (qsm->is_ptr || qsm->array_fixed))
+			needs_index = true;
+
+	fprintf(fp, "static void %1$s_fill(struct %1$s *v)\n"
+		    "{\n",
+		    name);
+	if (needs_index)
+		fprintf(fp, "	size_t i;\n"
+			    "\n");
+
+	list_for_each_entry(qsm, &qs->members, node) {
+		snprintf(expr, sizeof(expr), "v->%s", qsm->name);
+
+		if (qsm->type == TYPE_STRING) {
+			fprintf(fp, "	v->%1$s_len = bench_fill_string(v->%1$s, sizeof(v->%1$s));\n",
+				qsm->name);
+		} else if (qsm->is_ptr) {
+			fprintf(fp, "	v->%1$s_len = bench_rand() %% %2$u;\n",
+				qsm->name, qsm->array_size + 1);
+			snprintf(count, sizeof(count), "v->%s_len", qsm->name);
+			emit_fill_elements(ctx, fp, expr, qsm->type, qsm->qmi_struct, count);
+		} else if (qsm->array_fixed) {
+			snprintf(count, sizeof(count), "%u", qsm->array_size);
+			emit_fill_elements(ctx, fp, expr, qsm->type, qsm->qmi_struct, count);
+		} else {
+			emit_fill_elements(ctx, fp, expr, qsm->type, qsm->qmi_struct, NULL);
+		}
+	}
+
+	fprintf(fp, "}\n"
+		    "\n");
+}
+
+static void emit_message_fill(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+			      unsigned flags)
+{
+	struct qmi_message_member *qmm;
+	bool needs_index = false;
+	char count[300];
+	char expr[256];
+
+	list_for_each_entry(qmm, &qm->members, node)
+		if (qmm->type == TYPE_STRUCT && message_member_is_array(qmm))
+			needs_index = true;
+
+	fprintf(fp, "static void %1$s_%2$s_fill(struct %1$s_%2$s *msg)\n"
+		    "{\n",
+		    ctx->package.name, qm->name);
+	if (needs_index)
+		fprintf(fp, "	size_t i;\n"
+			    "\n");
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		snprintf(expr, sizeof(expr), "msg->%s", qmm->name);
+
+		if (message_member_is_optional(qmm))
+			emit_present_set(ctx, fp, "\t", qm, qmm, flags);
+
+		if (qmm->type == TYPE_STRING) {
+			fprintf(fp, "	msg->%1$s_len = bench_fill_string(msg->%1$s, sizeof(msg->%1$s));\n",
+				qmm->name);
+		} else if (qmm->type == TYPE_STRUCT && is_response_type(qmm->qmi_struct)) {
+			fprintf(fp, "	bench_fill(&%1$s, sizeof(%1$s));\n", expr);
+		} else if (message_member_is_array(qmm) &&
+			   qmm->array_fixed && qmm->type != TYPE_STRUCT) {
+			/* Fixed arrays are always sent in full */
+			fprintf(fp, "	msg->%1$s_len = %2$u;\n", qmm->name, qmm->array_size);
+			snprintf(count, sizeof(count), "%u", qmm->array_size);
+			emit_fill_elements(ctx, fp, expr, qmm->type, qmm->qmi_struct, count);
+		} else if (message_member_is_array(qmm)) {
+			fprintf(fp, "	msg->%1$s_len = bench_rand() %% %2$u;\n",
+				qmm->name, qmm->array_size + 1);
+			snprintf(count, sizeof(count), "msg->%s_len", qmm->name);
+			emit_fill_elements(ctx, fp, expr, qmm->type, qmm->qmi_struct, count);
+		} else {
+			emit_fill_elements(ctx, fp, expr, qmm->type, qmm->qmi_struct, NULL);
+		}
+	}
+
+	fprintf(fp, "}\n"
+		    "\n");
+}
+
+static void emit_wire_buf(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+			  const char *name)
+{
+	fprintf(fp, "	static uint8_t %s[sizeof(struct qmi_header) + ", name);
+	emit_upper(fp, ctx->package.name);
+	fprintf(fp, "_");
+	emit_upper(fp, qm->name);
+	fprintf(fp, "_MAX_WIRE_SIZE];\n");
+}
+
+/* The msg_id of the QMI header is 16 bits, whatever the IDL says */
+static unsigned wire_msg_id(struct qmi_message *qm)
+{
+	return qm->msg_id & 0xffff;
+}
+
+/*
+ * Before timing anything, check that decoding the filled message and encoding
+ * it again gives the same bytes, that input cut short is rejected and, with
+ * the ei tables, that libqrtr agrees with the compiled encoder and decoder.
+ */
+static void emit_kernel_check(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+			      unsigned flags)
+{
+	const char *package = ctx->package.name;
+	bool ei = !(flags & (KERNEL_MASK | KERNEL_CONST));
+
+	fprintf(fp, "static void check_%1$s_%2$s(const struct %1$s_%2$s *msg)\n"
+		    "{\n",
+		    package, qm->name);
+	emit_wire_buf(ctx, fp, qm, "buf");
+	emit_wire_buf(ctx, fp, qm, "again");
+	fprintf(fp, "	static struct %1$s_%2$s out;\n",
+		package, qm->name);
+	if (flags & KERNEL_VIEW)
+		fprintf(fp, "	static struct %1$s_%2$s_view view;\n",
+			package, qm->name);
+	if (ei)
+		fprintf(fp, "	struct qrtr_packet pkt;\n");
+	fprintf(fp, "	int len;\n"
+		    "\n"
+		    "	len = %1$s_%2$s_encode(msg, buf, sizeof(buf));\n"
+		    "	if (len < 0)\n"
+		    "		bench_fail(\"%2$s\", \"encode\");\n"
+		    "\n"
+		    "	memset(&out, 0, sizeof(out));\n"
+		    "	if (%1$s_%2$s_decode(&out, buf, len) < 0 ||\n"
+		    "	    %1$s_%2$s_encode(&out, again, sizeof(again)) != len ||\n"
+		    "	    memcmp(buf, again, len))\n"
+		    "		bench_fail(\"%2$s\", \"decode and encode again\");\n"
+		    "\n"
+		    "	/* Cut short within the last TLV */\n"
+		    "	if (len && %1$s_%2$s_decode(&out, buf, len - 1) != -EINVAL)\n"
+		    "		bench_fail(\"%2$s\", \"decode of truncated input\");\n",
+		    package, qm->name);
+
+	if (flags & KERNEL_VIEW)
+		fprintf(fp, "\n"
+			    "	if (%1$s_%2$s_decode_view(&view, buf, len) < 0)\n"
+			    "		bench_fail(\"%2$s\", \"decode_view\");\n"
+			    "	if (len && %1$s_%2$s_decode_view(&view, buf, len - 1) != -EINVAL)\n"
+			    "		bench_fail(\"%2$s\", \"decode_view of truncated input\");\n",
+			    package, qm->name);
+
+	if (ei)
+		fprintf(fp, "\n"
+			    "	pkt.data = again;\n"
+			    "	pkt.data_len = sizeof(again);\n"
+			    "	if (qmi_encode_message(&pkt, %3$d, %4$u, 0, msg, %1$s_%2$s_ei) < 0 ||\n"
+			    "	    pkt.data_len != sizeof(struct qmi_header) + len ||\n"
+			    "	    memcmp(buf, again + sizeof(struct qmi_header), len))\n"
+			    "		bench_fail(\"%2$s\", \"encode matching qmi_encode_message\");\n"
+			    "\n"
+			    "	memset(&out, 0, sizeof(out));\n"
+			    "	if (qmi_decode_message(&out, NULL, &pkt, %3$d, %4$u, %1$s_%2$s_ei) < 0 ||\n"
+			    "	    %1$s_%2$s_encode(&out, again, sizeof(again)) != len ||\n"
+			    "	    memcmp(buf, again, len))\n"
+			    "		bench_fail(\"%2$s\", \"encode matching qmi_decode_message\");\n",
+			    package, qm->name, qm->type, wire_msg_id(qm));
+
+	fprintf(fp, "}\n"
+		    "\n");
+}
+
+static void emit_kernel_bench(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+			      unsigned flags)
+{
+	const char *package = ctx->package.name;
+
+	fprintf(fp, "static void bench_%1$s_%2$s(unsigned iterations)\n"
+		    "{\n",
+		    package, qm->name);
+	emit_wire_buf(ctx, fp, qm, "buf");
+	fprintf(fp, "	static struct %1$s_%2$s msg;\n"
+		    "	static struct %1$s_%2$s out;\n",
+		    package, qm->name);
+	if (!(flags & (KERNEL_MASK | KERNEL_CONST)))
+		fprintf(fp, "	struct qrtr_packet pkt;\n");
+	fprintf(fp, "	uint64_t encode;\n"
+		    "	uint64_t decode;\n"
+		    "	uint64_t start;\n");
+	if (!(flags & (KERNEL_MASK | KERNEL_CONST)))
+		fprintf(fp, "	unsigned txn;\n");
+	fprintf(fp, "	size_t len = 0;\n"
+		    "	unsigned i;\n");
+	if (flags & KERNEL_CODEC)
+		fprintf(fp, "	int ret = 0;\n");
+	if (flags & KERNEL_VIEW)
+		fprintf(fp, "	static struct %1$s_%2$s_view view;\n",
+			package, qm->name);
+	fprintf(fp, "\n"
+		    "	%1$s_%2$s_fill(&msg);\n",
+		    package, qm->name);
+	if (flags & KERNEL_CODEC)
+		fprintf(fp, "	check_%1$s_%2$s(&msg);\n",
+			package, qm->name);
+
+	/* There are no ei tables with presence masks or relocation-free tables */
+	if (!(flags & (KERNEL_MASK | KERNEL_CONST)))
+		fprintf(fp, "\n"
+			    "	start = bench_now();\n"
+			    "	for (i = 0; i < iterations; i++) {\n"
+			    "		pkt.data = buf;\n"
+			    "		pkt.data_len = sizeof(buf);\n"
+			    "		if (qmi_encode_message(&pkt, %3$d, %4$u, i, &msg, %1$s_%2$s_ei) < 0)\n"
+			    "			bench_fail(\"%2$s\", \"qmi_encode_message\");\n"
+			    "	}\n"
+			    "	encode = bench_now() - start;\n"
+			    "	len = pkt.data_len;\n"
+			    "\n"
+			    "	start = bench_now();\n"
+			    "	for (i = 0; i < iterations; i++) {\n"
+			    "		pkt.data = buf;\n"
+			    "		pkt.data_len = len;\n"
+			    "		if (qmi_decode_message(&out, &txn, &pkt, %3$d, %4$u, %1$s_%2$s_ei) < 0)\n"
+			    "			bench_fail(\"%2$s\", \"qmi_decode_message\");\n"
+			    "	}\n"
+			    "	decode = bench_now() - start;\n"
+			    "\n"
+			    "	printf(\"%%-32s %%-6s %%8.1f %%8.1f %%8zu\\n\", \"%2$s\", \"ei\",\n"
+			    "	       (double)encode / iterations, (double)decode / iterations, len);\n",
+			    package, qm->name, qm->type, wire_msg_id(qm));
+
+	if (flags & KERNEL_CODEC)
+		fprintf(fp, "\n"
+			    "	start = bench_now();\n"
+			    "	for (i = 0; i < iterations; i++) {\n"
+			    "		ret = %1$s_%2$s_encode(&msg, buf, sizeof(buf));\n"
+			    "		if (ret < 0)\n"
+			    "			bench_fail(\"%2$s\", \"encode\");\n"
+			    "	}\n"
+			    "	encode = bench_now() - start;\n"
+			    "	len = ret;\n"
+			    "\n"
+			    "	start = bench_now();\n"
+			    "	for (i = 0; i < iterations; i++) {\n"
+			    "		if (%1$s_%2$s_decode(&out, buf, len) < 0)\n"
+			    "			bench_fail(\"%2$s\", \"decode\");\n"
+			    "	}\n"
+			    "	decode = bench_now() - start;\n"
+			    "\n"
+			    "	printf(\"%%-32s %%-6s %%8.1f %%8.1f %%8zu\\n\", \"%2$s\", \"codec\",\n"
+			    "	       (double)encode / iterations, (double)decode / iterations, len);\n",
+			    package, qm->name);
+
+	/* Views are decode only */
+	if (flags & KERNEL_VIEW)
+		fprintf(fp, "\n"
+			    "	start = bench_now();\n"
+			    "	for (i = 0; i < iterations; i++) {\n"
+			    "		if (%1$s_%2$s_decode_view(&view, buf, len) < 0)\n"
+			    "			bench_fail(\"%2$s\", \"decode_view\");\n"
+			    "	}\n"
+			    "	decode = bench_now() - start;\n"
+			    "\n"
+			    "	printf(\"%%-32s %%-6s %%8s %%8.1f %%8zu\\n\", \"%2$s\", \"view\", \"-\",\n"
+			    "	       (double)decode / iterations, len);\n",
+			    package, qm->name);
+
+	fprintf(fp, "}\n"
+		    "\n");
+}
+
+void bench_emit_kernel(struct qmi_ctx *ctx, FILE *fp, unsigned flags)
+{
+	struct qmi_message *qm;
+	struct qmi_struct *qs;
+
+	emit_bench_helpers(fp, ctx->package.name);
+
+	/* Nested structs are listed before the structs containing them */
+	list_for_each_entry(qs, &ctx->structs, node)
+		emit_struct_fill(ctx, fp, qs);
+
+	list_for_each_entry(qm, &ctx->messages, node) {
+		emit_message_fill(ctx, fp, qm, flags);
+		if (flags & KERNEL_CODEC)
+			emit_kernel_check(ctx, fp, qm, flags);
+		emit_kernel_bench(ctx, fp, qm, flags);
+	}
+
+	emit_bench_main(ctx, fp, "message                          path     encode   decode    bytes (ns/op)",
+			false);
+}
@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# Generate a synthetic QMI IDL, for measuring how qmic scales.
+#
+# usage: gen-idl.sh [-a] PACKAGE MESSAGES STRUCTS DEPTH CONSTS ENUMS
+#
+#   -a        only use what the accessor style sources support, i.e. leave
+#             out the qmi_response_type_v01 members; STRUCTS should be 0
+#
+#   MESSAGES  number of request/response/indication triplets
+#   STRUCTS   number of top level structs
+#   DEPTH     deepest nesting of struct definitions, at most STRUCT_NEST_MAX - 1
+#   CONSTS    number of constants
+#   ENUMS     number of enums, each with 16 values
+#
+
+accessor=0
+if [ "$1" = "-a" ]; then
+	accessor=1
+	shift
+fi
+
+if [ $# -ne 6 ]; then
+	echo "usage: $0 [-a] PACKAGE MESSAGES STRUCTS DEPTH CONSTS ENUMS" >&2
+	exit 1
+fi
+
+awk -v accessor="$accessor" -v pkg="$1" -v messages="$2" -v structs="$3" -v depth="$4" \
+    -v consts="$5" -v enums="$6" '
+function indent(n,	s) {
+	s = ""
+	while (n-- > 0)
+		s = s "\t"
+	return s
+}
+
+# Struct members, with a chain of nested struct definitions below them
+function nested(level, max,	t) {
+	t = indent(level + 1)
+	printf "%su8 a;\n", t
+	printf "%su16 b;\n", t
+	printf "%su32 *c(u16)[8];\n", t
+	printf "%sstring d;\n", t
+	printf "%su8 e[4];\n", t
+	if (level < max) {
+		printf "%sstruct {\n", t
+		nested(level + 1, max)
+		printf "%s} n;\n", t
+	}
+}
+
+BEGIN {
+	printf "package %s 0x42;\n\n", pkg
+
+	for (i = 0; i < consts; i++)
+		printf "const %s_C%d = %d;\n", toupper(pkg), i, i % 32 + 1
+	printf "\n"
+
+	for (i = 0; i < enums; i++) {
+		printf "enum %s_e%d {\n", pkg, i
+		for (j = 0; j < 16; j++)
+			printf "\t%s_E%d_V%d = 0x%x;\n", toupper(pkg), i, j, j
+		printf "};\n\n"
+	}
+
+	for (i = 0; i < structs; i++) {
+		printf "struct s%d {\n", i
+		nested(0, depth ? i % depth : 0)
+		printf "};\n\n"
+	}
+
+	for (i = 0; i < messages; i++) {
+		id = i + 1
+		cnst = consts ? sprintf("%s_C%d", toupper(pkg), i % consts) : 4
+
+		printf "request m%d_req {\n", i
+		printf "\trequired u8 mode = 0x01;\n"
+		printf "\toptional u16 flags = 0x10;\n"
+		printf "\toptional string name = 0x11;\n"
+		printf "\toptional u32 ids(u16) = 0x12;\n"
+		printf "\toptional u8 raw[%s] = 0x13;\n", cnst
+		if (structs)
+			printf "\toptional s%d st = 0x14;\n", i % structs
+		printf "} = %d;\n\n", id
+
+		printf "response m%d_resp {\n", i
+		if (!accessor)
+			printf "\trequired qmi_response_type_v01 res = 0x02;\n"
+		printf "\toptional i64 value = 0x10;\n"
+		if (structs)
+			printf "\toptional s%d sts(u8) = 0x11;\n", (i + 1) % structs
+		printf "} = %d;\n\n", id
+
+		printf "indication m%d_ind {\n", i
+		printf "\toptional string info = 0x10;\n"
+		printf "\toptional u64 stamps(u8) = 0x11;\n"
+		printf "} = %d;\n\n", id
+	}
+}'
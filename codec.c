@@ -0,0 +1,1190 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qmic.h"
+
+/*
+ * Compiled encoders and decoders for the kernel style structs
+ *
+ * Rather than having libqrtr interpret the qmi_elem_info tables for every
+ * message, emit straight-line code for each message and struct, with the
+ * element sizes, array bounds and TLV ids baked in. The wire format is the
+ * one described by the tables emitted in kernel.c.
+ */
+
+static const unsigned native_sizes[] = {
+	[TYPE_U8] = 1,
+	[TYPE_U16] = 2,
+	[TYPE_U32] = 4,
+	[TYPE_U64] = 8,
+	[TYPE_I8] = 1,
+	[TYPE_I16] = 2,
+	[TYPE_I32] = 4,
+	[TYPE_I64] = 8,
+	[TYPE_CHAR] = 1,
+};
+
+bool is_response_type(struct qmi_struct *qs)
+{
+	return !strcmp(qs->name, "qmi_response_type_v01");
+}
+
+/* Name of the C struct, and prefix of its helpers, for @qs */
+const char *struct_name(struct qmi_ctx *ctx, char *buf, size_t len, struct qmi_struct *qs)
+{
+	if (is_response_type(qs))
+		snprintf(buf, len, "%s", qs->name);
+	else
+		snprintf(buf, len, "%s_%s", ctx->package.name, qs->name);
+
+	return buf;
+}
+
+/* Name of the ei table for @qs, shared by all structs of its shape */
+const char *struct_ei_name(struct qmi_ctx *ctx, char *buf, size_t len, struct qmi_struct *qs)
+{
+	char name[256];
+
+	snprintf(buf, len, "%s_ei", struct_name(ctx, name, sizeof(name), qs->shape));
+
+	return buf;
+}
+
+/* Type used on the wire for the length of a variable message array */
+const char *message_array_len_type(struct qmi_message_member *qmm)
+{
+	if (qmm->array_len_type >= 0)
+		return sz_native_types[qmm->array_len_type];
+
+	return qmm->array_size >= 256 ? "uint16_t" : "uint8_t";
+}
+
+unsigned message_array_len_size(struct qmi_message_member *qmm)
+{
+	if (qmm->array_len_type >= 0)
+		return native_sizes[qmm->array_len_type];
+
+	return qmm->array_size >= 256 ? 2 : 1;
+}
+
+/*
+ * Strings may declare their maximum length, as in "string name(32)" or, in
+ * structs, "string name[32]"; undeclared ones hold up to 255 characters.
+ * Everything else derives from the maximum, so that the compiled codecs
+ * and libqrtr accept the same strings and neither overruns the storage.
+ */
+unsigned message_string_max(struct qmi_message_member *qmm)
+{
+	return qmm->array_size ? qmm->array_size : 255;
+}
+
+/*
+ * Size of the char array holding a string, with room for a NUL, which is
+ * also its elem_len in the tables: libqrtr rejects strings as long as that
+ */
+unsigned message_string_elem_len(struct qmi_message_member *qmm)
+{
+	return message_string_max(qmm) + 1;
+}
+
+unsigned struct_string_max(struct qmi_struct_member *qsm)
+{
+	return qsm->array_fixed ? qsm->array_size : 255;
+}
+
+unsigned struct_string_elem_len(struct qmi_struct_member *qsm)
+{
+	return struct_string_max(qsm) + 1;
+}
+
+/* Like libqrtr, strings in structs have a one byte length if it's enough */
+static const char *struct_string_len_type(struct qmi_struct_member *qsm)
+{
+	return struct_string_elem_len(qsm) <= UINT8_MAX ? "uint8_t" : "uint16_t";
+}
+
+static unsigned struct_string_len_size(struct qmi_struct_member *qsm)
+{
+	return struct_string_elem_len(qsm) <= UINT8_MAX ? 1 : 2;
+}
+
+bool message_member_is_array(struct qmi_message_member *qmm)
+{
+	if (qmm->type == TYPE_STRING)
+		return false;
+
+	if (qmm->type == TYPE_STRUCT && is_response_type(qmm->qmi_struct))
+		return false;
+
+	return qmm->array_size;
+}
+
+/* Strings and the response type have no _valid flag, they're always sent */
+bool message_member_is_optional(struct qmi_message_member *qmm)
+{
+	if (qmm->type == TYPE_STRING)
+		return false;
+
+	if (qmm->type == TYPE_STRUCT && is_response_type(qmm->qmi_struct))
+		return false;
+
+	return !qmm->required;
+}
+
+/*
+ * With KERNEL_MASK the optional members of a message are marked present by a
+ * bit each in its "present" member, in IDL order, rather than by _valid flags
+ */
+unsigned message_optional_count(struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+	unsigned count = 0;
+
+	list_for_each_entry(qmm, &qm->members, node)
+		if (message_member_is_optional(qmm))
+			count++;
+
+	return count;
+}
+
+const char *message_mask_type(struct qmi_message *qm)
+{
+	unsigned count = message_optional_count(qm);
+
+	if (count > 64)
+		errx(1, "message %s has %u optional members, a presence mask holds 64",
+		     qm->name, count);
+
+	return count > 32 ? "uint64_t" : "uint32_t";
+}
+
+unsigned message_present_bit(struct qmi_message *qm, struct qmi_message_member *qmm)
+{
+	struct qmi_message_member *it;
+	unsigned bit = 0;
+
+	list_for_each_entry(it, &qm->members, node) {
+		if (it == qmm)
+			break;
+		if (message_member_is_optional(it))
+			bit++;
+	}
+
+	return bit;
+}
+
+/* Name of the bit of @qmm in the presence mask, <PKG>_<MSG>_HAS_<FIELD> */
+void emit_present_name(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+		       struct qmi_message_member *qmm)
+{
+	emit_upper(fp, ctx->package.name);
+	fprintf(fp, "_");
+	emit_upper(fp, qm->name);
+	fprintf(fp, "_HAS_");
+	emit_upper(fp, qmm->name);
+}
+
+/* Mark optional @qmm of *msg as present */
+void emit_present_set(struct qmi_ctx *ctx, FILE *fp, const char *indent,
+		      struct qmi_message *qm, struct qmi_message_member *qmm,
+		      unsigned flags)
+{
+	if (flags & KERNEL_MASK) {
+		fprintf(fp, "%smsg->present |= ", indent);
+		emit_present_name(ctx, fp, qm, qmm);
+		fprintf(fp, ";\n");
+	} else {
+		fprintf(fp, "%smsg->%s_valid = true;\n", indent, qmm->name);
+	}
+}
+
+static void emit_present_test(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+			      struct qmi_message_member *qmm, unsigned flags)
+{
+	if (flags & KERNEL_MASK) {
+		fprintf(fp, "	if (msg->present & ");
+		emit_present_name(ctx, fp, qm, qmm);
+		fprintf(fp, ") {\n");
+	} else {
+		fprintf(fp, "	if (msg->%s_valid) {\n", qmm->name);
+	}
+}
+
+static bool struct_member_is_array(struct qmi_struct_member *qsm)
+{
+	return qsm->type != TYPE_STRING && (qsm->is_ptr || qsm->array_fixed);
+}
+
+static void emit_codec_helpers(FILE *fp)
+{
+	fprintf(fp, "#define QMIC_PUT(src, size) do {			\\\n"
+		    "	if ((size_t)(end - p) < (size))			\\\n"
+		    "		return -ENOSPC;				\\\n"
+		    "	memcpy(p, (src), (size));			\\\n"
+		    "	p += (size);					\\\n"
+		    "} while (0)\n"
+		    "\n"
+		    "#define QMIC_GET(dst, size) do {			\\\n"
+		    "	if ((size_t)(end - p) < (size))			\\\n"
+		    "		return -EINVAL;				\\\n"
+		    "	memcpy((dst), p, (size));			\\\n"
+		    "	p += (size);					\\\n"
+		    "} while (0)\n"
+		    "\n");
+
+	fprintf(fp, "static inline int qmi_response_type_v01_encode_struct(const struct qmi_response_type_v01 *v, uint8_t **pp, uint8_t *end)\n"
+		    "{\n"
+		    "	uint8_t *p = *pp;\n"
+		    "\n"
+		    "	QMIC_PUT(&v->result, sizeof(uint16_t));\n"
+		    "	QMIC_PUT(&v->error, sizeof(uint16_t));\n"
+		    "\n"
+		    "	*pp = p;\n"
+		    "	return 0;\n"
+		    "}\n"
+		    "\n"
+		    "static inline int qmi_response_type_v01_decode_struct(struct qmi_response_type_v01 *v, const uint8_t **pp, const uint8_t *end)\n"
+		    "{\n"
+		    "	const uint8_t *p = *pp;\n"
+		    "\n"
+		    "	QMIC_GET(&v->result, sizeof(uint16_t));\n"
+		    "	QMIC_GET(&v->error, sizeof(uint16_t));\n"
+		    "\n"
+		    "	*pp = p;\n"
+		    "	return 0;\n"
+		    "}\n"
+		    "\n");
+}
+
+/*
+ * Emit the encoding of @count elements (or a single element if @count is
+ * NULL) found at @expr, which is an array if @count is given.
+ */
+static void emit_encode_value(struct qmi_ctx *ctx, FILE *fp, const char *indent, const char *expr,
+			      int type, struct qmi_struct *qs, const char *count)
+{
+	char name[256];
+
+	if (type != TYPE_STRUCT) {
+		if (count)
+			fprintf(fp, "%1$sQMIC_PUT(%2$s, %3$s * sizeof(%4$s));\n",
+				indent, expr, count, sz_native_types[type]);
+		else
+			fprintf(fp, "%1$sQMIC_PUT(&%2$s, sizeof(%3$s));\n",
+				indent, expr, sz_native_types[type]);
+		return;
+	}
+
+	struct_name(ctx, name, sizeof(name), qs);
+	if (count)
+		fprintf(fp, "%1$sfor (i = 0; i < %3$s; i++) {\n"
+			    "%1$s	ret = %4$s_encode_struct(&%2$s[i], &p, end);\n"
+			    "%1$s	if (ret < 0)\n"
+			    "%1$s		return ret;\n"
+			    "%1$s}\n",
+			indent, expr, count, name);
+	else
+		fprintf(fp, "%1$sret = %3$s_encode_struct(&%2$s, &p, end);\n"
+			    "%1$sif (ret < 0)\n"
+			    "%1$s	return ret;\n",
+			indent, expr, name);
+}
+
+static void emit_decode_value(struct qmi_ctx *ctx, FILE *fp, const char *indent, const char *expr,
+			      int type, struct qmi_struct *qs, const char *count)
+{
+	char name[256];
+
+	if (type != TYPE_STRUCT) {
+		if (count)
+			fprintf(fp, "%1$sQMIC_GET(%2$s, %3$s * sizeof(%4$s));\n",
+				indent, expr, count, sz_native_types[type]);
+		else
+			fprintf(fp, "%1$sQMIC_GET(&%2$s, sizeof(%3$s));\n",
+				indent, expr, sz_native_types[type]);
+		return;
+	}
+
+	struct_name(ctx, name, sizeof(name), qs);
+	if (count)
+		fprintf(fp, "%1$sfor (i = 0; i < %3$s; i++) {\n"
+			    "%1$s	ret = %4$s_decode_struct(&%2$s[i], &p, end);\n"
+			    "%1$s	if (ret < 0)\n"
+			    "%1$s		return ret;\n"
+			    "%1$s}\n",
+			indent, expr, count, name);
+	else
+		fprintf(fp, "%1$sret = %3$s_decode_struct(&%2$s, &p, end);\n"
+			    "%1$sif (ret < 0)\n"
+			    "%1$s	return ret;\n",
+			indent, expr, name);
+}
+
+static bool struct_needs_index(struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+
+	list_for_each_entry(qsm, &qs->members, node)
+		if (qsm->type == TYPE_STRUCT && struct_member_is_array(qsm))
+			return true;
+
+	return false;
+}
+
+static bool struct_needs_ret(struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+
+	list_for_each_entry(qsm, &qs->members, node)
+		if (qsm->type == TYPE_STRUCT)
+			return true;
+
+	return false;
+}
+
+static void emit_struct_encoder(struct qmi_ctx *ctx, FILE *fp, struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	char count[300];
+	char expr[256];
+	char name[256];
+
+	struct_name(ctx, name, sizeof(name), qs);
+
+	fprintf(fp, "static int %1$s_encode_struct(const struct %1$s *v, uint8_t **pp, uint8_t *end)\n"
+		    "{\n"
+		    "	uint8_t *p = *pp;\n",
+		    name);
+	if (struct_needs_index(qs))
+		fprintf(fp, "	size_t i;\n");
+	if (struct_needs_ret(qs))
+		fprintf(fp, "	int ret;\n");
+	fprintf(fp, "\n");
+
+	list_for_each_entry(qsm, &qs->members, node) {
+		snprintf(expr, sizeof(expr), "v->%s", qsm->name);
+
+		if (qsm->type == TYPE_STRING) {
+			fprintf(fp, "	{\n"
+				    "		%2$s len = strnlen(v->%1$s, %3$u);\n"
+				    "\n"
+				    "		QMIC_PUT(&len, sizeof(len));\n"
+				    "		QMIC_PUT(v->%1$s, len);\n"
+				    "	}\n",
+				    qsm->name, struct_string_len_type(qsm),
+				    struct_string_max(qsm));
+		} else if (qsm->is_ptr) {
+			fprintf(fp, "	if (v->%1$s_len > %2$u)\n"
+				    "		return -EINVAL;\n"
+				    "	QMIC_PUT(&v->%1$s_len, sizeof(%3$s));\n",
+				    qsm->name, qsm->array_size,
+				    sz_native_types[qsm->array_len_type]);
+			snprintf(count, sizeof(count), "v->%s_len", qsm->name);
+			emit_encode_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, count);
+		} else if (qsm->array_fixed) {
+			snprintf(count, sizeof(count), "%u", qsm->array_size);
+			emit_encode_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, count);
+		} else {
+			emit_encode_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, NULL);
+		}
+	}
+
+	fprintf(fp, "\n"
+		    "	*pp = p;\n"
+		    "	return 0;\n"
+		    "}\n"
+		    "\n");
+}
+
+static void emit_struct_decoder(struct qmi_ctx *ctx, FILE *fp, struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	char count[300];
+	char expr[256];
+	char name[256];
+
+	struct_name(ctx, name, sizeof(name), qs);
+
+	fprintf(fp, "static int %1$s_decode_struct(struct %1$s *v, const uint8_t **pp, const uint8_t *end)\n"
+		    "{\n"
+		    "	const uint8_t *p = *pp;\n",
+		    name);
+	if (struct_needs_index(qs))
+		fprintf(fp, "	size_t i;\n");
+	if (struct_needs_ret(qs))
+		fprintf(fp, "	int ret;\n");
+	fprintf(fp, "\n");
+
+	list_for_each_entry(qsm, &qs->members, node) {
+		snprintf(expr, sizeof(expr), "v->%s", qsm->name);
+
+		if (qsm->type == TYPE_STRING) {
+			fprintf(fp, "	{\n"
+				    "		%2$s len;\n"
+				    "\n"
+				    "		QMIC_GET(&len, sizeof(len));\n"
+				    "		if (len > %3$u)\n"
+				    "			return -EINVAL;\n"
+				    "		QMIC_GET(v->%1$s, len);\n"
+				    "		v->%1$s[len] = '\\0';\n"
+				    "		v->%1$s_len = len;\n"
+				    "	}\n",
+				    qsm->name, struct_string_len_type(qsm),
+				    struct_string_max(qsm));
+		} else if (qsm->is_ptr) {
+			fprintf(fp, "	v->%1$s_len = 0;\n"
+				    "	QMIC_GET(&v->%1$s_len, sizeof(%3$s));\n"
+				    "	if (v->%1$s_len > %2$u)\n"
+				    "		return -EINVAL;\n",
+				    qsm->name, qsm->array_size,
+				    sz_native_types[qsm->array_len_type]);
+			snprintf(count, sizeof(count), "v->%s_len", qsm->name);
+			emit_decode_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, count);
+		} else if (qsm->array_fixed) {
+			snprintf(count, sizeof(count), "%u", qsm->array_size);
+			emit_decode_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, count);
+		} else {
+			emit_decode_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, NULL);
+		}
+	}
+
+	fprintf(fp, "\n"
+		    "	*pp = p;\n"
+		    "	return 0;\n"
+		    "}\n"
+		    "\n");
+}
+
+static bool message_needs_index(struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+
+	list_for_each_entry(qmm, &qm->members, node)
+		if (qmm->type == TYPE_STRUCT && message_member_is_array(qmm))
+			return true;
+
+	return false;
+}
+
+static bool message_needs_ret(struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+
+	list_for_each_entry(qmm, &qm->members, node)
+		if (qmm->type == TYPE_STRUCT)
+			return true;
+
+	return false;
+}
+
+static unsigned long long struct_max_size(struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	unsigned long long size = 0;
+	unsigned long long elem;
+
+	if (is_response_type(qs))
+		return 2 * sizeof(uint16_t);
+
+	list_for_each_entry(qsm, &qs->members, node) {
+		if (qsm->type == TYPE_STRING) {
+			size += struct_string_len_size(qsm) + struct_string_max(qsm);
+			continue;
+		}
+
+		if (qsm->type == TYPE_STRUCT)
+			elem = struct_max_size(qsm->qmi_struct);
+		else
+			elem = native_sizes[qsm->type];
+
+		if (qsm->is_ptr)
+			size += native_sizes[qsm->array_len_type] + qsm->array_size * elem;
+		else if (qsm->array_fixed)
+			size += qsm->array_size * elem;
+		else
+			size += elem;
+	}
+
+	return size;
+}
+
+/* Largest payload of the TLV of @qmm, excluding its header */
+static unsigned long long message_member_max_size(struct qmi_message_member *qmm)
+{
+	unsigned long long elem;
+
+	if (qmm->type == TYPE_STRING)
+		return message_string_max(qmm);
+
+	if (qmm->type == TYPE_STRUCT)
+		elem = struct_max_size(qmm->qmi_struct);
+	else
+		elem = native_sizes[qmm->type];
+
+	if (message_member_is_array(qmm) &&
+	    qmm->array_fixed && qmm->type != TYPE_STRUCT)
+		return qmm->array_size * elem;
+	else if (message_member_is_array(qmm))
+		return message_array_len_size(qmm) + qmm->array_size * elem;
+	else
+		return elem;
+}
+
+static unsigned long long message_max_size(struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+	unsigned long long size = 0;
+
+	/* TLV type and length, and payload */
+	list_for_each_entry(qmm, &qm->members, node)
+		size += 3 + message_member_max_size(qmm);
+
+	return size;
+}
+
+static void emit_message_encoder(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+				 unsigned flags)
+{
+	struct qmi_message_member *qmm;
+	const char *indent;
+	char count[300];
+	char expr[256];
+
+	fprintf(fp, "int %1$s_%2$s_encode(const struct %1$s_%2$s *msg, void *buf, size_t len)\n"
+		    "{\n"
+		    "	uint8_t *p = buf;\n"
+		    "	uint8_t *end = p + len;\n"
+		    "	uint8_t *tlv;\n"
+		    "	uint16_t tlv_len;\n",
+		    ctx->package.name, qm->name);
+	if (message_needs_index(qm))
+		fprintf(fp, "	size_t i;\n");
+	if (message_needs_ret(qm))
+		fprintf(fp, "	int ret;\n");
+	fprintf(fp, "\n");
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		snprintf(expr, sizeof(expr), "msg->%s", qmm->name);
+
+		if (message_member_is_optional(qmm)) {
+			emit_present_test(ctx, fp, qm, qmm, flags);
+			indent = "\t\t";
+		} else {
+			fprintf(fp, "	{\n");
+			indent = "\t\t";
+		}
+
+		fprintf(fp, "%1$sif (end - p < 3)\n"
+			    "%1$s	return -ENOSPC;\n"
+			    "%1$stlv = p;\n"
+			    "%1$sp += 3;\n",
+			    indent);
+
+		if (qmm->type == TYPE_STRING) {
+			fprintf(fp, "%1$sQMIC_PUT(%2$s, strnlen(%2$s, %3$u));\n",
+				indent, expr, message_string_max(qmm));
+		} else if (message_member_is_array(qmm) &&
+			   qmm->array_fixed && qmm->type != TYPE_STRUCT) {
+			snprintf(count, sizeof(count), "%u", qmm->array_size);
+			emit_encode_value(ctx, fp, indent, expr, qmm->type, qmm->qmi_struct, count);
+		} else if (message_member_is_array(qmm)) {
+			fprintf(fp, "%1$sif (%2$s_len > %3$u)\n"
+				    "%1$s	return -EINVAL;\n"
+				    "%1$s{\n"
+				    "%1$s	%4$s n = %2$s_len;\n"
+				    "\n"
+				    "%1$s	QMIC_PUT(&n, sizeof(n));\n"
+				    "%1$s}\n",
+				    indent, expr, qmm->array_size,
+				    message_array_len_type(qmm));
+			snprintf(count, sizeof(count), "%s_len", expr);
+			emit_encode_value(ctx, fp, indent, expr, qmm->type, qmm->qmi_struct, count);
+		} else {
+			emit_encode_value(ctx, fp, indent, expr, qmm->type, qmm->qmi_struct, NULL);
+		}
+
+		/* The length of the TLV is 16 bits, which only some can outgrow */
+		if (message_member_max_size(qmm) > UINT16_MAX)
+			fprintf(fp, "%1$sif (p - tlv - 3 > UINT16_MAX)\n"
+				    "%1$s	return -EMSGSIZE;\n",
+				    indent);
+
+		fprintf(fp, "%1$stlv_len = p - tlv - 3;\n"
+			    "%1$stlv[0] = 0x%2$02x;\n"
+			    "%1$smemcpy(&tlv[1], &tlv_len, sizeof(tlv_len));\n"
+			    "	}\n"
+			    "\n",
+			    indent, qmm->id);
+	}
+
+	fprintf(fp, "	return p - (uint8_t *)buf;\n"
+		    "}\n"
+		    "\n");
+}
+
+static void emit_message_decoder(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+				 unsigned flags)
+{
+	struct qmi_message_member *qmm;
+	char count[300];
+	char expr[256];
+
+	fprintf(fp, "int %1$s_%2$s_decode(struct %1$s_%2$s *msg, const void *buf, size_t len)\n"
+		    "{\n"
+		    "	const uint8_t *p = buf;\n"
+		    "	const uint8_t *buf_end = p + len;\n"
+		    "	const uint8_t *end;\n"
+		    "	uint16_t tlv_len;\n"
+		    "	uint8_t tlv_type;\n",
+		    ctx->package.name, qm->name);
+	if (message_needs_index(qm))
+		fprintf(fp, "	size_t i;\n");
+	if (message_needs_ret(qm))
+		fprintf(fp, "	int ret;\n");
+	fprintf(fp, "\n");
+
+	if (flags & KERNEL_MASK) {
+		if (message_optional_count(qm))
+			fprintf(fp, "	msg->present = 0;\n");
+	} else {
+		list_for_each_entry(qmm, &qm->members, node)
+			if (message_member_is_optional(qmm))
+				fprintf(fp, "	msg->%s_valid = false;\n", qmm->name);
+	}
+
+	fprintf(fp, "\n"
+		    "	while (p < buf_end) {\n"
+		    "		if (buf_end - p < 3)\n"
+		    "			return -EINVAL;\n"
+		    "		tlv_type = p[0];\n"
+		    "		memcpy(&tlv_len, &p[1], sizeof(tlv_len));\n"
+		    "		p += 3;\n"
+		    "\n"
+		    "		if (buf_end - p < tlv_len)\n"
+		    "			return -EINVAL;\n"
+		    "		end = p + tlv_len;\n"
+		    "\n"
+		    "		switch (tlv_type) {\n");
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		snprintf(expr, sizeof(expr), "msg->%s", qmm->name);
+
+		fprintf(fp, "		case 0x%02x:\n", qmm->id);
+
+		if (qmm->type == TYPE_STRING) {
+			fprintf(fp, "			if (tlv_len > %2$u)\n"
+				    "				return -EINVAL;\n"
+				    "			QMIC_GET(%1$s, tlv_len);\n"
+				    "			%1$s[tlv_len] = '\\0';\n"
+				    "			%1$s_len = tlv_len;\n",
+				    expr, message_string_max(qmm));
+		} else if (message_member_is_array(qmm) &&
+			   qmm->array_fixed && qmm->type != TYPE_STRUCT) {
+			snprintf(count, sizeof(count), "%u", qmm->array_size);
+			emit_decode_value(ctx, fp, "\t\t\t", expr, qmm->type, qmm->qmi_struct, count);
+			fprintf(fp, "			%s_len = %u;\n", expr, qmm->array_size);
+		} else if (message_member_is_array(qmm)) {
+			fprintf(fp, "			{\n"
+				    "				%3$s n;\n"
+				    "\n"
+				    "				QMIC_GET(&n, sizeof(n));\n"
+				    "				if (n > %2$u)\n"
+				    "					return -EINVAL;\n"
+				    "				%1$s_len = n;\n"
+				    "			}\n",
+				    expr, qmm->array_size,
+				    message_array_len_type(qmm));
+			snprintf(count, sizeof(count), "%s_len", expr);
+			emit_decode_value(ctx, fp, "\t\t\t", expr, qmm->type, qmm->qmi_struct, count);
+		} else {
+			emit_decode_value(ctx, fp, "\t\t\t", expr, qmm->type, qmm->qmi_struct, NULL);
+		}
+
+		if (message_member_is_optional(qmm))
+			emit_present_set(ctx, fp, "\t\t\t", qm, qmm, flags);
+		fprintf(fp, "			break;\n");
+	}
+
+	fprintf(fp, "		default:\n"
+		    "			/* Unknown TLVs are skipped */\n"
+		    "			break;\n"
+		    "		}\n"
+		    "\n"
+		    "		p = end;\n"
+		    "	}\n"
+		    "\n"
+		    "	return 0;\n"
+		    "}\n"
+		    "\n");
+}
+
+/*
+ * Emit the expression for the encoded size of @count elements (or a single
+ * element if @count is NULL) found at @expr.
+ */
+static void emit_size_value(struct qmi_ctx *ctx, FILE *fp, const char *indent, const char *expr,
+			    int type, struct qmi_struct *qs, const char *count)
+{
+	char name[256];
+
+	if (type != TYPE_STRUCT) {
+		if (count)
+			fprintf(fp, "%1$ssize += %2$s * %3$u;\n",
+				indent, count, native_sizes[type]);
+		else
+			fprintf(fp, "%1$ssize += %2$u;\n",
+				indent, native_sizes[type]);
+		return;
+	}
+
+	struct_name(ctx, name, sizeof(name), qs);
+	if (count)
+		fprintf(fp, "%1$sfor (i = 0; i < %3$s; i++)\n"
+			    "%1$s	size += %4$s_encoded_size_struct(&%2$s[i]);\n",
+			indent, expr, count, name);
+	else
+		fprintf(fp, "%1$ssize += %3$s_encoded_size_struct(&%2$s);\n",
+			indent, expr, name);
+}
+
+static void emit_struct_size(struct qmi_ctx *ctx, FILE *fp, struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	char count[300];
+	char expr[256];
+	char name[256];
+
+	struct_name(ctx, name, sizeof(name), qs);
+
+	fprintf(fp, "static inline size_t %1$s_encoded_size_struct(const struct %1$s *v)\n"
+		    "{\n"
+		    "	size_t size = 0;\n",
+		    name);
+	if (struct_needs_index(qs))
+		fprintf(fp, "	size_t i;\n");
+	fprintf(fp, "\n");
+
+	/* Structs without variable sized members have a constant size */
+	list_for_each_entry(qsm, &qs->members, node)
+		if (qsm->type == TYPE_STRING || qsm->type == TYPE_STRUCT || qsm->is_ptr)
+			break;
+	if (&qsm->node == &qs->members)
+		fprintf(fp, "	(void)v;\n");
+
+	list_for_each_entry(qsm, &qs->members, node) {
+		snprintf(expr, sizeof(expr), "v->%s", qsm->name);
+
+		if (qsm->type == TYPE_STRING) {
+			fprintf(fp, "	size += %1$u + strnlen(v->%2$s, %3$u);\n",
+				struct_string_len_size(qsm), qsm->name,
+				struct_string_max(qsm));
+		} else if (qsm->is_ptr) {
+			fprintf(fp, "	size += %u;\n",
+				native_sizes[qsm->array_len_type]);
+			snprintf(count, sizeof(count), "v->%s_len", qsm->name);
+			emit_size_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, count);
+		} else if (qsm->array_fixed) {
+			snprintf(count, sizeof(count), "%u", qsm->array_size);
+			emit_size_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, count);
+		} else {
+			emit_size_value(ctx, fp, "\t", expr, qsm->type, qsm->qmi_struct, NULL);
+		}
+	}
+
+	fprintf(fp, "\n"
+		    "	return size;\n"
+		    "}\n"
+		    "\n");
+}
+
+static void emit_message_size(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+			      unsigned flags)
+{
+	struct qmi_message_member *qmm;
+	const char *indent;
+	char count[300];
+	char expr[256];
+
+	fprintf(fp, "size_t %1$s_%2$s_encoded_size(const struct %1$s_%2$s *msg)\n"
+		    "{\n"
+		    "	size_t size = 0;\n",
+		    ctx->package.name, qm->name);
+	if (message_needs_index(qm))
+		fprintf(fp, "	size_t i;\n");
+	fprintf(fp, "\n");
+
+	/* Messages with only fixed size, required members have a constant size */
+	list_for_each_entry(qmm, &qm->members, node)
+		if (message_member_is_optional(qmm) || qmm->type == TYPE_STRING ||
+		    qmm->type == TYPE_STRUCT ||
+		    (message_member_is_array(qmm) && !qmm->array_fixed))
+			break;
+	if (&qmm->node == &qm->members)
+		fprintf(fp, "	(void)msg;\n");
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		snprintf(expr, sizeof(expr), "msg->%s", qmm->name);
+
+		if (message_member_is_optional(qmm)) {
+			emit_present_test(ctx, fp, qm, qmm, flags);
+			indent = "\t\t";
+		} else {
+			indent = "\t";
+		}
+
+		fprintf(fp, "%ssize += 3;\n", indent);
+
+		if (qmm->type == TYPE_STRING) {
+			fprintf(fp, "%1$ssize += strnlen(%2$s, %3$u);\n",
+				indent, expr, message_string_max(qmm));
+		} else if (message_member_is_array(qmm) &&
+			   qmm->array_fixed && qmm->type != TYPE_STRUCT) {
+			snprintf(count, sizeof(count), "%u", qmm->array_size);
+			emit_size_value(ctx, fp, indent, expr, qmm->type, qmm->qmi_struct, count);
+		} else if (message_member_is_array(qmm)) {
+			fprintf(fp, "%ssize += %u;\n",
+				indent, message_array_len_size(qmm));
+			snprintf(count, sizeof(count), "%s_len", expr);
+			emit_size_value(ctx, fp, indent, expr, qmm->type, qmm->qmi_struct, count);
+		} else {
+			emit_size_value(ctx, fp, indent, expr, qmm->type, qmm->qmi_struct, NULL);
+		}
+
+		if (message_member_is_optional(qmm))
+			fprintf(fp, "	}\n");
+	}
+
+	fprintf(fp, "\n"
+		    "	return size;\n"
+		    "}\n"
+		    "\n");
+}
+
+void emit_upper(FILE *fp, const char *s)
+{
+	while (*s)
+		fputc(toupper(*s++), fp);
+}
+
+void codec_emit_size_c(struct qmi_ctx *ctx, FILE *fp, unsigned flags)
+{
+	struct qmi_message *qm;
+	struct qmi_struct *qs;
+
+	fprintf(fp, "static inline size_t qmi_response_type_v01_encoded_size_struct(const struct qmi_response_type_v01 *v)\n"
+		    "{\n"
+		    "	(void)v;\n"
+		    "	return %zu;\n"
+		    "}\n"
+		    "\n",
+		    2 * sizeof(uint16_t));
+
+	list_for_each_entry(qs, &ctx->structs, node)
+		emit_struct_size(ctx, fp, qs);
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		emit_message_size(ctx, fp, qm, flags);
+}
+
+void codec_emit_size_h(struct qmi_ctx *ctx, FILE *fp)
+{
+	struct qmi_message *qm;
+
+	fprintf(fp, "/* Largest TLV payload of each message, excluding the QMI header */\n");
+	list_for_each_entry(qm, &ctx->messages, node) {
+		fprintf(fp, "#define ");
+		emit_upper(fp, ctx->package.name);
+		fprintf(fp, "_");
+		emit_upper(fp, qm->name);
+		fprintf(fp, "_MAX_WIRE_SIZE %llu\n", message_max_size(qm));
+	}
+	fprintf(fp, "\n");
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		fprintf(fp, "size_t %1$s_%2$s_encoded_size(const struct %1$s_%2$s *msg);\n",
+			ctx->package.name, qm->name);
+	fprintf(fp, "\n");
+}
+
+void codec_emit_c(struct qmi_ctx *ctx, FILE *fp, unsigned flags)
+{
+	struct qmi_message *qm;
+	struct qmi_struct *qs;
+
+	emit_codec_helpers(fp);
+
+	list_for_each_entry(qs, &ctx->structs, node) {
+		emit_struct_encoder(ctx, fp, qs);
+		emit_struct_decoder(ctx, fp, qs);
+	}
+
+	list_for_each_entry(qm, &ctx->messages, node) {
+		emit_message_encoder(ctx, fp, qm, flags);
+		emit_message_decoder(ctx, fp, qm, flags);
+	}
+}
+
+void codec_emit_h(struct qmi_ctx *ctx, FILE *fp)
+{
+	struct qmi_message *qm;
+
+	list_for_each_entry(qm, &ctx->messages, node) {
+		fprintf(fp, "int %1$s_%2$s_encode(const struct %1$s_%2$s *msg, void *buf, size_t len);\n"
+			    "int %1$s_%2$s_decode(struct %1$s_%2$s *msg, const void *buf, size_t len);\n",
+			    ctx->package.name, qm->name);
+	}
+	fprintf(fp, "\n");
+}
+
+/*
+ * Zero-copy views of received messages
+ *
+ * A view has the members of the message struct, but strings and arrays are
+ * pointers into the received buffer rather than copies of it, so decoding
+ * only walks the TLVs. Arrays of structs are kept encoded, as a span which
+ * <pkg>_<struct>_view_next() decodes an element at a time. Array elements
+ * are in wire order and not necessarily aligned, so arrays of integers wider
+ * than a byte are left as bytes too, to be read with the qmi_view_<type>()
+ * loaders rather than through a misaligned typed pointer.
+ */
+static const char *view_elem_type(int type)
+{
+	return native_sizes[type] > 1 ? "uint8_t" : sz_native_types[type];
+}
+
+static void emit_message_view(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+	char name[256];
+
+	fprintf(fp, "struct %1$s_%2$s_view {\n", ctx->package.name, qm->name);
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		if (message_member_is_optional(qmm))
+			fprintf(fp, "\tbool %s_valid;\n", qmm->name);
+
+		if (qmm->type == TYPE_STRING) {
+			fprintf(fp, "\tstruct qmi_strview %s;\n", qmm->name);
+		} else if (message_member_is_array(qmm)) {
+			fprintf(fp, "\tuint32_t %s_len;\n", qmm->name);
+			if (qmm->type == TYPE_STRUCT)
+				fprintf(fp, "\tstruct qmi_span %s;\n", qmm->name);
+			else
+				fprintf(fp, "\tconst %s *%s;\n",
+					view_elem_type(qmm->type), qmm->name);
+		} else if (qmm->type == TYPE_STRUCT) {
+			fprintf(fp, "\tstruct %s %s;\n",
+				struct_name(ctx, name, sizeof(name), qmm->qmi_struct),
+				qmm->name);
+		} else {
+			fprintf(fp, "\t%s %s;\n",
+				sz_native_types[qmm->type], qmm->name);
+		}
+	}
+
+	fprintf(fp, "};\n"
+		    "\n");
+}
+
+static void emit_message_view_decoder(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+	char expr[256];
+
+	fprintf(fp, "int %1$s_%2$s_decode_view(struct %1$s_%2$s_view *msg, const void *buf, size_t len)\n"
+		    "{\n"
+		    "	const uint8_t *p = buf;\n"
+		    "	const uint8_t *buf_end = p + len;\n"
+		    "	const uint8_t *end;\n"
+		    "	uint16_t tlv_len;\n"
+		    "	uint8_t tlv_type;\n",
+		    ctx->package.name, qm->name);
+	list_for_each_entry(qmm, &qm->members, node) {
+		if (qmm->type == TYPE_STRUCT && !message_member_is_array(qmm)) {
+			fprintf(fp, "	int ret;\n");
+			break;
+		}
+	}
+	fprintf(fp, "\n"
+		    "	memset(msg, 0, sizeof(*msg));\n"
+		    "\n"
+		    "	while (p < buf_end) {\n"
+		    "		if (buf_end - p < 3)\n"
+		    "			return -EINVAL;\n"
+		    "		tlv_type = p[0];\n"
+		    "		memcpy(&tlv_len, &p[1], sizeof(tlv_len));\n"
+		    "		p += 3;\n"
+		    "\n"
+		    "		if (buf_end - p < tlv_len)\n"
+		    "			return -EINVAL;\n"
+		    "		end = p + tlv_len;\n"
+		    "\n"
+		    "		switch (tlv_type) {\n");
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		snprintf(expr, sizeof(expr), "msg->%s", qmm->name);
+
+		fprintf(fp, "		case 0x%02x:\n", qmm->id);
+
+		if (qmm->type == TYPE_STRING) {
+			fprintf(fp, "			if (tlv_len > %2$u)\n"
+				    "				return -EINVAL;\n"
+				    "			%1$s.ptr = (const char *)p;\n"
+				    "			%1$s.len = tlv_len;\n",
+				    expr, message_string_max(qmm));
+		} else if (message_member_is_array(qmm) &&
+			   qmm->array_fixed && qmm->type != TYPE_STRUCT) {
+			fprintf(fp, "			if ((size_t)(end - p) < %2$u * sizeof(%3$s))\n"
+				    "				return -EINVAL;\n"
+				    "			%1$s = (const %4$s *)p;\n"
+				    "			%1$s_len = %2$u;\n",
+				    expr, qmm->array_size, sz_native_types[qmm->type],
+				    view_elem_type(qmm->type));
+		} else if (message_member_is_array(qmm)) {
+			fprintf(fp, "			{\n"
+				    "				%3$s n;\n"
+				    "\n"
+				    "				QMIC_GET(&n, sizeof(n));\n"
+				    "				if (n > %2$u)\n"
+				    "					return -EINVAL;\n"
+				    "				%1$s_len = n;\n"
+				    "			}\n",
+				    expr, qmm->array_size,
+				    message_array_len_type(qmm));
+			if (qmm->type == TYPE_STRUCT)
+				fprintf(fp, "			%1$s.ptr = p;\n"
+					    "			%1$s.len = end - p;\n",
+					    expr);
+			else
+				fprintf(fp, "			if ((size_t)(end - p) < %1$s_len * sizeof(%2$s))\n"
+					    "				return -EINVAL;\n"
+					    "			%1$s = (const %3$s *)p;\n",
+					    expr, sz_native_types[qmm->type],
+					    view_elem_type(qmm->type));
+		} else {
+			emit_decode_value(ctx, fp, "\t\t\t", expr, qmm->type, qmm->qmi_struct, NULL);
+		}
+
+		if (message_member_is_optional(qmm))
+			fprintf(fp, "			%s_valid = true;\n", expr);
+		fprintf(fp, "			break;\n");
+	}
+
+	fprintf(fp, "		default:\n"
+		    "			/* Unknown TLVs are skipped */\n"
+		    "			break;\n"
+		    "		}\n"
+		    "\n"
+		    "		p = end;\n"
+		    "	}\n"
+		    "\n"
+		    "	return 0;\n"
+		    "}\n"
+		    "\n");
+}
+
+static void emit_struct_view_next(struct qmi_ctx *ctx, FILE *fp, struct qmi_struct *qs)
+{
+	char name[256];
+
+	struct_name(ctx, name, sizeof(name), qs);
+
+	fprintf(fp, "int %1$s_view_next(struct %1$s *v, struct qmi_span *span)\n"
+		    "{\n"
+		    "	const uint8_t *p = span->ptr;\n"
+		    "	int ret;\n"
+		    "\n"
+		    "	ret = %1$s_decode_struct(v, &p, p + span->len);\n"
+		    "	if (ret < 0)\n"
+		    "		return ret;\n"
+		    "\n"
+		    "	span->len -= p - (const uint8_t *)span->ptr;\n"
+		    "	span->ptr = p;\n"
+		    "	return 0;\n"
+		    "}\n"
+		    "\n",
+		    name);
+}
+
+void codec_emit_view_c(struct qmi_ctx *ctx, FILE *fp)
+{
+	struct qmi_message *qm;
+	struct qmi_struct *qs;
+
+	list_for_each_entry(qs, &ctx->structs, node)
+		emit_struct_view_next(ctx, fp, qs);
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		emit_message_view_decoder(ctx, fp, qm);
+}
+
+static const struct {
+	const char *name;
+	int type;
+} view_loads[] = {
+	{ "u16", TYPE_U16 },
+	{ "u32", TYPE_U32 },
+	{ "u64", TYPE_U64 },
+	{ "i16", TYPE_I16 },
+	{ "i32", TYPE_I32 },
+	{ "i64", TYPE_I64 },
+};
+
+void codec_emit_view_h(struct qmi_ctx *ctx, FILE *fp)
+{
+	struct qmi_message *qm;
+	struct qmi_struct *qs;
+	char name[256];
+	size_t i;
+
+	fprintf(fp, "#ifndef QMI_STRVIEW_DEFINED\n"
+		    "#define QMI_STRVIEW_DEFINED\n"
+		    "/* A string in a received message, not NUL-terminated */\n"
+		    "struct qmi_strview {\n"
+		    "	const char *ptr;\n"
+		    "	size_t len;\n"
+		    "};\n"
+		    "#endif\n"
+		    "\n"
+		    "#ifndef QMI_SPAN_DEFINED\n"
+		    "#define QMI_SPAN_DEFINED\n"
+		    "/* Encoded elements of an array of structs in a received message */\n"
+		    "struct qmi_span {\n"
+		    "	const void *ptr;\n"
+		    "	size_t len;\n"
+		    "};\n"
+		    "#endif\n"
+		    "\n");
+
+	fprintf(fp, "#ifndef QMI_VIEW_LOAD_DEFINED\n"
+		    "#define QMI_VIEW_LOAD_DEFINED\n"
+		    "/* Element @i of an array of integers in a view */\n");
+	for (i = 0; i < sizeof(view_loads) / sizeof(view_loads[0]); i++) {
+		fprintf(fp, "static inline %2$s qmi_view_%1$s(const uint8_t *p, size_t i)\n"
+			    "{\n"
+			    "	%2$s v;\n"
+			    "\n"
+			    "	memcpy(&v, p + i * sizeof(v), sizeof(v));\n"
+			    "	return v;\n"
+			    "}\n"
+			    "\n",
+			    view_loads[i].name, sz_native_types[view_loads[i].type]);
+	}
+	fprintf(fp, "#endif\n"
+		    "\n");
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		emit_message_view(ctx, fp, qm);
+
+	list_for_each_entry(qs, &ctx->structs, node)
+		fprintf(fp, "int %1$s_view_next(struct %1$s *v, struct qmi_span *span);\n",
+			struct_name(ctx, name, sizeof(name), qs));
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		fprintf(fp, "int %1$s_%2$s_decode_view(struct %1$s_%2$s_view *msg, const void *buf, size_t len);\n",
+			ctx->package.name, qm->name);
+	fprintf(fp, "\n");
+}
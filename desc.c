@@ -0,0 +1,307 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qmic.h"
+
+/*
+ * Relocation-free descriptor tables for the kernel style sources
+ *
+ * With KERNEL_CONST the qmi_elem_info tables, full of pointers which each
+ * need a relocation when loaded, are replaced by a single const array of
+ * struct qmi_elem_rec per package. It has the entries of the response type,
+ * then of each struct and then of each message, each list ending with a
+ * QMI_EOTI entry. Nested structs are referred to by the 1-based index of
+ * their first entry, so the array only holds integers and ends up in shared
+ * .rodata. Structs of the same shape share the entries of the first one.
+ *
+ * desc_emit_c() also records where each message starts, in rec_index, for
+ * the dispatch table.
+ */
+
+static bool uses_response_type(struct qmi_ctx *ctx)
+{
+	struct qmi_message_member *qmm;
+	struct qmi_message *qm;
+	struct qmi_struct *qs;
+
+	/* Structs of the same shape share its entries */
+	list_for_each_entry(qs, &ctx->structs, node) {
+		if (is_response_type(qs->shape))
+			return true;
+	}
+
+	list_for_each_entry(qm, &ctx->messages, node) {
+		list_for_each_entry(qmm, &qm->members, node) {
+			if (qmm->type == TYPE_STRUCT && is_response_type(qmm->qmi_struct))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static unsigned struct_entries(struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	unsigned count = 1;
+
+	list_for_each_entry(qsm, &qs->members, node)
+		count += qsm->is_ptr ? 2 : 1;
+
+	return count;
+}
+
+static unsigned message_entries(struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+	unsigned count = 1;
+
+	list_for_each_entry(qmm, &qm->members, node)
+		count += message_member_ei_entries(qmm);
+
+	return count;
+}
+
+/* The response type's entries come first, when it's used */
+#define RESPONSE_INDEX 1
+
+/* Assign each struct and message the 1-based index of its first entry */
+static void assign_indices(struct qmi_ctx *ctx)
+{
+	unsigned index = uses_response_type(ctx) ? 4 : 1;
+	struct qmi_message *qm;
+	struct qmi_struct *qs;
+
+	list_for_each_entry(qs, &ctx->structs, node) {
+		if (qs->shape != qs)
+			continue;
+
+		qs->rec_index = index;
+		index += struct_entries(qs);
+	}
+
+	/* Structs shaped like an earlier one use its entries */
+	list_for_each_entry(qs, &ctx->structs, node) {
+		if (is_response_type(qs->shape))
+			qs->rec_index = RESPONSE_INDEX;
+		else
+			qs->rec_index = qs->shape->rec_index;
+	}
+
+	list_for_each_entry(qm, &ctx->messages, node) {
+		qm->rec_index = index;
+		index += message_entries(qm);
+	}
+}
+
+static void emit_rec(FILE *fp, const char *data_type, const char *array_type,
+		     unsigned tlv_type, unsigned elem_len, const char *elem_size,
+		     const char *offset, unsigned ei_array)
+{
+	fprintf(fp, "\t{ .data_type = %s, ", data_type);
+	if (array_type)
+		fprintf(fp, ".array_type = %s, ", array_type);
+	if (tlv_type)
+		fprintf(fp, ".tlv_type = 0x%02x, ", tlv_type);
+	fprintf(fp, ".elem_len = %u, .elem_size = %s, .offset = %s",
+		elem_len, elem_size, offset);
+	if (ei_array)
+		fprintf(fp, ", .ei_array = %u", ei_array);
+	fprintf(fp, " },\n");
+}
+
+static void emit_rec_end(FILE *fp)
+{
+	fprintf(fp, "\t{ .data_type = QMI_EOTI },\n");
+}
+
+static void emit_response_recs(FILE *fp)
+{
+	fprintf(fp, "\t/* qmi_response_type_v01 */\n");
+	emit_rec(fp, "QMI_UNSIGNED_2_BYTE", NULL, 0, 1, "sizeof(uint16_t)",
+		 "offsetof(struct qmi_response_type_v01, result)", 0);
+	emit_rec(fp, "QMI_UNSIGNED_2_BYTE", NULL, 0, 1, "sizeof(uint16_t)",
+		 "offsetof(struct qmi_response_type_v01, error)", 0);
+	emit_rec_end(fp);
+}
+
+static void emit_struct_recs(struct qmi_ctx *ctx, FILE *fp, struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	const char *array_type;
+	char elem_size[256];
+	char offset[600];
+	char self[256];
+
+	snprintf(self, sizeof(self), "%s_%s", ctx->package.name, qs->name);
+
+	fprintf(fp, "\t/* %u: %s */\n", qs->rec_index, self);
+
+	list_for_each_entry(qsm, &qs->members, node) {
+		if (qsm->is_ptr) {
+			snprintf(elem_size, sizeof(elem_size), "sizeof(%s)",
+				 sz_native_types[qsm->array_len_type]);
+			snprintf(offset, sizeof(offset), "offsetof(struct %s, %s_len)",
+				 self, qsm->name);
+			emit_rec(fp, "QMI_DATA_LEN", NULL, 0, 1, elem_size, offset, 0);
+		}
+
+		if (qsm->array_fixed)
+			array_type = "STATIC_ARRAY";
+		else if (qsm->is_ptr)
+			array_type = "VAR_LEN_ARRAY";
+		else
+			array_type = NULL;
+
+		snprintf(offset, sizeof(offset), "offsetof(struct %s, %s)", self, qsm->name);
+
+		switch (qsm->type) {
+		case TYPE_STRING:
+			emit_rec(fp, "QMI_STRING", NULL, 0, struct_string_elem_len(qsm),
+				 "sizeof(char)", offset, 0);
+			break;
+		case TYPE_STRUCT:
+			snprintf(elem_size, sizeof(elem_size), "sizeof(struct %s_%s)",
+				 ctx->package.name, qsm->qmi_struct->name);
+			emit_rec(fp, "QMI_STRUCT", array_type, 0,
+				 array_type ? qsm->array_size : 1, elem_size, offset,
+				 qsm->qmi_struct->rec_index);
+			break;
+		default:
+			snprintf(elem_size, sizeof(elem_size), "sizeof(%s)",
+				 sz_native_types[qsm->type]);
+			emit_rec(fp, sz_data_types[qsm->type], array_type, 0,
+				 array_type ? qsm->array_size : 1, elem_size, offset, 0);
+			break;
+		}
+	}
+
+	emit_rec_end(fp);
+}
+
+static void emit_message_recs(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm)
+{
+	struct qmi_message_member *qmm;
+	const char *data_type;
+	char len_offset[600];
+	char elem_size[256];
+	char len_size[64];
+	char offset[600];
+	char self[256];
+	unsigned nested;
+
+	snprintf(self, sizeof(self), "%s_%s", ctx->package.name, qm->name);
+
+	fprintf(fp, "\t/* %u: %s */\n", qm->rec_index, self);
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		snprintf(offset, sizeof(offset), "offsetof(struct %s, %s)", self, qmm->name);
+
+		if (qmm->type == TYPE_STRING) {
+			emit_rec(fp, "QMI_STRING", "VAR_LEN_ARRAY", qmm->id,
+				 message_string_elem_len(qmm), "sizeof(char)", offset, 0);
+			continue;
+		}
+
+		if (qmm->type == TYPE_STRUCT && is_response_type(qmm->qmi_struct)) {
+			emit_rec(fp, "QMI_STRUCT", NULL, qmm->id, 1,
+				 "sizeof(struct qmi_response_type_v01)", offset,
+				 RESPONSE_INDEX);
+			continue;
+		}
+
+		if (!qmm->required) {
+			snprintf(offset, sizeof(offset), "offsetof(struct %s, %s_valid)",
+				 self, qmm->name);
+			emit_rec(fp, "QMI_OPT_FLAG", NULL, qmm->id, 1, "sizeof(bool)",
+				 offset, 0);
+			snprintf(offset, sizeof(offset), "offsetof(struct %s, %s)",
+				 self, qmm->name);
+		}
+
+		if (qmm->type == TYPE_STRUCT) {
+			data_type = "QMI_STRUCT";
+			snprintf(elem_size, sizeof(elem_size), "sizeof(struct %s_%s)",
+				 ctx->package.name, qmm->qmi_struct->name);
+			nested = qmm->qmi_struct->rec_index;
+		} else {
+			data_type = qmm->array_size ? "QMI_UNSIGNED_1_BYTE" : sz_data_types[qmm->type];
+			snprintf(elem_size, sizeof(elem_size), "sizeof(%s)",
+				 sz_native_types[qmm->type]);
+			nested = 0;
+		}
+
+		if (qmm->array_fixed && qmm->type != TYPE_STRUCT) {
+			emit_rec(fp, data_type, "STATIC_ARRAY", qmm->id,
+				 qmm->array_size, elem_size, offset, 0);
+		} else if (qmm->array_size) {
+			snprintf(len_size, sizeof(len_size), "sizeof(%s)",
+				 message_array_len_type(qmm));
+			snprintf(len_offset, sizeof(len_offset), "offsetof(struct %s, %s_len)",
+				 self, qmm->name);
+			emit_rec(fp, "QMI_DATA_LEN", NULL, qmm->id, 1, len_size,
+				 len_offset, 0);
+			emit_rec(fp, data_type, "VAR_LEN_ARRAY", qmm->id,
+				 qmm->array_size, elem_size, offset, nested);
+		} else {
+			emit_rec(fp, data_type, NULL, qmm->id, 1, elem_size, offset, nested);
+		}
+	}
+
+	emit_rec_end(fp);
+}
+
+void desc_emit_c(struct qmi_ctx *ctx, FILE *fp)
+{
+	struct qmi_message *qm;
+	struct qmi_struct *qs;
+
+	if (!uses_response_type(ctx) && list_empty(&ctx->structs) &&
+	    list_empty(&ctx->messages))
+		return;
+
+	assign_indices(ctx);
+
+	fprintf(fp, "const struct qmi_elem_rec %s_elems[] = {\n", ctx->package.name);
+
+	if (uses_response_type(ctx))
+		emit_response_recs(fp);
+
+	list_for_each_entry(qs, &ctx->structs, node) {
+		if (qs->shape == qs)
+			emit_struct_recs(ctx, fp, qs);
+	}
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		emit_message_recs(ctx, fp, qm);
+
+	fprintf(fp, "};\n"
+		    "\n");
+}
+
+void desc_emit_h(struct qmi_ctx *ctx, FILE *fp)
+{
+	fprintf(fp, "#ifndef QMI_ELEM_REC_DEFINED\n"
+		    "#define QMI_ELEM_REC_DEFINED\n"
+		    "/*\n"
+		    " * Counterpart of struct qmi_elem_info without pointers; ei_array is the\n"
+		    " * 1-based index of the entries of a nested struct in the same array\n"
+		    " */\n"
+		    "struct qmi_elem_rec {\n"
+		    "	uint32_t elem_len;\n"
+		    "	uint32_t elem_size;\n"
+		    "	uint32_t offset;\n"
+		    "	uint32_t ei_array;\n"
+		    "	uint8_t data_type;	/* enum qmi_elem_type */\n"
+		    "	uint8_t array_type;	/* enum qmi_array_type */\n"
+		    "	uint8_t tlv_type;\n"
+		    "};\n"
+		    "#endif\n"
+		    "\n");
+
+	fprintf(fp, "extern const struct qmi_elem_rec %s_elems[];\n"
+		    "\n",
+		    ctx->package.name);
+}
@@ -0,0 +1,371 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qmic.h"
+
+/*
+ * Message dispatch table for the kernel style sources
+ *
+ * With KERNEL_DISPATCH, <pkg>_lookup() maps the type and msg_id of a
+ * received message to its descriptor, with the ei table, its tlv_index when
+ * the codecs are compiled, the size of the native struct and a slot for a
+ * handler. When the msg_ids are close together the descriptors are indexed
+ * by type and msg_id directly, otherwise through a perfect hash of the two
+ * found at compile time. The table is built once per package, for both the
+ * source and the header.
+ *
+ * With KERNEL_CONST the descriptors are struct qmi_message_rec instead, which
+ * refer to the relocation-free tables of desc.c by index and have no handler
+ * slot, so they can be const.
+ */
+
+/* Direct indexing as long as it takes at most this many slots per message */
+#define DISPATCH_DENSE_SLOTS 4
+
+#define DISPATCH_HASH_TRIES 10000
+
+struct dispatch {
+	/* Messages in the table; ids which don't fit the wire are left out */
+	struct qmi_message **messages;
+	unsigned count;
+
+	bool dense;
+
+	/* Direct indexing */
+	unsigned min_id;
+	unsigned span;
+
+	/* Perfect hashing */
+	uint32_t mult;
+	unsigned bits;
+
+	/* 1-based index of the message in each slot, 0 when empty */
+	uint16_t *slots;
+	unsigned nslots;
+};
+
+static uint32_t dispatch_key(unsigned type, unsigned msg_id)
+{
+	return (uint32_t)type << 16 | msg_id;
+}
+
+static unsigned dispatch_hash(struct dispatch *d, uint32_t key)
+{
+	return (uint32_t)(key * d->mult) >> (32 - d->bits);
+}
+
+static bool dispatch_try_hash(struct dispatch *d)
+{
+	struct qmi_message *qm;
+	unsigned slot;
+	unsigned i;
+
+	memset(d->slots, 0, d->nslots * sizeof(*d->slots));
+
+	for (i = 0; i < d->count; i++) {
+		qm = d->messages[i];
+		slot = dispatch_hash(d, dispatch_key(qm->type, qm->msg_id));
+		if (d->slots[slot])
+			return false;
+
+		d->slots[slot] = i + 1;
+	}
+
+	return true;
+}
+
+static struct dispatch *dispatch_build(struct qmi_ctx *ctx)
+{
+	struct qmi_message *qm;
+	struct dispatch *d;
+	unsigned max_id = 0;
+	unsigned tries;
+	unsigned i;
+
+	if (ctx->dispatch)
+		return ctx->dispatch;
+
+	d = arena_alloc(&ctx->arena, sizeof(*d));
+	memset(d, 0, sizeof(*d));
+	ctx->dispatch = d;
+
+	list_for_each_entry(qm, &ctx->messages, node)
+		d->count++;
+	d->messages = arena_alloc(&ctx->arena, (d->count + 1) * sizeof(*d->messages));
+	d->count = 0;
+
+	d->min_id = UINT16_MAX;
+	list_for_each_entry(qm, &ctx->messages, node) {
+		if (qm->msg_id > UINT16_MAX)
+			continue;
+
+		/* The first of several messages with the same type and id wins */
+		for (i = 0; i < d->count; i++)
+			if (d->messages[i]->type == qm->type &&
+			    d->messages[i]->msg_id == qm->msg_id)
+				break;
+		if (i < d->count)
+			continue;
+
+		d->messages[d->count++] = qm;
+		if (qm->msg_id < d->min_id)
+			d->min_id = qm->msg_id;
+		if (qm->msg_id > max_id)
+			max_id = qm->msg_id;
+	}
+
+	if (!d->count)
+		return d;
+
+	d->span = max_id - d->min_id + 1;
+	if (d->span <= DISPATCH_DENSE_SLOTS * d->count) {
+		d->dense = true;
+		d->nslots = 3 * d->span;
+		d->slots = arena_alloc(&ctx->arena, d->nslots * sizeof(*d->slots));
+
+		for (i = 0; i < d->count; i++) {
+			qm = d->messages[i];
+			d->slots[qm->type / 2 * d->span + qm->msg_id - d->min_id] = i + 1;
+		}
+		return d;
+	}
+
+	/* Start at twice as many slots as messages, for a hit to come quickly */
+	for (d->bits = 1; (1u << d->bits) < 2 * d->count; d->bits++)
+		;
+
+	for (; d->bits <= 16; d->bits++) {
+		d->nslots = 1u << d->bits;
+		d->slots = arena_alloc(&ctx->arena, d->nslots * sizeof(*d->slots));
+
+		/* Odd multipliers, starting from Knuth's 2^32 / phi */
+		for (tries = 0; tries < DISPATCH_HASH_TRIES; tries++) {
+			d->mult = 2654435761u + 2 * tries;
+			if (dispatch_try_hash(d))
+				return d;
+		}
+	}
+
+	errx(1, "no perfect hash found for the messages of %s", ctx->package.name);
+}
+
+static void emit_dispatch_messages(struct qmi_ctx *ctx, FILE *fp, struct dispatch *d,
+				   unsigned flags)
+{
+	struct qmi_message *qm;
+	unsigned i;
+
+	fprintf(fp, "struct qmi_message_desc %s_messages[] = {\n", ctx->package.name);
+
+	for (i = 0; i < d->count; i++) {
+		qm = d->messages[i];
+
+		fprintf(fp, "\t{\n"
+			    "\t\t.type = %d,\n"
+			    "\t\t.msg_id = 0x%04x,\n",
+			qm->type, qm->msg_id);
+		/* libqrtr can't interpret presence masks, see kernel.c */
+		if (flags & KERNEL_MASK)
+			fprintf(fp, "\t\t.ei = NULL,\n"
+				    "\t\t.tlv_index = NULL,\n");
+		else if (!(flags & KERNEL_CODEC))
+			fprintf(fp, "\t\t.ei = %s_%s_ei,\n"
+				    "\t\t.tlv_index = NULL,\n",
+				ctx->package.name, qm->name);
+		else
+			fprintf(fp, "\t\t.ei = %1$s_%2$s_ei,\n"
+				    "\t\t.tlv_index = %1$s_%2$s_tlv_index,\n",
+				ctx->package.name, qm->name);
+		fprintf(fp, "\t\t.size = sizeof(struct %1$s_%2$s),\n"
+			    "\t\t.name = \"%2$s\",\n"
+			    "\t},\n",
+			ctx->package.name, qm->name);
+	}
+
+	fprintf(fp, "};\n"
+		    "\n");
+}
+
+/* The same without pointers, the names are all in one string */
+static void emit_dispatch_recs(struct qmi_ctx *ctx, FILE *fp, struct dispatch *d)
+{
+	struct qmi_message *qm;
+	unsigned name = 0;
+	unsigned i;
+
+	fprintf(fp, "const char %s_names[] =\n", ctx->package.name);
+	for (i = 0; i < d->count; i++)
+		fprintf(fp, "\t\"%s\\0\"%s\n", d->messages[i]->name,
+			i == d->count - 1 ? ";" : "");
+	fprintf(fp, "\n");
+
+	fprintf(fp, "const struct qmi_message_rec %s_messages[] = {\n", ctx->package.name);
+
+	for (i = 0; i < d->count; i++) {
+		qm = d->messages[i];
+
+		fprintf(fp, "\t{ .type = %1$d, .msg_id = 0x%2$04x, .elems = %3$u, .name = %4$u, "
+			    ".size = sizeof(struct %5$s_%6$s) },\n",
+			qm->type, qm->msg_id, qm->rec_index, name,
+			ctx->package.name, qm->name);
+
+		name += strlen(qm->name) + 1;
+	}
+
+	fprintf(fp, "};\n"
+		    "\n");
+}
+
+static void emit_dispatch_slots(FILE *fp, struct dispatch *d)
+{
+	unsigned i;
+
+	for (i = 0; i < d->nslots; i++) {
+		if (d->slots[i])
+			fprintf(fp, "\t[%u] = %u,\n", i, d->slots[i]);
+	}
+}
+
+/* Type of the descriptors, which are relocation-free with KERNEL_CONST */
+static const char *dispatch_desc_type(unsigned flags)
+{
+	if (flags & KERNEL_CONST)
+		return "const struct qmi_message_rec";
+
+	return "struct qmi_message_desc";
+}
+
+void dispatch_emit_c(struct qmi_ctx *ctx, FILE *fp, unsigned flags)
+{
+	const char *desc = dispatch_desc_type(flags);
+	const char *package = ctx->package.name;
+	struct dispatch *d;
+
+	if (!(flags & KERNEL_DISPATCH))
+		return;
+
+	d = dispatch_build(ctx);
+
+	if (!d->count) {
+		fprintf(fp, "%s *%s_lookup(unsigned type, unsigned msg_id)\n"
+			    "{\n"
+			    "	(void)type;\n"
+			    "	(void)msg_id;\n"
+			    "	return NULL;\n"
+			    "}\n"
+			    "\n",
+			desc, package);
+		return;
+	}
+
+	if (flags & KERNEL_CONST)
+		emit_dispatch_recs(ctx, fp, d);
+	else
+		emit_dispatch_messages(ctx, fp, d, flags);
+
+	fprintf(fp, "static const uint16_t %s_dispatch[%u] = {\n", package, d->nslots);
+	emit_dispatch_slots(fp, d);
+	fprintf(fp, "};\n"
+		    "\n");
+
+	if (d->dense) {
+		/* Slots are per type, requests, responses and then indications */
+		fprintf(fp, "%5$s *%1$s_lookup(unsigned type, unsigned msg_id)\n"
+			    "{\n"
+			    "	unsigned idx;\n"
+			    "\n"
+			    "	if (type > %2$d || type %% 2 || msg_id - 0x%3$04x >= %4$u)\n"
+			    "		return NULL;\n"
+			    "\n"
+			    "	idx = %1$s_dispatch[type / 2 * %4$u + msg_id - 0x%3$04x];\n"
+			    "	return idx ? &%1$s_messages[idx - 1] : NULL;\n"
+			    "}\n"
+			    "\n",
+			package, MESSAGE_INDICATION, d->min_id, d->span, desc);
+	} else {
+		fprintf(fp, "%4$s *%1$s_lookup(unsigned type, unsigned msg_id)\n"
+			    "{\n"
+			    "	%4$s *desc;\n"
+			    "	uint32_t key = (uint32_t)type << 16 | msg_id;\n"
+			    "	unsigned idx;\n"
+			    "\n"
+			    "	idx = %1$s_dispatch[(uint32_t)(key * %2$uu) >> %3$u];\n"
+			    "	if (!idx)\n"
+			    "		return NULL;\n"
+			    "\n"
+			    "	desc = &%1$s_messages[idx - 1];\n"
+			    "	if (desc->type != type || desc->msg_id != msg_id)\n"
+			    "		return NULL;\n"
+			    "\n"
+			    "	return desc;\n"
+			    "}\n"
+			    "\n",
+			package, d->mult, 32 - d->bits, desc);
+	}
+}
+
+void dispatch_emit_h(struct qmi_ctx *ctx, FILE *fp, unsigned flags)
+{
+	struct dispatch *d;
+
+	if (!(flags & KERNEL_DISPATCH))
+		return;
+
+	/* Without messages there are no tables, just a lookup finding nothing */
+	d = dispatch_build(ctx);
+
+	if (flags & KERNEL_CONST) {
+		fprintf(fp, "#ifndef QMI_MESSAGE_REC_DEFINED\n"
+			    "#define QMI_MESSAGE_REC_DEFINED\n"
+			    "/*\n"
+			    " * Counterpart of struct qmi_message_desc without pointers; elems is\n"
+			    " * the 1-based index of its entries in <pkg>_elems[] and name the\n"
+			    " * offset of its name in <pkg>_names[]\n"
+			    " */\n"
+			    "struct qmi_message_rec {\n"
+			    "	uint32_t size;\n"
+			    "	uint32_t elems;\n"
+			    "	uint32_t name;\n"
+			    "	uint16_t msg_id;\n"
+			    "	uint8_t type;\n"
+			    "};\n"
+			    "#endif\n"
+			    "\n");
+
+		if (d->count)
+			fprintf(fp, "extern const char %1$s_names[];\n"
+				    "extern const struct qmi_message_rec %1$s_messages[];\n",
+				    ctx->package.name);
+		fprintf(fp, "const struct qmi_message_rec *%s_lookup(unsigned type, unsigned msg_id);\n"
+			    "\n",
+			    ctx->package.name);
+		return;
+	}
+
+	fprintf(fp, "#ifndef QMI_MESSAGE_DESC_DEFINED\n"
+		    "#define QMI_MESSAGE_DESC_DEFINED\n"
+		    "/* A message of a service, as found by <pkg>_lookup() */\n"
+		    "struct qmi_message_desc {\n"
+		    "	unsigned type;\n"
+		    "	unsigned msg_id;\n"
+		    "	struct qmi_elem_info *ei;\n"
+		    "	/* 1-based index into ei of the first entry of each TLV type, if any */\n"
+		    "	const uint8_t *tlv_index;\n"
+		    "	size_t size;\n"
+		    "	const char *name;\n"
+		    "\n"
+		    "	/* Free for the user, e.g. for the handler of received messages */\n"
+		    "	void (*handler)(const struct qmi_message_desc *desc, void *msg, void *data);\n"
+		    "};\n"
+		    "#endif\n"
+		    "\n");
+
+	if (d->count)
+		fprintf(fp, "extern struct qmi_message_desc %s_messages[];\n",
+			ctx->package.name);
+	fprintf(fp, "struct qmi_message_desc *%s_lookup(unsigned type, unsigned msg_id);\n"
+		    "\n",
+		    ctx->package.name);
+}
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,19 +7,7 @@
 
 #include "qmic.h"
 
-static const char *sz_native_types[] = {
-	[TYPE_U8] = "uint8_t",
-	[TYPE_U16] = "uint16_t",
-	[TYPE_U32] = "uint32_t",
-	[TYPE_U64] = "uint64_t",
-	[TYPE_I8] = "int8_t",
-	[TYPE_I16] = "int16_t",
-	[TYPE_I32] = "int32_t",
-	[TYPE_I64] = "int64_t",
-	[TYPE_CHAR] = "char",
-};
-
-static const char *sz_data_types[] = {
+const char *sz_data_types[] = {
 	[TYPE_U8] = "QMI_UNSIGNED_1_BYTE",
 	[TYPE_U16] = "QMI_UNSIGNED_2_BYTE",
 	[TYPE_U32] = "QMI_UNSIGNED_4_BYTE",
@@ -30,19 +19,160 @@ static const char *sz_data_types[] = {
 	[TYPE_CHAR] = "QMI_SIGNED_1_BYTE",
 };
 
-static void emit_struct_definition(FILE *fp,
-				   struct qmi_struct *qs)
+/*
+ * In-memory layout of the emitted structs
+ *
+ * The members of each struct are collected along with their size and
+ * alignment before being emitted. With KERNEL_PACK they are reordered by
+ * alignment, with the _valid flags grouped at the end, and length members
+ * are only as wide as on the wire, to leave as little padding as possible.
+ * The qmi_elem_info tables and the codecs refer to the members by name, so
+ * the wire format doesn't depend on the order.
+ */
+struct c_field {
+	char *decl;
+	unsigned size;
+	unsigned align;
+	bool flag;
+};
+
+struct c_layout {
+	struct c_field *fields;
+	unsigned count;
+	/* Leading fields which keep their place */
+	unsigned pinned;
+	unsigned size;
+	unsigned align;
+};
+
+static const unsigned native_align[] = {
+	[TYPE_U8] = _Alignof(uint8_t),
+	[TYPE_U16] = _Alignof(uint16_t),
+	[TYPE_U32] = _Alignof(uint32_t),
+	[TYPE_U64] = _Alignof(uint64_t),
+	[TYPE_I8] = _Alignof(int8_t),
+	[TYPE_I16] = _Alignof(int16_t),
+	[TYPE_I32] = _Alignof(int32_t),
+	[TYPE_I64] = _Alignof(int64_t),
+	[TYPE_CHAR] = _Alignof(char),
+};
+
+static const unsigned native_size[] = {
+	[TYPE_U8] = sizeof(uint8_t),
+	[TYPE_U16] = sizeof(uint16_t),
+	[TYPE_U32] = sizeof(uint32_t),
+	[TYPE_U64] = sizeof(uint64_t),
+	[TYPE_I8] = sizeof(int8_t),
+	[TYPE_I16] = sizeof(int16_t),
+	[TYPE_I32] = sizeof(int32_t),
+	[TYPE_I64] = sizeof(int64_t),
+	[TYPE_CHAR] = sizeof(char),
+};
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+static void layout_init(struct qmi_ctx *ctx, struct c_layout *l, unsigned members)
+{
+	memset(l, 0, sizeof(*l));
+
+	/*
+	 * Each member has at most a _valid flag, a length and a value, messages
+	 * also have the header and possibly a presence mask
+	 */
+	l->fields = arena_alloc(&ctx->arena, (3 * members + 2) * sizeof(struct c_field));
+}
+
+static void layout_add(struct qmi_ctx *ctx, struct c_layout *l, unsigned size,
+		       unsigned align, bool flag, const char *fmt, ...)
+{
+	struct c_field *field = &l->fields[l->count++];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	field->decl = arena_alloc(&ctx->arena, len + 1);
+
+	va_start(ap, fmt);
+	vsnprintf(field->decl, len + 1, fmt, ap);
+	va_end(ap);
+
+	field->size = size;
+	field->align = align;
+	field->flag = flag;
+}
+
+/* Wider alignment first, then everything but the flags, keeping IDL order */
+static bool layout_before(struct c_field *a, struct c_field *b)
+{
+	if (a->align != b->align)
+		return a->align > b->align;
+
+	return !a->flag && b->flag;
+}
+
+static void layout_finish(struct c_layout *l, bool pack)
+{
+	struct c_field field;
+	unsigned offset = 0;
+	unsigned i;
+	unsigned j;
+
+	if (pack) {
+		for (i = l->pinned + 1; i < l->count; i++) {
+			field = l->fields[i];
+			for (j = i; j > l->pinned && layout_before(&field, &l->fields[j - 1]); j--)
+				l->fields[j] = l->fields[j - 1];
+			l->fields[j] = field;
+		}
+	}
+
+	l->align = 1;
+	for (i = 0; i < l->count; i++) {
+		offset = ALIGN_UP(offset, l->fields[i].align) + l->fields[i].size;
+		if (l->fields[i].align > l->align)
+			l->align = l->fields[i].align;
+	}
+
+	l->size = ALIGN_UP(offset, l->align);
+}
+
+static void emit_layout(FILE *fp, struct c_layout *l)
+{
+	unsigned i;
+
+	for (i = 0; i < l->count; i++)
+		fprintf(fp, "\t%s\n", l->fields[i].decl);
+}
+
+static void struct_layout(struct qmi_ctx *ctx, struct qmi_struct *qs, bool pack,
+			  struct c_layout *l)
 {
 	struct qmi_struct_member *qsm;
+	struct c_layout nested;
+	unsigned members = 0;
+	unsigned count;
+
+	list_for_each_entry(qsm, &qs->members, node)
+		members++;
 
-	fprintf(fp, "struct %s_%s {\n", qmi_package.name, qs->name);
+	layout_init(ctx, l, members);
 
 	list_for_each_entry(qsm, &qs->members, node) {
+		if (qsm->array_fixed || qsm->is_ptr)
+			count = qsm->array_size;
+		else
+			count = 1;
+
 		if (qsm->is_ptr) {
-			fprintf(fp, "\t%s %s_len;\n",
-				sz_native_types[qsm->array_len_type],
-				qsm->name);
+			layout_add(ctx, l, native_size[qsm->array_len_type],
+				   native_align[qsm->array_len_type], false,
+				   "%s %s_len;",
+				   sz_native_types[qsm->array_len_type], qsm->name);
 		}
+
 		switch (qsm->type) {
 		case TYPE_U8:
 		case TYPE_U16:
@@ -56,29 +186,187 @@ static void emit_struct_definition(FILE *fp,
 			// FIXME: rock and a hard place here, we libqrtr needs
 			// to be extended to support allocating memory for variable
 			// arrays
-			fprintf(fp, "\t%s %s", sz_native_types[qsm->type],
-				qsm->name);
+			layout_add(ctx, l, count * native_size[qsm->type],
+				   native_align[qsm->type], false,
+				   qsm->array_fixed || qsm->is_ptr ? "%s %s[%u];" : "%s %s;",
+				   sz_native_types[qsm->type], qsm->name, count);
+			break;
+		case TYPE_STRING:
+			if (pack)
+				layout_add(ctx, l, sizeof(uint16_t), _Alignof(uint16_t), false,
+					   "uint16_t %s_len;", qsm->name);
+			else
+				layout_add(ctx, l, sizeof(uint32_t), _Alignof(uint32_t), false,
+					   "uint32_t %s_len;", qsm->name);
+			layout_add(ctx, l, struct_string_elem_len(qsm), 1, false,
+				   "char %s[%u];", qsm->name, struct_string_elem_len(qsm));
+			break;
+		case TYPE_STRUCT:
+			struct_layout(ctx, qsm->qmi_struct, pack, &nested);
+			layout_add(ctx, l, count * nested.size, nested.align, false,
+				   qsm->array_fixed || qsm->is_ptr ? "struct %s_%s %s[%u];" : "struct %s_%s %s;",
+				   ctx->package.name, qsm->qmi_struct->name, qsm->name, count);
+			break;
+		}
+	}
+
+	layout_finish(l, pack);
+}
+
+/*
+ * struct qmi_message_header of libqrtr: a packed seven byte qmi_header, the
+ * ei pointer, the service and the name pointer
+ */
+static void header_field(struct qmi_ctx *ctx, struct c_layout *l)
+{
+	unsigned size;
+
+	size = ALIGN_UP(7, _Alignof(void *)) + sizeof(void *);
+	size = ALIGN_UP(size + sizeof(uint32_t), _Alignof(void *)) + sizeof(void *);
+
+	layout_add(ctx, l, size, _Alignof(void *), false,
+		   "struct qmi_message_header hdr;");
+	l->pinned = 1;
+}
+
+static void message_len_field(struct qmi_ctx *ctx, struct c_layout *l,
+			      struct qmi_message_member *qmm, bool pack)
+{
+	const char *type = "uint32_t";
+	unsigned size = sizeof(uint32_t);
+
+	if (pack) {
+		type = message_array_len_type(qmm);
+		size = message_array_len_size(qmm);
+	}
+
+	layout_add(ctx, l, size, size, false, "%s %s_len;", type, qmm->name);
+}
+
+static void message_layout(struct qmi_ctx *ctx, struct qmi_message *qm, unsigned flags,
+			   struct c_layout *l)
+{
+	bool pack = flags & KERNEL_PACK;
+	bool mask = flags & KERNEL_MASK;
+	struct qmi_message_member *qmm;
+	struct qmi_struct *qs;
+	struct c_layout nested;
+	unsigned members = 0;
+
+	list_for_each_entry(qmm, &qm->members, node)
+		members++;
+
+	layout_init(ctx, l, members);
+	header_field(ctx, l);
+
+	if (mask && message_optional_count(qm)) {
+		if (strcmp(message_mask_type(qm), "uint64_t"))
+			layout_add(ctx, l, sizeof(uint32_t), _Alignof(uint32_t), false,
+				   "uint32_t present;");
+		else
+			layout_add(ctx, l, sizeof(uint64_t), _Alignof(uint64_t), false,
+				   "uint64_t present;");
+	}
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		switch (qmm->type) {
+		case TYPE_U8:
+		case TYPE_U16:
+		case TYPE_U32:
+		case TYPE_U64:
+		case TYPE_I8:
+		case TYPE_I16:
+		case TYPE_I32:
+		case TYPE_I64:
+		case TYPE_CHAR:
+			if (!qmm->required && !mask)
+				layout_add(ctx, l, sizeof(bool), _Alignof(bool), true,
+					   "bool %s_valid;", qmm->name);
+
+			if (qmm->array_size) {
+				message_len_field(ctx, l, qmm, pack);
+				layout_add(ctx, l, qmm->array_size * native_size[qmm->type],
+					   native_align[qmm->type], false,
+					   "%s %s[%d];  // 0x%02x", sz_native_types[qmm->type],
+					   qmm->name, qmm->array_size, qmm->id);
+			} else {
+				layout_add(ctx, l, native_size[qmm->type],
+					   native_align[qmm->type], false,
+					   "%s %s;  // 0x%02x", sz_native_types[qmm->type],
+					   qmm->name, qmm->id);
+			}
 			break;
 		case TYPE_STRING:
-			fprintf(fp, "\tuint32_t %s_len;\n", qsm->name);
-			fprintf(fp, "\tchar %s", qsm->name);
+			if (pack)
+				layout_add(ctx, l, sizeof(uint16_t), _Alignof(uint16_t), false,
+					   "uint16_t %s_len;", qmm->name);
+			else
+				layout_add(ctx, l, sizeof(uint32_t), _Alignof(uint32_t), false,
+					   "uint32_t %s_len;", qmm->name);
+			layout_add(ctx, l, message_string_elem_len(qmm), 1, false,
+				   "char %s[%u]; // 0x%02x", qmm->name,
+				   message_string_elem_len(qmm), qmm->id);
 			break;
 		case TYPE_STRUCT:
-			fprintf(fp, "\tstruct %s_%s %s",
-				qmi_package.name, qsm->qmi_struct->name,
-				qsm->name);
+			qs = qmm->qmi_struct;
+
+			if (!strcmp(qs->name, "qmi_response_type_v01")) {
+				layout_add(ctx, l, 2 * sizeof(uint16_t), _Alignof(uint16_t), false,
+					   "struct %s %s;  // 0x%02x", qs->name, qmm->name, qmm->id);
+				break;
+			}
+
+			if (!qmm->required && !mask)
+				layout_add(ctx, l, sizeof(bool), _Alignof(bool), true,
+					   "bool %s_valid;", qmm->name);
+
+			struct_layout(ctx, qs, pack, &nested);
+			if (qmm->array_size) {
+				message_len_field(ctx, l, qmm, pack);
+				layout_add(ctx, l, qmm->array_size * nested.size, nested.align, false,
+					   "struct %s_%s %s[%d];  // 0x%02x", ctx->package.name, qs->name,
+					   qmm->name, qmm->array_size, qmm->id);
+			} else {
+				layout_add(ctx, l, nested.size, nested.align, false,
+					   "struct %s_%s %s;  // 0x%02x", ctx->package.name, qs->name,
+					   qmm->name, qmm->id);
+			}
 			break;
 		}
-		if (qsm->array_fixed || qsm->is_ptr || qsm->type == TYPE_STRING)
-				fprintf(fp, "[%d]", qsm->array_size);
-			fprintf(fp, ";\n");
 	}
 
+	layout_finish(l, pack);
+}
+
+/* Tell how much KERNEL_PACK saved on @name */
+static void report_layout(struct qmi_ctx *ctx, const char *name,
+			  struct c_layout *orig, struct c_layout *packed)
+{
+	fprintf(stderr, "%s: struct %s_%s: %u -> %u bytes, %u saved\n",
+		ctx->source ? ctx->source : "<stdin>", ctx->package.name, name,
+		orig->size, packed->size, orig->size - packed->size);
+}
+
+static void emit_struct_definition(struct qmi_ctx *ctx, FILE *fp,
+				   struct qmi_struct *qs, unsigned flags)
+{
+	struct c_layout packed;
+	struct c_layout l;
+
+	struct_layout(ctx, qs, false, &l);
+	if (flags & KERNEL_PACK) {
+		struct_layout(ctx, qs, true, &packed);
+		report_layout(ctx, qs->name, &l, &packed);
+		l = packed;
+	}
+
+	fprintf(fp, "struct %s_%s {\n", ctx->package.name, qs->name);
+	emit_layout(fp, &l);
 	fprintf(fp, "};\n");
 	fprintf(fp, "\n");
 }
 
-static void emit_struct_native_ei(FILE *fp,
+static void emit_struct_native_ei(struct qmi_ctx *ctx, FILE *fp,
 				 struct qmi_struct *qs,
 				 struct qmi_struct_member *qsm)
 {
@@ -90,7 +378,7 @@ static void emit_struct_native_ei(FILE *fp,
 			    "\t\t.elem_size = sizeof(%5$s),\n"
 			    "\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
 			    "\t},\n",
-			    qmi_package.name, qs->name, qsm->name,
+			    ctx->package.name, qs->name, qsm->name,
 			    sz_data_types[qsm->type], sz_native_types[qsm->type],
 			    qsm->array_size);
 	else if (qsm->is_ptr)
@@ -101,7 +389,7 @@ static void emit_struct_native_ei(FILE *fp,
 			    "\t\t.elem_size = sizeof(%5$s),\n"
 			    "\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
 			    "\t},\n",
-			    qmi_package.name, qs->name, qsm->name,
+			    ctx->package.name, qs->name, qsm->name,
 			    sz_data_types[qsm->type], sz_native_types[qsm->type],
 			    qsm->array_size);
 	else
@@ -111,41 +399,86 @@ static void emit_struct_native_ei(FILE *fp,
 			    "\t\t.elem_size = sizeof(%5$s),\n"
 			    "\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
 			    "\t},\n",
-			    qmi_package.name, qs->name, qsm->name,
+			    ctx->package.name, qs->name, qsm->name,
 			    sz_data_types[qsm->type], sz_native_types[qsm->type]);
 }
 
-static void emit_struct_nested_ei(FILE *fp,
+static void emit_struct_nested_ei(struct qmi_ctx *ctx, FILE *fp,
 				 struct qmi_struct *qs,
 				 struct qmi_struct_member *qsm)
 {
+	char ei[256];
+
+	struct_ei_name(ctx, ei, sizeof(ei), qsm->qmi_struct);
+
 	if (qsm->is_ptr) {
 		fprintf(fp, "\t{\n"
 			"\t\t.data_type = QMI_STRUCT,\n"
-			"\t\t.elem_len = 255,\n"
+			"\t\t.elem_len = %6$d,\n"
 			"\t\t.array_type = VAR_LEN_ARRAY,\n"
-			"\t\t.elem_size = sizeof(struct %1$s_%2$s),\n"
+			"\t\t.elem_size = sizeof(struct %1$s_%5$s),\n"
 			"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
-			"\t\t.ei_array = %1$s_%4$s_ei,\n"
+			"\t\t.ei_array = %4$s,\n"
 			"\t},\n",
-			qmi_package.name, qs->name, qsm->name, qsm->qmi_struct->name);
+			ctx->package.name, qs->name, qsm->name, ei,
+			qsm->qmi_struct->name, qsm->array_size);
 	} else {
 		fprintf(fp, "\t{\n"
 			"\t\t.data_type = QMI_STRUCT,\n"
 			"\t\t.elem_len = 1,\n"
-			"\t\t.elem_size = sizeof(struct %1$s_%2$s),\n"
+			"\t\t.elem_size = sizeof(struct %1$s_%5$s),\n"
 			"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
-			"\t\t.ei_array = %1$s_%4$s_ei,\n"
+			"\t\t.ei_array = %4$s,\n"
 			"\t},\n",
-			qmi_package.name, qs->name, qsm->name, qsm->qmi_struct->name);
+			ctx->package.name, qs->name, qsm->name, ei,
+			qsm->qmi_struct->name);
+	}
+}
+
+/*
+ * With -s, structs shaped like the response type have no table of their own
+ * to alias, libqrtr's is used instead; keep their names working in the
+ * sources using them
+ */
+static void emit_struct_ei_defines(struct qmi_ctx *ctx, FILE *fp)
+{
+	struct qmi_struct *qs;
+	bool any = false;
+
+	list_for_each_entry(qs, &ctx->structs, node) {
+		if (!is_response_type(qs->shape))
+			continue;
+
+		fprintf(fp, "#define %s_%s_ei qmi_response_type_v01_ei\n",
+			ctx->package.name, qs->name);
+		any = true;
 	}
+
+	if (any)
+		fprintf(fp, "\n");
 }
 
-static void emit_struct_ei(FILE *fp, struct qmi_struct *qs)
+static void emit_struct_ei(struct qmi_ctx *ctx, FILE *fp, struct qmi_struct *qs)
 {
 	struct qmi_struct_member *qsm;
+	char ei[256];
+
+	/*
+	 * With -s, structs shaped like an earlier one share its table, under
+	 * their own name as well; those shaped like the response type use
+	 * libqrtr's, with a #define for their name in the header
+	 */
+	if (qs->shape != qs) {
+		if (!is_response_type(qs->shape))
+			fprintf(fp, "extern struct qmi_elem_info %1$s_%2$s_ei[sizeof(%3$s) / sizeof(%3$s[0])] "
+				    "__attribute__((alias(\"%3$s\")));\n"
+				    "\n",
+				ctx->package.name, qs->name,
+				struct_ei_name(ctx, ei, sizeof(ei), qs));
+		return;
+	}
 
-	fprintf(fp, "struct qmi_elem_info %s_%s_ei[] = {\n", qmi_package.name, qs->name);
+	fprintf(fp, "struct qmi_elem_info %s_%s_ei[] = {\n", ctx->package.name, qs->name);
 
 	list_for_each_entry(qsm, &qs->members, node) {
 		if (qsm->is_ptr)
@@ -155,7 +488,7 @@ static void emit_struct_ei(FILE *fp, struct qmi_struct *qs)
 				"\t\t.elem_size = sizeof(%4$s),\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s_len),\n"
 				"\t},\n",
-				qmi_package.name, qs->name, qsm->name,
+				ctx->package.name, qs->name, qsm->name,
 				sz_native_types[qsm->array_len_type]);
 		switch (qsm->type) {
 		case TYPE_U8:
@@ -167,19 +500,20 @@ static void emit_struct_ei(FILE *fp, struct qmi_struct *qs)
 		case TYPE_I32:
 		case TYPE_I64:
 		case TYPE_CHAR:
-			emit_struct_native_ei(fp, qs, qsm);
+			emit_struct_native_ei(ctx, fp, qs, qsm);
 			break;
 		case TYPE_STRING:
 			fprintf(fp, "\t{\n"
 				    "\t\t.data_type = QMI_STRING,\n"
-				    "\t\t.elem_len = 256,\n"
+				    "\t\t.elem_len = %4$u,\n"
 				    "\t\t.elem_size = sizeof(char),\n"
 				    "\t\t.offset = offsetof(struct %1$s_%2$s, %3$s)\n"
 				    "\t},\n",
-				qmi_package.name, qs->name, qsm->name);
+				ctx->package.name, qs->name, qsm->name,
+				struct_string_elem_len(qsm));
 			break;
 		case TYPE_STRUCT:
-			emit_struct_nested_ei(fp, qs, qsm);
+			emit_struct_nested_ei(ctx, fp, qs, qsm);
 			break;
 		}
 	}
@@ -189,88 +523,67 @@ static void emit_struct_ei(FILE *fp, struct qmi_struct *qs)
 	fprintf(fp, "\n");
 }
 
-static void emit_native_type(FILE *fp, struct qmi_message *qm,
-			    struct qmi_message_member *qmm)
+/* Bits of the presence mask, with KERNEL_MASK */
+static void emit_msg_present_bits(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm)
 {
-	if (!qmm->required)
-		fprintf(fp, "\tbool %s_valid;\n", qmm->name);
-
-	if (qmm->array_size) {
-		fprintf(fp, "\tuint32_t %s_len;\n", qmm->name);
-		fprintf(fp, "\t%s %s[%d];  // 0x%02x\n", sz_native_types[qmm->type],
-			qmm->name, qmm->array_size, qmm->id);
-	} else {
-		fprintf(fp, "\t%s %s;  // 0x%02x\n", sz_native_types[qmm->type],
-			qmm->name, qmm->id);
-	}
-}
-
-static void emit_struct_type(FILE *fp, struct qmi_message *qm,
-			     struct qmi_message_member *qmm)
-{
-	struct qmi_struct *qs = qmm->qmi_struct;
+	const char *suffix = strcmp(message_mask_type(qm), "uint64_t") ? "U" : "ULL";
+	struct qmi_message_member *qmm;
 
-	if (!strcmp(qs->name, "qmi_response_type_v01")) {
-		fprintf(fp, "\tstruct %s %s;  // 0x%02x\n", qs->name, qmm->name, qmm->id);
+	if (!message_optional_count(qm))
 		return;
-	}
 
-	if (!qmm->required)
-		fprintf(fp, "\tbool %s_valid;\n", qmm->name);
+	list_for_each_entry(qmm, &qm->members, node) {
+		if (!message_member_is_optional(qmm))
+			continue;
 
-	if (qmm->array_size) {
-		fprintf(fp, "\tuint32_t %s_len;\n", qmm->name);
-		fprintf(fp, "\tstruct %s_%s %s[%d];  // 0x%02x\n", qmi_package.name, qs->name,
-			qmm->name, qmm->array_size, qmm->id);
-	} else {
-		fprintf(fp, "\tstruct %s_%s %s;  // 0x%02x\n", qmi_package.name, qs->name, qmm->name,
-			qmm->id);
+		fprintf(fp, "#define ");
+		emit_present_name(ctx, fp, qm, qmm);
+		fprintf(fp, " (1%s << %u)\n", suffix, message_present_bit(qm, qmm));
 	}
+	fprintf(fp, "\n");
 }
 
-static void emit_msg_struct(FILE *fp, struct qmi_message *qm)
+static void emit_msg_struct(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+			    unsigned flags)
 {
-	struct qmi_message_member *qmm;
+	struct c_layout packed;
+	struct c_layout l;
 
-	fprintf(fp, "struct %1$s_%2$s { // 0x%3$04x\n", qmi_package.name, qm->name, qm->msg_id);
-	fprintf(fp, "\tstruct qmi_message_header hdr;\n");
+	if (flags & KERNEL_MASK)
+		emit_msg_present_bits(ctx, fp, qm);
 
-	list_for_each_entry(qmm, &qm->members, node) {
-		switch (qmm->type) {
-		case TYPE_U8:
-		case TYPE_U16:
-		case TYPE_U32:
-		case TYPE_U64:
-		case TYPE_I8:
-		case TYPE_I16:
-		case TYPE_I32:
-		case TYPE_I64:
-		case TYPE_CHAR:
-			emit_native_type(fp, qm, qmm);
-			break;
-		case TYPE_STRING:
-			fprintf(fp, "\tuint32_t %s_len;\n", qmm->name);
-			fprintf(fp, "\tchar %s[256]; // 0x%02x\n", qmm->name, qmm->id);
-			break;
-		case TYPE_STRUCT:
-			emit_struct_type(fp, qm, qmm);
-			break;
-		}
+	message_layout(ctx, qm, flags & ~KERNEL_PACK, &l);
+	if (flags & KERNEL_PACK) {
+		message_layout(ctx, qm, flags, &packed);
+		report_layout(ctx, qm->name, &l, &packed);
+		l = packed;
 	}
 
+	fprintf(fp, "struct %1$s_%2$s { // 0x%3$04x\n", ctx->package.name, qm->name, qm->msg_id);
+	emit_layout(fp, &l);
 	fprintf(fp, "};\n");
 	fprintf(fp, "\n");
 }
 
-static void emit_msg_initialiser(FILE *fp,
-				    struct qmi_message *qm)
+static void emit_msg_initialiser(struct qmi_ctx *ctx, FILE *fp,
+				    struct qmi_message *qm, unsigned flags)
 {
 	struct qmi_message_member *qmm;
-	int initialiser_len = strlen(qmi_package.name) + strlen(qm->name) + 15; // "_, _INITIALIZER"
+	int initialiser_len = strlen(ctx->package.name) + strlen(qm->name) + 15; // "_, _INITIALIZER"
 	char *upper;
 	char *p = upper = memalloc(initialiser_len+1);
+	char ei[256];
+
+	/*
+	 * libqrtr can't interpret presence masks or the relocation-free
+	 * tables, there are no ei tables then
+	 */
+	if (flags & (KERNEL_MASK | KERNEL_CONST))
+		snprintf(ei, sizeof(ei), "NULL");
+	else
+		snprintf(ei, sizeof(ei), "%s_%s_ei", ctx->package.name, qm->name);
 
-	snprintf(upper, initialiser_len, "%s_%s_NEW", qmi_package.name, qm->name);
+	snprintf(upper, initialiser_len, "%s_%s_NEW", ctx->package.name, qm->name);
 	while (*p) {
 		*p = toupper(*p);
 		p++;
@@ -280,13 +593,13 @@ static void emit_msg_initialiser(FILE *fp,
 		    "	struct %2$s_%3$s *ptr = malloc(sizeof(struct %2$s_%3$s)); \\\n"
 		    "	ptr->hdr.qmi_header.type = %4$d; \\\n"
 		    "	ptr->hdr.qmi_header.msg_id = 0x%5$04x; \\\n"
-		    "	ptr->hdr.ei = %2$s_%3$s_ei; \\\n"
+		    "	ptr->hdr.ei = %7$s; \\\n"
 		    "	ptr->hdr.service = 0x%6$02x; \\\n"
 		    "	ptr->hdr.name = \"%3$s\"; ptr; })\n",
-		upper, qmi_package.name, qm->name, qm->type, qm->msg_id,
-		qmi_package.service_id);
+		upper, ctx->package.name, qm->name, qm->type, qm->msg_id,
+		ctx->package.service_id, ei);
 
-	snprintf(upper, initialiser_len, "%s_%s_INITIALIZER", qmi_package.name, qm->name);
+	snprintf(upper, initialiser_len, "%s_%s_INITIALIZER", ctx->package.name, qm->name);
 	p = upper;
 	while (*p) {
 		*p = toupper(*p);
@@ -294,10 +607,12 @@ static void emit_msg_initialiser(FILE *fp,
 	}
 
 	fprintf(fp, "#define %1$s { .hdr = { .qmi_header = { %2$d, 0, 0x%3$04x, 0 },\\\n"
-		    "	.ei = %4$s_%5$s_ei, \\\n"
+		    "	.ei = %4$s, \\\n"
 		    "	.service = 0x%6$02x, .name = \"%5$s\" } }\n",
-		upper, qm->type, qm->msg_id, qmi_package.name,
-		qm->name, qmi_package.service_id);
+		upper, qm->type, qm->msg_id, ei,
+		qm->name, ctx->package.service_id);
+
+	free(upper);
 
 	// list_for_each_entry(qmm, &qm->members, node) {
 	// 	switch (qmm->type) {
@@ -324,7 +639,7 @@ static void emit_msg_initialiser(FILE *fp,
 	// fprintf(fp, " }\n");
 }
 
-static void emit_native_ei(FILE *fp, struct qmi_message *qm,
+static void emit_native_ei(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
 			   struct qmi_message_member *qmm)
 {
 	if (!qmm->required) {
@@ -335,7 +650,7 @@ static void emit_native_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s_valid),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id);
+				ctx->package.name, qm->name, qmm->name, qmm->id);
 	}
 
 	if (qmm->array_fixed) {
@@ -347,7 +662,7 @@ static void emit_native_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id, qmm->array_size,
+				ctx->package.name, qm->name, qmm->name, qmm->id, qmm->array_size,
 				sz_native_types[qmm->type]);
 	} else if (qmm->array_size) {
 		if (qmm->array_len_type >= 0)
@@ -358,7 +673,7 @@ static void emit_native_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s_len),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id,
+				ctx->package.name, qm->name, qmm->name, qmm->id,
 				sz_native_types[qmm->array_len_type]);
 		else
 			fprintf(fp, "\t{\n"
@@ -368,7 +683,7 @@ static void emit_native_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s_len),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id,
+				ctx->package.name, qm->name, qmm->name, qmm->id,
 				qmm->array_size >= 256 ? "uint16_t" : "uint8_t");
 		fprintf(fp, "\t{\n"
 				"\t\t.data_type = QMI_UNSIGNED_1_BYTE,\n"
@@ -378,7 +693,7 @@ static void emit_native_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id, qmm->array_size,
+				ctx->package.name, qm->name, qmm->name, qmm->id, qmm->array_size,
 				sz_native_types[qmm->type]);
 	} else {
 		fprintf(fp, "\t{\n"
@@ -388,16 +703,17 @@ static void emit_native_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id,
+				ctx->package.name, qm->name, qmm->name, qmm->id,
 				sz_data_types[qmm->type],
 				sz_native_types[qmm->type]);
 	}
 }
 
-static void emit_struct_ref_ei(FILE *fp, struct qmi_message *qm,
+static void emit_struct_ref_ei(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
 			   struct qmi_message_member *qmm)
 {
 	struct qmi_struct *qs = qmm->qmi_struct;
+	char ei[256];
 
 	if (!strcmp(qs->name, "qmi_response_type_v01")) {
 		fprintf(fp, "\t{\n"
@@ -408,10 +724,12 @@ static void emit_struct_ref_ei(FILE *fp, struct qmi_message *qm,
 			    "\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
 			    "\t\t.ei_array = %5$s_ei,\n"
 			    "\t},\n",
-			    qmi_package.name, qm->name, qmm->name, qmm->id, qs->name);
+			    ctx->package.name, qm->name, qmm->name, qmm->id, qs->name);
 		return;
 	}
 
+	struct_ei_name(ctx, ei, sizeof(ei), qs);
+
 	if (!qmm->required) {
 		fprintf(fp, "\t{\n"
 				"\t\t.data_type = QMI_OPT_FLAG,\n"
@@ -420,7 +738,7 @@ static void emit_struct_ref_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s_valid),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id);
+				ctx->package.name, qm->name, qmm->name, qmm->id);
 	}
 
 	if (qmm->array_size) {
@@ -432,7 +750,7 @@ static void emit_struct_ref_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s_len),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id,
+				ctx->package.name, qm->name, qmm->name, qmm->id,
 				sz_native_types[qmm->array_len_type]);
 		else
 			fprintf(fp, "\t{\n"
@@ -442,7 +760,7 @@ static void emit_struct_ref_ei(FILE *fp, struct qmi_message *qm,
 				"\t\t.tlv_type = %4$d,\n"
 				"\t\t.offset = offsetof(struct %1$s_%2$s, %3$s_len),\n"
 				"\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id,
+				ctx->package.name, qm->name, qmm->name, qmm->id,
 				qmm->array_size >= 256 ? "uint16_t" : "uint8_t");
 
 		fprintf(fp, "\t{\n"
@@ -452,9 +770,10 @@ static void emit_struct_ref_ei(FILE *fp, struct qmi_message *qm,
 			    "\t\t.array_type = VAR_LEN_ARRAY,\n"
 			    "\t\t.tlv_type = %4$d,\n"
 			    "\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
-			    "\t\t.ei_array = %1$s_%5$s_ei,\n"
+			    "\t\t.ei_array = %7$s,\n"
 			    "\t},\n",
-			    qmi_package.name, qm->name, qmm->name, qmm->id, qs->name, qmm->array_size);
+			    ctx->package.name, qm->name, qmm->name, qmm->id, qs->name, qmm->array_size,
+			    ei);
 	} else {
 		fprintf(fp, "\t{\n"
 			    "\t\t.data_type = QMI_STRUCT,\n"
@@ -462,24 +781,98 @@ static void emit_struct_ref_ei(FILE *fp, struct qmi_message *qm,
 			    "\t\t.elem_size = sizeof(struct %1$s_%5$s),\n"
 			    "\t\t.tlv_type = %4$d,\n"
 			    "\t\t.offset = offsetof(struct %1$s_%2$s, %3$s),\n"
-			    "\t\t.ei_array = %1$s_%5$s_ei,\n"
+			    "\t\t.ei_array = %6$s,\n"
 			    "\t},\n",
-			    qmi_package.name, qm->name, qmm->name, qmm->id, qs->name);
+			    ctx->package.name, qm->name, qmm->name, qmm->id, qs->name, ei);
 	}
 }
 
-static void emit_elem_info_array_decl(FILE *fp, struct qmi_message *qm)
+/* Number of entries emit_elem_info_array() emits for @qmm */
+unsigned message_member_ei_entries(struct qmi_message_member *qmm)
+{
+	unsigned count = 0;
+
+	switch (qmm->type) {
+	case TYPE_STRING:
+		return 1;
+	case TYPE_STRUCT:
+		if (!strcmp(qmm->qmi_struct->name, "qmi_response_type_v01"))
+			return 1;
+
+		if (!qmm->required)
+			count++;
+		return count + (qmm->array_size ? 2 : 1);
+	default:
+		if (!qmm->required)
+			count++;
+		if (qmm->array_fixed)
+			return count + 1;
+		return count + (qmm->array_size ? 2 : 1);
+	}
+}
+
+static void emit_elem_info_array_decl(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+				      unsigned flags)
+{
+	fprintf(fp, "extern struct qmi_elem_info %s_%s_ei[];\n",
+		ctx->package.name, qm->name);
+
+	/* The TLV index goes along with the compiled codecs */
+	if (!(flags & KERNEL_CODEC))
+		return;
+
+	fprintf(fp, "extern const uint8_t %1$s_%2$s_tlv_index[256];\n"
+		    "\n"
+		    "/* Entries of %1$s_%2$s_ei[] for a TLV type start here, if known */\n"
+		    "static inline struct qmi_elem_info *%1$s_%2$s_ei_find(uint8_t tlv_type)\n"
+		    "{\n"
+		    "	uint8_t idx = %1$s_%2$s_tlv_index[tlv_type];\n"
+		    "\n"
+		    "	return idx ? &%1$s_%2$s_ei[idx - 1] : NULL;\n"
+		    "}\n"
+		    "\n",
+		ctx->package.name, qm->name);
+}
+
+/*
+ * Map from TLV type to the 1-based index of the first ei entry of its
+ * member, so decoders don't have to scan the ei array for each TLV
+ */
+static void emit_tlv_index(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm)
 {
-	fprintf(fp, "extern struct qmi_elem_info %1$s_%2$s_ei[];\n",
-		qmi_package.name, qm->name);
+	struct qmi_message_member *qmm;
+	uint8_t index[256] = {};
+	unsigned entry = 0;
+	unsigned i;
+
+	list_for_each_entry(qmm, &qm->members, node) {
+		/* The first of several members with the same id wins */
+		if (qmm->id >= 0 && qmm->id < 256 && !index[qmm->id]) {
+			if (entry >= UINT8_MAX)
+				errx(1, "message %s has too many ei entries for a tlv_index",
+				     qm->name);
+			index[qmm->id] = entry + 1;
+		}
+
+		entry += message_member_ei_entries(qmm);
+	}
+
+	fprintf(fp, "const uint8_t %s_%s_tlv_index[256] = {\n",
+		ctx->package.name, qm->name);
+	for (i = 0; i < 256; i++) {
+		if (index[i])
+			fprintf(fp, "\t[0x%02x] = %u,\n", i, index[i]);
+	}
+	fprintf(fp, "};\n");
+	fprintf(fp, "\n");
 }
 
-static void emit_elem_info_array(FILE *fp, struct qmi_message *qm)
+static void emit_elem_info_array(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm)
 {
 	struct qmi_message_member *qmm;
 
 	fprintf(fp, "struct qmi_elem_info %1$s_%2$s_ei[] = {\n",
-		qmi_package.name, qm->name);
+		ctx->package.name, qm->name);
 
 	list_for_each_entry(qmm, &qm->members, node) {
 		switch (qmm->type) {
@@ -492,21 +885,22 @@ static void emit_elem_info_array(FILE *fp, struct qmi_message *qm)
 		case TYPE_I32:
 		case TYPE_I64:
 		case TYPE_CHAR:
-			emit_native_ei(fp, qm, qmm);
+			emit_native_ei(ctx, fp, qm, qmm);
 			break;
 		case TYPE_STRUCT:
-			emit_struct_ref_ei(fp, qm, qmm);
+			emit_struct_ref_ei(ctx, fp, qm, qmm);
 			break;
 		case TYPE_STRING:
 			fprintf(fp, "\t{\n"
 				    "\t\t.data_type = QMI_STRING,\n"
-				    "\t\t.elem_len = 256,\n"
+				    "\t\t.elem_len = %5$u,\n"
 				    "\t\t.elem_size = sizeof(char),\n"
 				    "\t\t.array_type = VAR_LEN_ARRAY,\n"
 				    "\t\t.tlv_type = %4$d,\n"
 				    "\t\t.offset = offsetof(struct %1$s_%2$s, %3$s)\n"
 				    "\t},\n",
-				qmi_package.name, qm->name, qmm->name, qmm->id);
+				ctx->package.name, qm->name, qmm->name, qmm->id,
+				message_string_elem_len(qmm));
 			break;
 		}
 	}
@@ -515,53 +909,102 @@ static void emit_elem_info_array(FILE *fp, struct qmi_message *qm)
 	fprintf(fp, "\n");
 }
 
-static void emit_h_file_header(FILE *fp)
+static void emit_h_file_header(FILE *fp, unsigned flags)
 {
 	fprintf(fp, "#include <stdint.h>\n"
-		    "#include <stdbool.h>\n"
-		    "\n"
+		    "#include <stdbool.h>\n");
+	/* For the array loaders of the views */
+	if (flags & KERNEL_VIEW)
+		fprintf(fp, "#include <string.h>\n");
+	fprintf(fp, "\n"
 		    "#include \"libqrtr.h\"\n"
 		    "\n");
 };
 
-void kernel_emit_c(FILE *fp)
+void kernel_emit_c(struct qmi_ctx *ctx, FILE *fp, unsigned flags)
 {
 	struct qmi_message *qm;
 	struct qmi_struct *qs;
 
-	emit_source_includes(fp, qmi_package.name);
-	
-	list_for_each_entry(qs, &qmi_structs, node)
-		emit_struct_ei(fp, qs);
+	emit_source_includes(fp, ctx->package.name);
 	
-	list_for_each_entry(qm, &qmi_messages, node)
-		emit_elem_info_array(fp, qm);
+	if (flags & KERNEL_CONST) {
+		desc_emit_c(ctx, fp);
+
+		list_for_each_entry(qm, &ctx->messages, node)
+			emit_tlv_index(ctx, fp, qm);
+	} else {
+		list_for_each_entry(qs, &ctx->structs, node)
+			emit_struct_ei(ctx, fp, qs);
+	}
+
+	if (!(flags & (KERNEL_MASK | KERNEL_CONST))) {
+		list_for_each_entry(qm, &ctx->messages, node) {
+			emit_elem_info_array(ctx, fp, qm);
+			if (flags & KERNEL_CODEC)
+				emit_tlv_index(ctx, fp, qm);
+		}
+	}
+
+	dispatch_emit_c(ctx, fp, flags);
+
+	codec_emit_size_c(ctx, fp, flags);
+
+	if (flags & KERNEL_CODEC)
+		codec_emit_c(ctx, fp, flags);
+
+	if (flags & KERNEL_VIEW)
+		codec_emit_view_c(ctx, fp);
 }
 
-void kernel_emit_h(FILE *fp)
+void kernel_emit_h(struct qmi_ctx *ctx, FILE *fp, unsigned flags)
 {
 	struct qmi_message *qm;
 	struct qmi_struct *qs;
 
-	guard_header(fp, qmi_package.name);
-	emit_h_file_header(fp);
+	guard_header(fp, ctx->package.name);
+	emit_h_file_header(fp, flags);
+
+	if (flags & KERNEL_CONST) {
+		desc_emit_h(ctx, fp);
+
+		/* Relative to the first entry of each message in <pkg>_elems[] */
+		list_for_each_entry(qm, &ctx->messages, node)
+			fprintf(fp, "extern const uint8_t %s_%s_tlv_index[256];\n",
+				ctx->package.name, qm->name);
+		fprintf(fp, "\n");
+	} else if (!(flags & KERNEL_MASK)) {
+		list_for_each_entry(qm, &ctx->messages, node)
+			emit_elem_info_array_decl(ctx, fp, qm, flags);
+		if (!(flags & KERNEL_CODEC))
+			fprintf(fp, "\n");
+	}
 
-	list_for_each_entry(qm, &qmi_messages, node)
-		emit_elem_info_array_decl(fp, qm);
-	fprintf(fp, "\n");
+	if (!(flags & KERNEL_CONST))
+		emit_struct_ei_defines(ctx, fp);
 
-	qmi_const_header(fp);
-	qmi_enum_header(fp);
+	qmi_const_header(ctx, fp);
+	qmi_enum_header(ctx, fp);
 
-	list_for_each_entry(qs, &qmi_structs, node)
-		emit_struct_definition(fp, qs);
+	list_for_each_entry(qs, &ctx->structs, node)
+		emit_struct_definition(ctx, fp, qs, flags);
 
-	list_for_each_entry(qm, &qmi_messages, node)
-		emit_msg_struct(fp, qm);
+	list_for_each_entry(qm, &ctx->messages, node)
+		emit_msg_struct(ctx, fp, qm, flags);
 
-	list_for_each_entry(qm, &qmi_messages, node)
-		emit_msg_initialiser(fp, qm);
+	list_for_each_entry(qm, &ctx->messages, node)
+		emit_msg_initialiser(ctx, fp, qm, flags);
 	fprintf(fp, "\n");
 
+	dispatch_emit_h(ctx, fp, flags);
+
+	codec_emit_size_h(ctx, fp);
+
+	if (flags & KERNEL_CODEC)
+		codec_emit_h(ctx, fp);
+
+	if (flags & KERNEL_VIEW)
+		codec_emit_view_h(ctx, fp);
+
 	guard_footer(fp);
 }
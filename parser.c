@@ -12,6 +12,8 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "qmic.h"
@@ -19,13 +21,6 @@
 #define TOKEN_BUF_SIZE		128	/* TOKEN_BUF_MIN or more */
 #define TOKEN_BUF_MIN		24	/* Enough for a 64-bit octal number */
 
-struct qmi_package qmi_package;
-
-struct list_head qmi_consts = LIST_INIT(qmi_consts);
-struct list_head qmi_messages = LIST_INIT(qmi_messages);
-struct list_head qmi_structs = LIST_INIT(qmi_structs);
-struct list_head qmi_enums = LIST_INIT(qmi_enums);
-
 enum token_id {
 	/* Also any non-NUL (7-bit) ASCII character */
 	TOK_CONST = CHAR_MAX + 1,
@@ -49,16 +44,47 @@ struct token {
 	struct qmi_struct *qmi_struct;
 };
 
-static int yyline = 1;
+/* State of the parser, for the duration of a single qmi_parse() */
+struct parser {
+	struct qmi_ctx *ctx;
+
+	int yyline;
+	bool in_comment;
+
+	/*
+	 * The whole source is scanned from memory; regular files are mapped
+	 * and anything else (e.g. stdin) is read in one go.
+	 */
+	char *yybuf;
+	size_t yybuf_len;
+	bool yybuf_mapped;
+	const char *yyp;
+	const char *yyend;
+
+	/*
+	 * Symbols are also kept in a chained hash table, which is doubled in
+	 * size whenever it holds more symbols than buckets.
+	 */
+	struct list_head symbols;
+	struct symbol **symbol_hash;
+	unsigned symbol_hash_size;
+	unsigned symbol_count;
+
+	struct token curr_token;
+};
 
-static void yyerror(const char *fmt, ...)
+static void yyerror(struct parser *ps, const char *fmt, ...)
 {
 	va_list ap;
 
 	va_start(ap, fmt);
 
-	fprintf(stderr, "%s: parse error on line %u:\n\t",
-		program_invocation_short_name, yyline);
+	if (ps->ctx->source)
+		fprintf(stderr, "%s: %s: parse error on line %u:\n\t",
+			program_invocation_short_name, ps->ctx->source, ps->yyline);
+	else
+		fprintf(stderr, "%s: parse error on line %u:\n\t",
+			program_invocation_short_name, ps->yyline);
 	vfprintf(stderr, fmt, ap);
 	fprintf(stderr, "\n");
 
@@ -67,30 +93,72 @@ static void yyerror(const char *fmt, ...)
 	exit(1);
 }
 
-static char input()
+static void source_load(struct parser *ps, FILE *fp)
 {
-	int ch;
+	struct stat sb;
+	size_t size = 0;
+	size_t n;
+	void *map;
+
+	if (!fstat(fileno(fp), &sb) && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+		if (map != MAP_FAILED) {
+			ps->yybuf = map;
+			ps->yybuf_len = sb.st_size;
+			ps->yybuf_mapped = true;
+			goto out;
+		}
+	}
 
-	ch = fgetc(sourcefile);
-	if (ch < 0)
-		return 0;	/* End of input */
+	for (;;) {
+		if (ps->yybuf_len == size) {
+			size = size ? size * 2 : 65536;
+			ps->yybuf = realloc(ps->yybuf, size);
+			if (!ps->yybuf)
+				err(1, "failed to allocate source buffer");
+		}
 
-	if (ch == '\n')
-		yyline++;
-	else if (!isascii(ch))
-		yyerror("invalid non-ASCII character");
-	else if (!ch)
-		yyerror("invalid NUL character");
+		n = fread(ps->yybuf + ps->yybuf_len, 1, size - ps->yybuf_len, fp);
+		if (!n)
+			break;
+		ps->yybuf_len += n;
+	}
+
+	if (ferror(fp))
+		errx(1, "failed to read source");
+
+out:
+	ps->yyp = ps->yybuf;
+	ps->yyend = ps->yybuf + ps->yybuf_len;
+}
+
+static void source_release(struct parser *ps)
+{
+	if (ps->yybuf_mapped)
+		munmap(ps->yybuf, ps->yybuf_len);
+	else
+		free(ps->yybuf);
 
-	return (char)ch;
+	ps->yybuf = NULL;
+	ps->yyp = ps->yyend = NULL;
 }
 
-static void unput(int ch)
+static char input(struct parser *ps)
 {
+	char ch;
+
+	if (ps->yyp == ps->yyend)
+		return 0;	/* End of input */
+
+	ch = *ps->yyp++;
 	if (ch == '\n')
-		yyline--;
-	if (ungetc(ch, sourcefile) != ch)
-		yyerror("ungetc error");
+		ps->yyline++;
+	else if (!isascii(ch))
+		yyerror(ps, "invalid non-ASCII character");
+	else if (!ch)
+		yyerror(ps, "invalid NUL character");
+
+	return ch;
 }
 
 struct symbol {
@@ -109,22 +177,63 @@ struct symbol {
 		unsigned long long value;		/* TOK_VALUE */
 	};
 
+	/* Next symbol in the same hash bucket */
+	struct symbol *hash_next;
+	unsigned hash;
+
 	struct list_head node;
 };
 
-static struct list_head symbols = LIST_INIT(symbols);
+#define SYMBOL_HASH_MIN		256
 
-static struct symbol *symbol_find(const char *name)
+/* FNV-1a */
+static unsigned symbol_hash_name(const char *name)
 {
+	unsigned hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void symbol_hash_resize(struct parser *ps, unsigned size)
+{
+	struct symbol **table;
 	struct symbol *sym;
+	unsigned i;
+
+	table = memalloc(size * sizeof(*table));
+
+	list_for_each_entry(sym, &ps->symbols, node) {
+		i = sym->hash & (size - 1);
+		sym->hash_next = table[i];
+		table[i] = sym;
+	}
+
+	free(ps->symbol_hash);
+	ps->symbol_hash = table;
+	ps->symbol_hash_size = size;
+}
 
-	list_for_each_entry(sym, &symbols, node)
-		if (!strcmp(name, sym->name))
+static struct symbol *symbol_find(struct parser *ps, const char *name)
+{
+	struct symbol *sym;
+	unsigned hash;
+
+	if (!ps->symbol_hash)
+		return NULL;
+
+	hash = symbol_hash_name(name);
+	for (sym = ps->symbol_hash[hash & (ps->symbol_hash_size - 1)]; sym; sym = sym->hash_next)
+		if (sym->hash == hash && !strcmp(name, sym->name))
 			return sym;
 	return NULL;
 }
 
-static const char *token_name(enum token_id token_id)
+static const char *token_name(struct parser *ps, enum token_id token_id)
 {
 	struct symbol *sym;
 
@@ -141,14 +250,14 @@ static const char *token_name(enum token_id token_id)
 		break;
 	}
 
-	list_for_each_entry(sym, &symbols, node)
+	list_for_each_entry(sym, &ps->symbols, node)
 		if (token_id == sym->token_id)
 			return sym->name;
 
 	return NULL;
 }
 
-static bool symbol_valid(const char *name)
+static bool symbol_valid(struct parser *ps, const char *name)
 {
 	const char *p = name;
 	char ch;
@@ -167,26 +276,27 @@ static bool symbol_valid(const char *name)
 		return 0;
 
 	/* Finally, symbol names must be unique */
-	if (symbol_find(name))
+	if (symbol_find(ps, name))
 		return false;
 
 	return true;
 }
 
-static void symbol_add(const char *name, enum token_id token_id, ...)
+static void symbol_add(struct parser *ps, const char *name, enum token_id token_id, ...)
 {
 	struct symbol *sym;
 	va_list ap;
 
 	//printf("Adding symbol: %s\n", name);
 
-	assert(symbol_valid(name));
+	assert(symbol_valid(ps, name));
 
 	va_start(ap, token_id);
 
-	sym = memalloc(sizeof(struct symbol));
+	sym = arena_alloc(&ps->ctx->arena, sizeof(struct symbol));
 	sym->token_id = token_id;
 	sym->name = name;
+	sym->hash = symbol_hash_name(name);
 
 	switch (token_id) {
 	case TOK_MESSAGE:
@@ -204,19 +314,24 @@ static void symbol_add(const char *name, enum token_id token_id, ...)
 		break;	/* Most tokens are standalone */
 	}
 
-	list_add(&symbols, &sym->node);
+	list_add(&ps->symbols, &sym->node);
+
+	if (++ps->symbol_count > ps->symbol_hash_size) {
+		symbol_hash_resize(ps, ps->symbol_hash_size ? ps->symbol_hash_size * 2 : SYMBOL_HASH_MIN);
+	} else {
+		sym->hash_next = ps->symbol_hash[sym->hash & (ps->symbol_hash_size - 1)];
+		ps->symbol_hash[sym->hash & (ps->symbol_hash_size - 1)] = sym;
+	}
 
 	va_end(ap);
 }
 
 /* Skip over white space and comments (which start with '#', end with '\n') */
-static bool skip(char ch)
+static bool skip(struct parser *ps, char ch)
 {
-	static bool in_comment = false;
-
-	if (in_comment) {
+	if (ps->in_comment) {
 		if (ch == '\n')
-			in_comment = false;
+			ps->in_comment = false;
 		return true;
 	}
 
@@ -224,29 +339,41 @@ static bool skip(char ch)
 		return true;
 
 	if (ch == '#')
-		in_comment = true;
+		ps->in_comment = true;
+
+	return ps->in_comment;
+}
+
+/* Copy the token at [start, end) into the given buffer */
+static void token_copy(struct parser *ps, char *buf, size_t size,
+		       const char *start, const char *end, const char *what)
+{
+	size_t len = end - start;
+
+	if (len >= size) {
+		memcpy(buf, start, TOKEN_BUF_MIN);
+		buf[TOKEN_BUF_MIN] = '\0';
+		yyerror(ps, "%s too long: \"%s...\"", what, buf);
+	}
 
-	return in_comment;
+	memcpy(buf, start, len);
+	buf[len] = '\0';
 }
 
 /* Extract an identifier from input into the given buffer */
-static struct symbol *qmi_identifier_parse(char *buf, size_t size, char ch)
+static struct symbol *qmi_identifier_parse(struct parser *ps, char *buf, size_t size)
 {
-	char *p = buf;
+	const char *start = ps->yyp - 1;
+	const char *p = ps->yyp;
 
 	/* First character is known to be alphabetic */
-	*p++ = ch;
-	while ((ch = input()) && (isalnum(ch) || ch == '_')) {
-		if (p - buf == size) {
-			buf[TOKEN_BUF_MIN] = '\0';
-			yyerror("token too long: \"%s...\"", buf);
-		}
-		*p++ = ch;
-	}
-	unput(ch);
-	*p = '\0';
+	while (p < ps->yyend && (isalnum((unsigned char)*p) || *p == '_'))
+		p++;
 
-	return symbol_find(buf);
+	token_copy(ps, buf, size, start, p, "token");
+	ps->yyp = p;
+
+	return symbol_find(ps, buf);
 }
 
 /* Used for parsing octal numbers */
@@ -256,44 +383,37 @@ static int isodigit(int c)
 }
 
 /* Extract a number from input into the given buffer; return base */
-static unsigned qmi_number_parse(char *buf, size_t size, char ch)
+static unsigned qmi_number_parse(struct parser *ps, char *buf, size_t size, char ch)
 {
 	int (*isvalid)(int) = isdigit;
-	char *p = buf;
+	const char *start = ps->yyp - 1;
+	const char *p = ps->yyp;
 	unsigned base = 10;
 
 	/* First character is known to be a digit 0-9 */
-	*p++ = ch;
 
 	/* Determine base and valid character set */
-	if (ch == '0') {
-		ch = input();
-		if (ch == 'x' || ch == 'X') {
-			*p++ = ch;
-			ch = input();
+	if (ch == '0' && p < ps->yyend) {
+		if (*p == 'x' || *p == 'X') {
+			p++;
 			isvalid = isxdigit;
 			base = 16;
-		} else if (isodigit(ch)) {
+		} else if (isodigit((unsigned char)*p)) {
 			isvalid = isodigit;
 			base = 8;
 		}
-		unput(ch);
 	}
 
-	while ((ch = input()) && isvalid(ch)) {
-		if (p - buf == size) {
-			buf[TOKEN_BUF_MIN] = '\0';
-			yyerror("number too long: \"%s...\"", buf);
-		}
-		*p++ = ch;
-	}
-	unput(ch);
-	*p = '\0';
+	while (p < ps->yyend && isvalid((unsigned char)*p))
+		p++;
+
+	token_copy(ps, buf, size, start, p, "number");
+	ps->yyp = p;
 
 	return base;
 }
 
-static struct token yylex()
+static struct token yylex(struct parser *ps)
 {
 	struct symbol *sym;
 	struct token token = {};
@@ -302,16 +422,13 @@ static struct token yylex()
 	int base;
 	char ch;
 
-	while ((ch = input()) && skip(ch))
+	while ((ch = input(ps)) && skip(ps, ch))
 		;
 
 	if (isalpha(ch)) {
-		sym = qmi_identifier_parse(buf, sizeof(buf), ch);
+		sym = qmi_identifier_parse(ps, buf, sizeof(buf));
 
-		token.str = strdup(buf);
-		if (!token.str)
-			yyerror("strdup() failed in %s(), line %d\n",
-				__func__, __LINE__);
+		token.str = arena_strdup(&ps->ctx->arena, buf);
 		if (sym) {
 			token.id = sym->token_id;
 			switch (token.id) {
@@ -336,12 +453,12 @@ static struct token yylex()
 
 		return token;
 	} else if (isdigit(ch)) {
-		base = qmi_number_parse(buf, sizeof(buf), ch);
+		base = qmi_number_parse(ps, buf, sizeof(buf), ch);
 
 		errno = 0;
 		num = strtoull(buf, NULL, base);
 		if (errno)
-			yyerror("number %s out of range", buf);
+			yyerror(ps, "number %s out of range", buf);
 
 		token.num = num;
 		token.id = TOK_NUM;
@@ -357,87 +474,95 @@ static struct token yylex()
 	return token;
 }
 
-static struct token curr_token;
+static void token_next(struct parser *ps)
+{
+	struct qmi_stats *stats = &ps->ctx->stats;
+	uint64_t start;
 
-static void token_init(void)
+	if (!stats->enabled) {
+		ps->curr_token = yylex(ps);
+		return;
+	}
+
+	start = qmi_clock_ns();
+	ps->curr_token = yylex(ps);
+	stats->lex += qmi_clock_ns() - start;
+}
+
+static void token_init(struct parser *ps)
 {
-	curr_token = yylex();
+	token_next(ps);
 }
 
-static bool token_accept(enum token_id token_id, struct token *tok)
+static bool token_accept(struct parser *ps, enum token_id token_id, struct token *tok)
 {
 	// printf("have: %s / %d:%c / %d, want: %d:%c\n",
-	// 	curr_token.str, curr_token.id, curr_token.id,
-	// 	curr_token.num, token_id, token_id);
-	if (curr_token.id != token_id)
+	// 	ps->curr_token.str, ps->curr_token.id, ps->curr_token.id,
+	// 	ps->curr_token.num, token_id, token_id);
+	if (ps->curr_token.id != token_id)
 		return false;
 
-	/* Be sure to free the token string if caller won't be doing it */
 	if (tok)
-		*tok = curr_token;
-	else if (curr_token.str)
-		free(curr_token.str);
+		*tok = ps->curr_token;
 
-	curr_token = yylex();
+	token_next(ps);
 
 	return true;
 }
 
-static void token_expect(enum token_id token_id, struct token *tok)
+static void token_expect(struct parser *ps, enum token_id token_id, struct token *tok)
 {
 	const char *want;
 
-	if (token_accept(token_id, tok))
+	if (token_accept(ps, token_id, tok))
 		return;
 
-	want = token_name(token_id);
+	want = token_name(ps, token_id);
 	if (want)
-		yyerror("expected %s", want);
+		yyerror(ps, "expected %s", want);
 	else
-		yyerror("expected '%c'", token_id);
+		yyerror(ps, "expected '%c'", token_id);
 }
 
-static void qmi_package_parse(void)
+static void qmi_package_parse(struct parser *ps)
 {
 	struct token tok;
 	struct token service_id;
 
-	token_expect(TOK_ID, &tok);
-	if (token_accept(TOK_NUM, &service_id))
-		qmi_package.service_id = service_id.num;
-	token_expect(';', NULL);
+	token_expect(ps, TOK_ID, &tok);
+	if (token_accept(ps, TOK_NUM, &service_id))
+		ps->ctx->package.service_id = service_id.num;
+	token_expect(ps, ';', NULL);
 
-	if (qmi_package.name)
-		yyerror("package may only be specified once");
-	qmi_package.name = tok.str;
+	if (ps->ctx->package.name)
+		yyerror(ps, "package may only be specified once");
+	ps->ctx->package.name = tok.str;
 }
 
-static void qmi_const_parse(struct list_head *target_list)
+static void qmi_const_parse(struct parser *ps, struct list_head *target_list)
 {
-	struct qmi_const *qcm;
 	struct qmi_const *qc;
 	struct token num_tok;
 	struct token id_tok;
 
-	token_expect(TOK_ID, &id_tok);
-	token_expect('=', NULL);
-	token_expect(TOK_NUM, &num_tok);
-	token_expect(';', NULL);
+	token_expect(ps, TOK_ID, &id_tok);
+	token_expect(ps, '=', NULL);
+	token_expect(ps, TOK_NUM, &num_tok);
+	token_expect(ps, ';', NULL);
 
-	list_for_each_entry(qcm, &qmi_consts, node)
-		if (!strcmp(qcm->name, id_tok.str))
-			yyerror("duplicate constant \"%s\"", qcm->name);
+	if (symbol_find(ps, id_tok.str))
+		yyerror(ps, "duplicate constant \"%s\"", id_tok.str);
 
-	qc = memalloc(sizeof(struct qmi_const));
+	qc = arena_alloc(&ps->ctx->arena, sizeof(struct qmi_const));
 	qc->name = id_tok.str;
 	qc->value = num_tok.num;
 
 	list_add(target_list, &qc->node);
 
-	symbol_add(qc->name, TOK_VALUE, qc->value);
+	symbol_add(ps, qc->name, TOK_VALUE, qc->value);
 }
 
-static void qmi_message_parse(enum message_type message_type)
+static void qmi_message_parse(struct parser *ps, enum message_type message_type)
 {
 	struct qmi_message_member *qmm;
 	struct qmi_message *qm;
@@ -450,67 +575,72 @@ static void qmi_message_parse(enum message_type message_type)
 	bool array_fixed;
 	bool required;
 
-	token_expect(TOK_ID, &msg_id_tok);
-	token_expect('{', NULL);
+	token_expect(ps, TOK_ID, &msg_id_tok);
+	token_expect(ps, '{', NULL);
 
-	qm = memalloc(sizeof(struct qmi_message));
+	qm = arena_alloc(&ps->ctx->arena, sizeof(struct qmi_message));
 	qm->name = msg_id_tok.str;
 	qm->type = message_type;
 	list_init(&qm->members);
 
-	while (!token_accept('}', NULL)) {
+	while (!token_accept(ps, '}', NULL)) {
 		array_len_type = -1;
 		array_size = 0;
 		array_fixed = false;
-		if (token_accept(TOK_REQUIRED, NULL))
+		if (token_accept(ps, TOK_REQUIRED, NULL))
 			required = true;
-		else if (token_accept(TOK_OPTIONAL, NULL))
+		else if (token_accept(ps, TOK_OPTIONAL, NULL))
 			required = false;
 		else
-			yyerror("expected required, optional or '}'");
+			yyerror(ps, "expected required, optional or '}'");
 
-		token_expect(TOK_TYPE, &type_tok);
-		token_expect(TOK_ID, &id_tok);
+		token_expect(ps, TOK_TYPE, &type_tok);
+		token_expect(ps, TOK_ID, &id_tok);
 
-		if (token_accept('[', NULL)) {
-			token_expect(TOK_NUM, &num_tok);
+		if (token_accept(ps, '[', NULL)) {
+			token_expect(ps, TOK_NUM, &num_tok);
 			array_size = num_tok.num;
-			token_expect(']', NULL);
+			token_expect(ps, ']', NULL);
 			array_fixed = true;
-		} else if (token_accept('(', NULL)) {
-			if (token_accept(TOK_NUM, &num_tok)) {
+		} else if (token_accept(ps, '(', NULL)) {
+			if (token_accept(ps, TOK_NUM, &num_tok)) {
 				array_size = num_tok.num;
-			} else if (token_accept(TOK_TYPE, &num_tok)) {
+			} else if (token_accept(ps, TOK_TYPE, &num_tok)) {
 				if (num_tok.num > TYPE_CHAR)
-					yyerror("Array size type must be a basic type");
+					yyerror(ps, "Array size type must be a basic type");
 				array_len_type = num_tok.num;
 				if (type_tok.qmi_struct)
 					array_size = 8;
 				else
 					array_size = 64;
 			}
-			token_expect(')', NULL);
+			token_expect(ps, ')', NULL);
 			array_fixed = false;
 		}
 
-		token_expect('=', NULL);
-		token_expect(TOK_NUM, &num_tok);
-		token_expect(';', NULL);
+		if (type_tok.num == TYPE_STRING) {
+			if (array_len_type >= 0)
+				yyerror(ps, "string length must be a number");
+			if (array_size > UINT16_MAX)
+				yyerror(ps, "string length must be at most %u", UINT16_MAX);
+		}
+
+		token_expect(ps, '=', NULL);
+		token_expect(ps, TOK_NUM, &num_tok);
+		token_expect(ps, ';', NULL);
 
 		list_for_each_entry(qmm, &qm->members, node) {
 			if (!strcmp(qmm->name, id_tok.str))
-				yyerror("duplicate message member \"%s\"",
+				yyerror(ps, "duplicate message member \"%s\"",
 					qmm->name);
 			if (qmm->id == num_tok.num)
-				yyerror("duplicate message member number %u",
+				yyerror(ps, "duplicate message member number %u",
 					qmm->id);
 		}
 
-		qmm = memalloc(sizeof(struct qmi_message_member));
+		qmm = arena_alloc(&ps->ctx->arena, sizeof(struct qmi_message_member));
 		qmm->name = id_tok.str;
 		qmm->type = type_tok.num;
-		if (type_tok.str)
-			free(type_tok.str);
 		qmm->qmi_struct = type_tok.qmi_struct;
 		qmm->id = num_tok.num;
 		qmm->required = required;
@@ -521,41 +651,38 @@ static void qmi_message_parse(enum message_type message_type)
 		list_add(&qm->members, &qmm->node);
 	}
 
-	if (token_accept('=', NULL)) {
-		token_expect(TOK_NUM, &num_tok);
+	if (token_accept(ps, '=', NULL)) {
+		token_expect(ps, TOK_NUM, &num_tok);
 
 		qm->msg_id = num_tok.num;
 	}
 
-	token_expect(';', NULL);
+	token_expect(ps, ';', NULL);
 
-	list_add(&qmi_messages, &qm->node);
+	list_add(&ps->ctx->messages, &qm->node);
 }
 
-static void qmi_struct_gen_names(struct qmi_struct *qs, char *_namebuf)
+static void qmi_struct_gen_names(struct parser *ps, struct qmi_struct *qs, const char *parent)
 {
 	struct qmi_struct_member *qsm;
-	char *namebuf = memalloc(1024);
+	size_t len;
 
 	if (qs->name) {
 		// In case this is a reference to a previously defined struct
-		if (symbol_find(qs->name))
+		if (symbol_find(ps, qs->name))
 			return;
-		strcpy(namebuf, qs->name);
-		free(qs->name);
 	} else {
-		strcpy(namebuf, _namebuf);
-		strcat(namebuf, "_");
-		strcat(namebuf, qs->member->name);
+		len = strlen(parent) + strlen(qs->member->name) + 2;
+		qs->name = arena_alloc(&ps->ctx->arena, len);
+		snprintf(qs->name, len, "%s_%s", parent, qs->member->name);
 	}
 
-	qs->name = strdup(namebuf);
 	list_for_each_entry(qsm, &qs->members, node)
 		if (qsm->type == TYPE_STRUCT && !qsm->is_struct_ref) {
-			qmi_struct_gen_names(qsm->qmi_struct, qs->name);
+			qmi_struct_gen_names(ps, qsm->qmi_struct, qs->name);
 		}
 
-	symbol_add(qs->name, TOK_TYPE, TYPE_STRUCT, qs);
+	symbol_add(ps, qs->name, TOK_TYPE, TYPE_STRUCT, qs);
 }
 
 /*
@@ -595,24 +722,24 @@ static void qmi_struct_gen_names(struct qmi_struct *qs, char *_namebuf)
  *   ...
  * };
  */
-static inline void qmi_struct_parse_array_len_size(struct qmi_struct_member *qsm)
+static inline void qmi_struct_parse_array_len_size(struct parser *ps, struct qmi_struct_member *qsm)
 {
 	struct token array_len_size;
 
 	if (qsm->is_ptr) {
-		if (!token_accept('(', NULL))
-			yyerror("Variable length arrays must define the length type, "
+		if (!token_accept(ps, '(', NULL))
+			yyerror(ps, "Variable length arrays must define the length type, "
 				"e.g. u8 *my_data(u16);");
-		token_expect(TOK_TYPE, &array_len_size);
+		token_expect(ps, TOK_TYPE, &array_len_size);
 		if (array_len_size.num >= TYPE_STRING)
-			yyerror("Array size type must be a basic type");
-		token_expect(')', NULL);
+			yyerror(ps, "Array size type must be a basic type");
+		token_expect(ps, ')', NULL);
 		qsm->array_len_type = array_len_size.num;
 	}
 
-	if (token_accept('[', NULL)) {
-		token_expect(TOK_NUM, &array_len_size);
-		token_expect(']', NULL);
+	if (token_accept(ps, '[', NULL)) {
+		token_expect(ps, TOK_NUM, &array_len_size);
+		token_expect(ps, ']', NULL);
 		qsm->array_size = array_len_size.num;
 
 		if (!qsm->is_ptr)
@@ -624,28 +751,28 @@ static inline void qmi_struct_parse_array_len_size(struct qmi_struct_member *qsm
 
 #define DEFAULT_ARRAY_LENGTH 128
 
-static void qmi_struct_parse(void)
+static void qmi_struct_parse(struct parser *ps)
 {
 	struct qmi_struct_member *qsm, *qsm_temp;
 	struct token struct_id_tok;
-	struct qmi_struct **structs;
+	struct qmi_struct *structs[STRUCT_NEST_MAX];
 	struct qmi_struct *qs;
+	uint64_t start = 0;
 	int nest = 0;
 	struct token type_tok;
 	struct token id_tok;
 
-	token_expect(TOK_ID, &struct_id_tok);
-	token_expect('{', NULL);
+	token_expect(ps, TOK_ID, &struct_id_tok);
+	token_expect(ps, '{', NULL);
 
-	structs = memalloc(sizeof(struct qmi_struct*) * STRUCT_NEST_MAX);
-	qs = structs[0] = memalloc(sizeof(struct qmi_struct));
+	qs = structs[0] = arena_alloc(&ps->ctx->arena, sizeof(struct qmi_struct));
 
 	qs->name = struct_id_tok.str;
 	list_init(&qs->members);
 
 	while (true) {
 		char *struct_type = NULL;
-		qsm = memalloc(sizeof(struct qmi_struct_member));
+		qsm = arena_alloc(&ps->ctx->arena, sizeof(struct qmi_struct_member));
 		qsm->array_size = DEFAULT_ARRAY_LENGTH;
 		/*
 		 * If we find a nested struct definition, "push" it to the structs stack
@@ -655,20 +782,20 @@ static void qmi_struct_parse(void)
 		 *	REFERENCE: (required TYPE)[*]ID<string>';'
 		 *	DEFINITION: '{' MEMBERS '}' ';'
 		 */
-		if (token_accept(TOK_STRUCT, NULL)) {
+		if (token_accept(ps, TOK_STRUCT, NULL)) {
 			/*
 			 * If we accept TOK_TYPE, that means the struct was already defined
 			 * if instead we accept TOK_ID then it's a custom type for a new struct
 			 */
-			if (token_accept(TOK_TYPE, &type_tok)) {
+			if (token_accept(ps, TOK_TYPE, &type_tok)) {
 				qsm->qmi_struct = type_tok.qmi_struct;
 				qsm->is_struct_ref = true;
 				if (!qsm->qmi_struct) // SHOULD NOT HAPPEN
-					yyerror("Can't find qmi_struct pointer for \"%s\"",
+					yyerror(ps, "Can't find qmi_struct pointer for \"%s\"",
 						type_tok.str);
 			} else {
 				// Optionally define a custom type for the nested struct
-				if (token_accept(TOK_ID, &id_tok))
+				if (token_accept(ps, TOK_ID, &id_tok))
 					struct_type = id_tok.str;
 
 				// Add the struct member associated with this nested
@@ -677,10 +804,10 @@ static void qmi_struct_parse(void)
 
 				nest++;
 				if (nest == STRUCT_NEST_MAX) {
-					yyerror("Can't have nested structs more than %d levels "
+					yyerror(ps, "Can't have nested structs more than %d levels "
 						"deep!", STRUCT_NEST_MAX);
 				}
-				qs = structs[nest] = memalloc(sizeof(struct qmi_struct));
+				qs = structs[nest] = arena_alloc(&ps->ctx->arena, sizeof(struct qmi_struct));
 				list_init(&qs->members);
 
 				// Save this for later
@@ -688,28 +815,28 @@ static void qmi_struct_parse(void)
 				if (struct_type)
 					qs->name = struct_type;
 
-				token_expect('{', NULL);
+				token_expect(ps, '{', NULL);
 				continue;
 			}
-		} else if (!token_accept(TOK_TYPE, &type_tok)) {
-			token_expect('}', NULL);
+		} else if (!token_accept(ps, TOK_TYPE, &type_tok)) {
+			token_expect(ps, '}', NULL);
 
 			if (nest) {
 				qsm = qs->member;
-				if (token_accept('*', NULL))
+				if (token_accept(ps, '*', NULL))
 					qsm->is_ptr = true;
 
-				token_expect(TOK_ID, &id_tok);
+				token_expect(ps, TOK_ID, &id_tok);
 				qsm->name = id_tok.str;
 				qsm->type = TYPE_STRUCT;
 				qsm->qmi_struct = qs;
 
-				qmi_struct_parse_array_len_size(qsm);
+				qmi_struct_parse_array_len_size(ps, qsm);
 			}
 
-			token_expect(';', NULL);
+			token_expect(ps, ';', NULL);
 
-			list_add(&qmi_structs, &qs->node);
+			list_add(&ps->ctx->structs, &qs->node);
 
 			if (!nest)
 				break;
@@ -719,59 +846,185 @@ static void qmi_struct_parse(void)
 			continue;
 		}
 
-		if (token_accept('*', NULL))
+		if (token_accept(ps, '*', NULL))
 			qsm->is_ptr = true;
 
-		token_expect(TOK_ID, &id_tok);
-		qmi_struct_parse_array_len_size(qsm);
-		token_expect(';', NULL);
+		token_expect(ps, TOK_ID, &id_tok);
+		qmi_struct_parse_array_len_size(ps, qsm);
+		token_expect(ps, ';', NULL);
+
+		if (type_tok.num == TYPE_STRING &&
+		    (qsm->is_ptr || !qsm->array_size || qsm->array_size > UINT16_MAX))
+			yyerror(ps, "string length must be between 1 and %u, e.g. string name[32];",
+				UINT16_MAX);
 
 		list_for_each_entry(qsm_temp, &qs->members, node)
 			if (!strcmp(qsm_temp->name, id_tok.str))
-				yyerror("duplicate struct member \"%s\"",
+				yyerror(ps, "duplicate struct member \"%s\"",
 					qsm_temp->name);
 		
 
 		qsm->name = id_tok.str;
 		qsm->type = type_tok.num;
-		if (type_tok.str)
-			free(type_tok.str);
 
 		list_add(&qs->members, &qsm->node);
 	}
 
 	assert(nest == 0);
-	free(structs);
 
-	qmi_struct_gen_names(qs, memalloc(1024));
+	if (ps->ctx->stats.enabled)
+		start = qmi_clock_ns();
+
+	qmi_struct_gen_names(ps, qs, NULL);
+
+	if (ps->ctx->stats.enabled)
+		ps->ctx->stats.names += qmi_clock_ns() - start;
 }
 
-static void qmi_enum_parse(void)
+static void qmi_enum_parse(struct parser *ps)
 {
 	struct token id_tok;
-	struct qmi_enum *qe = memalloc(sizeof(struct qmi_enum));
+	struct qmi_enum *qe = arena_alloc(&ps->ctx->arena, sizeof(struct qmi_enum));
 	list_init(&qe->members);
 
-	token_expect(TOK_ID, &id_tok);
-	token_expect('{', NULL);
-	while (!token_accept('}', NULL))
-		qmi_const_parse(&qe->members);
-	token_expect(';', NULL);
+	token_expect(ps, TOK_ID, &id_tok);
+	token_expect(ps, '{', NULL);
+	while (!token_accept(ps, '}', NULL))
+		qmi_const_parse(ps, &qe->members);
+	token_expect(ps, ';', NULL);
 
 	qe->name = id_tok.str;
 	
-	list_add(&qmi_enums, &qe->node);
-	symbol_add(qe->name, TOK_ENUM, TYPE_ENUM, qe);
+	list_add(&ps->ctx->enums, &qe->node);
+	symbol_add(ps, qe->name, TOK_ENUM, TYPE_ENUM, qe);
 }
 
 struct qmi_struct qmi_response_type_v01 = {
 	.name = "qmi_response_type_v01",
+	.shape = &qmi_response_type_v01,
 	.members = LIST_INIT(qmi_response_type_v01.members),
 };
 
-void qmi_parse(void)
+/*
+ * Structs with the same members but for their names are laid out the same
+ * way, so their ei tables are identical. When asked to, point each struct at
+ * the first one of its shape, whose table the others share, or at
+ * qmi_response_type_v01 when it's just a pair of u16, for which libqrtr
+ * already has a table. Otherwise each struct is its own shape.
+ */
+#define SHAPE_MEMBER_MAX 96
+
+struct shape {
+	const char *key;
+	unsigned hash;
+	struct qmi_struct *qs;
+};
+
+static bool qmi_struct_is_response_shaped(struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	unsigned count = 0;
+
+	list_for_each_entry(qsm, &qs->members, node) {
+		if (qsm->type != TYPE_U16 || qsm->is_ptr || qsm->array_fixed)
+			return false;
+		count++;
+	}
+
+	return count == 2;
+}
+
+/* Everything emit_struct_ei() looks at, except for the names */
+static const char *qmi_struct_shape_key(struct parser *ps, struct qmi_struct *qs)
+{
+	struct qmi_struct_member *qsm;
+	unsigned count = 0;
+	size_t len = 0;
+	char *key;
+
+	list_for_each_entry(qsm, &qs->members, node)
+		count++;
+
+	key = arena_alloc(&ps->ctx->arena, count * SHAPE_MEMBER_MAX + 1);
+	key[0] = '\0';
+
+	list_for_each_entry(qsm, &qs->members, node) {
+		len += snprintf(key + len, SHAPE_MEMBER_MAX, "%d:%d:%d:%d:%u:%p;",
+				qsm->type, qsm->is_ptr, qsm->array_fixed,
+				qsm->is_ptr ? qsm->array_len_type : 0,
+				qsm->is_ptr || qsm->array_fixed || qsm->type == TYPE_STRING ?
+					qsm->array_size : 0,
+				qsm->type == TYPE_STRUCT ? (void *)qsm->qmi_struct->shape : NULL);
+	}
+
+	return key;
+}
+
+static void qmi_struct_shapes(struct parser *ps)
 {
+	struct qmi_struct *qs;
+	struct shape *table;
+	struct shape *sh;
+	unsigned count = 0;
+	unsigned size;
+	unsigned hash;
+	const char *key;
+
+	if (!ps->ctx->share_shapes) {
+		list_for_each_entry(qs, &ps->ctx->structs, node)
+			qs->shape = qs;
+		return;
+	}
+
+	list_for_each_entry(qs, &ps->ctx->structs, node)
+		count++;
+	for (size = 1; size <= 2 * count; size <<= 1)
+		;
+
+	table = memalloc(size * sizeof(*table));
+
+	/* Nested and referenced structs precede the structs using them */
+	list_for_each_entry(qs, &ps->ctx->structs, node) {
+		if (qmi_struct_is_response_shaped(qs)) {
+			qs->shape = &qmi_response_type_v01;
+			continue;
+		}
+
+		key = qmi_struct_shape_key(ps, qs);
+		hash = symbol_hash_name(key);
+
+		for (sh = &table[hash & (size - 1)]; sh->key;
+		     sh = &table[(sh - table + 1) & (size - 1)]) {
+			if (sh->hash == hash && !strcmp(sh->key, key))
+				break;
+		}
+
+		if (!sh->key) {
+			sh->key = key;
+			sh->hash = hash;
+			sh->qs = qs;
+		}
+
+		qs->shape = sh->qs;
+	}
+
+	free(table);
+}
+
+void qmi_parse(struct qmi_ctx *ctx, FILE *fp)
+{
+	struct parser *ps;
 	struct token tok;
+	uint64_t total = 0;
+	uint64_t start = 0;
+
+	if (ctx->stats.enabled)
+		total = qmi_clock_ns();
+
+	ps = memalloc(sizeof(struct parser));
+	ps->ctx = ctx;
+	ps->yyline = 1;
+	list_init(&ps->symbols);
 
 	/* PACKAGE ID<string> [QMI_SERVICE<string>] ';' */
 	/* CONST ID<string> '=' NUM<num> ';' */
@@ -780,49 +1033,68 @@ void qmi_parse(void)
 	/* MESSAGE ID<string> '{' ... '}' ';' */
 		/* (REQUIRED | OPTIONAL) TYPE<type*> ID<string> '=' NUM<num> ';' */
 
-	symbol_add("const", TOK_CONST);
-	symbol_add("optional", TOK_OPTIONAL);
-	symbol_add("message", TOK_MESSAGE, MESSAGE_RESPONSE); /* backward compatible with early hacking */
-	symbol_add("request", TOK_MESSAGE, MESSAGE_REQUEST);
-	symbol_add("response", TOK_MESSAGE, MESSAGE_RESPONSE);
-	symbol_add("indication", TOK_MESSAGE, MESSAGE_INDICATION);
-	symbol_add("package", TOK_PACKAGE);
-	symbol_add("required", TOK_REQUIRED);
-	symbol_add("struct", TOK_STRUCT);
-	symbol_add("enum", TOK_ENUM);
-	symbol_add("string", TOK_TYPE, TYPE_STRING);
-	symbol_add("u8", TOK_TYPE, TYPE_U8);
-	symbol_add("u16", TOK_TYPE, TYPE_U16);
-	symbol_add("u32", TOK_TYPE, TYPE_U32);
-	symbol_add("u64", TOK_TYPE, TYPE_U64);
-	symbol_add("i8", TOK_TYPE, TYPE_I8);
-	symbol_add("i16", TOK_TYPE, TYPE_I16);
-	symbol_add("i32", TOK_TYPE, TYPE_I32);
-	symbol_add("i64", TOK_TYPE, TYPE_I64);
-	symbol_add("char", TOK_TYPE, TYPE_CHAR);
-
-	symbol_add(qmi_response_type_v01.name, TOK_TYPE, TYPE_STRUCT, &qmi_response_type_v01);
-
-	token_init();
-	while (!token_accept(TOK_EOF, NULL)) {
-		if (token_accept(TOK_PACKAGE, NULL)) {
-			qmi_package_parse();
-		} else if (token_accept(TOK_CONST, NULL)) {
-			qmi_const_parse(&qmi_consts);
-		} else if (token_accept(TOK_STRUCT, NULL)) {
-			qmi_struct_parse();
-		} else if (token_accept(TOK_ENUM, NULL)) {
-			qmi_enum_parse();
-		} else if (token_accept(TOK_MESSAGE, &tok)) {
-			qmi_message_parse(tok.num);
-			free(tok.str);
+	symbol_add(ps, "const", TOK_CONST);
+	symbol_add(ps, "optional", TOK_OPTIONAL);
+	symbol_add(ps, "message", TOK_MESSAGE, MESSAGE_RESPONSE); /* backward compatible with early hacking */
+	symbol_add(ps, "request", TOK_MESSAGE, MESSAGE_REQUEST);
+	symbol_add(ps, "response", TOK_MESSAGE, MESSAGE_RESPONSE);
+	symbol_add(ps, "indication", TOK_MESSAGE, MESSAGE_INDICATION);
+	symbol_add(ps, "package", TOK_PACKAGE);
+	symbol_add(ps, "required", TOK_REQUIRED);
+	symbol_add(ps, "struct", TOK_STRUCT);
+	symbol_add(ps, "enum", TOK_ENUM);
+	symbol_add(ps, "string", TOK_TYPE, TYPE_STRING);
+	symbol_add(ps, "u8", TOK_TYPE, TYPE_U8);
+	symbol_add(ps, "u16", TOK_TYPE, TYPE_U16);
+	symbol_add(ps, "u32", TOK_TYPE, TYPE_U32);
+	symbol_add(ps, "u64", TOK_TYPE, TYPE_U64);
+	symbol_add(ps, "i8", TOK_TYPE, TYPE_I8);
+	symbol_add(ps, "i16", TOK_TYPE, TYPE_I16);
+	symbol_add(ps, "i32", TOK_TYPE, TYPE_I32);
+	symbol_add(ps, "i64", TOK_TYPE, TYPE_I64);
+	symbol_add(ps, "char", TOK_TYPE, TYPE_CHAR);
+
+	symbol_add(ps, qmi_response_type_v01.name, TOK_TYPE, TYPE_STRUCT, &qmi_response_type_v01);
+
+	if (ctx->stats.enabled)
+		start = qmi_clock_ns();
+
+	/* Reading the source counts as lexing */
+	source_load(ps, fp);
+
+	if (ctx->stats.enabled)
+		ctx->stats.lex += qmi_clock_ns() - start;
+
+	token_init(ps);
+	while (!token_accept(ps, TOK_EOF, NULL)) {
+		if (token_accept(ps, TOK_PACKAGE, NULL)) {
+			qmi_package_parse(ps);
+		} else if (token_accept(ps, TOK_CONST, NULL)) {
+			qmi_const_parse(ps, &ps->ctx->consts);
+		} else if (token_accept(ps, TOK_STRUCT, NULL)) {
+			qmi_struct_parse(ps);
+		} else if (token_accept(ps, TOK_ENUM, NULL)) {
+			qmi_enum_parse(ps);
+		} else if (token_accept(ps, TOK_MESSAGE, &tok)) {
+			qmi_message_parse(ps, tok.num);
 		} else {
-			yyerror("unexpected symbol");
+			yyerror(ps, "unexpected symbol");
 			break;
 		}
 	}
 
 	/* The package name must have been specified */
-	if (!qmi_package.name)
-		yyerror("package not specified");
+	if (!ps->ctx->package.name)
+		yyerror(ps, "package not specified");
+
+	qmi_struct_shapes(ps);
+
+	source_release(ps);
+	free(ps->symbol_hash);
+	free(ps);
+
+	/* Whatever wasn't spent lexing or generating names was parsing */
+	if (ctx->stats.enabled)
+		ctx->stats.parse = qmi_clock_ns() - total - ctx->stats.lex -
+				   ctx->stats.names;
 }
@@ -1,52 +1,417 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qmi_tlv.h"
+
+_Static_assert(sizeof(struct qmi_header) == 7, "struct qmi_header is 7 bytes on the wire");
+_Static_assert(sizeof(struct qmi_tlv_header) == 3, "struct qmi_tlv_header is 3 bytes on the wire");
+
+/*
+ * Once qmi_tlv_pool_init() has been called, freed qmi_tlv objects and
+ * message buffers are kept in per-thread caches for reuse rather than going
+ * back to malloc. Buffers come in a few size classes, with a free list for
+ * each. Being per-thread, the caches need no locking; anything freed simply
+ * goes to the cache of the thread freeing it. Each cache holds at most
+ * QMI_TLV_POOL_DEPTH entries or QMI_TLV_POOL_BYTES, whichever is less, and
+ * is released when its thread exits.
+ *
+ * The pools are process-wide: <pkg>_pool_init() of any package enables them
+ * for all of them.
+ */
+#define QMI_TLV_POOL_DEPTH 64
+#define QMI_TLV_POOL_BYTES (1024 * 1024)
+
+static const size_t qmi_tlv_pool_sizes[] = {
+	64, 256, 1024, 4096, 16384,
+	sizeof(struct qmi_header) + UINT16_MAX,
+};
+
+#define QMI_TLV_POOL_CLASSES (sizeof(qmi_tlv_pool_sizes) / sizeof(qmi_tlv_pool_sizes[0]))
+
+struct qmi_tlv_pool_entry {
+	struct qmi_tlv_pool_entry *next;
+};
+
+struct qmi_tlv_pool {
+	struct qmi_tlv_pool_entry *tlvs;
+	unsigned num_tlvs;
+
+	struct qmi_tlv_pool_entry *bufs[QMI_TLV_POOL_CLASSES];
+	unsigned num_bufs[QMI_TLV_POOL_CLASSES];
+
+	/* Set as the thread's value of qmi_tlv_pool_key, for the destructor */
+	bool registered;
+};
+
+static bool qmi_tlv_pool_enabled;
+static __thread struct qmi_tlv_pool qmi_tlv_pool;
+
+static pthread_once_t qmi_tlv_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t qmi_tlv_pool_key;
+static bool qmi_tlv_pool_have_key;
+
+static void qmi_tlv_pool_release(struct qmi_tlv_pool *pool)
+{
+	struct qmi_tlv_pool_entry *entry;
+	unsigned i;
+
+	while ((entry = pool->tlvs)) {
+		pool->tlvs = entry->next;
+		free(entry);
+	}
+	pool->num_tlvs = 0;
+
+	for (i = 0; i < QMI_TLV_POOL_CLASSES; i++) {
+		while ((entry = pool->bufs[i])) {
+			pool->bufs[i] = entry->next;
+			free(entry);
+		}
+		pool->num_bufs[i] = 0;
+	}
+}
+
+/* Called on thread exit for each thread which cached anything */
+static void qmi_tlv_pool_destroy(void *data)
+{
+	struct qmi_tlv_pool *pool = data;
+
+	pool->registered = false;
+	qmi_tlv_pool_release(pool);
+}
+
+static void qmi_tlv_pool_key_init(void)
+{
+	qmi_tlv_pool_have_key = !pthread_key_create(&qmi_tlv_pool_key, qmi_tlv_pool_destroy);
+}
+
+void qmi_tlv_pool_init(void)
+{
+	pthread_once(&qmi_tlv_pool_once, qmi_tlv_pool_key_init);
+	__atomic_store_n(&qmi_tlv_pool_enabled, true, __ATOMIC_RELEASE);
+}
+
+/* Release everything cached by the calling thread */
+void qmi_tlv_pool_flush(void)
+{
+	qmi_tlv_pool_release(&qmi_tlv_pool);
+}
+
+/*
+ * Have the calling thread's cache released when it exits, before it caches
+ * anything; without a key the cache is only released by qmi_tlv_pool_flush()
+ */
+static void qmi_tlv_pool_register(struct qmi_tlv_pool *pool)
+{
+	if (pool->registered || !qmi_tlv_pool_have_key)
+		return;
+
+	pool->registered = !pthread_setspecific(qmi_tlv_pool_key, pool);
+}
+
+static bool qmi_tlv_pool_active(void)
+{
+	return __atomic_load_n(&qmi_tlv_pool_enabled, __ATOMIC_ACQUIRE);
+}
+
+static struct qmi_tlv *qmi_tlv_pool_get_tlv(void)
+{
+	struct qmi_tlv_pool *pool = &qmi_tlv_pool;
+	struct qmi_tlv_pool_entry *entry = pool->tlvs;
+
+	if (!entry)
+		return malloc(sizeof(struct qmi_tlv));
+
+	pool->tlvs = entry->next;
+	pool->num_tlvs--;
+
+	return (struct qmi_tlv *)entry;
+}
+
+static void qmi_tlv_pool_put_tlv(struct qmi_tlv *tlv)
+{
+	struct qmi_tlv_pool *pool = &qmi_tlv_pool;
+	struct qmi_tlv_pool_entry *entry = (struct qmi_tlv_pool_entry *)tlv;
+
+	if (!qmi_tlv_pool_active() || pool->num_tlvs >= QMI_TLV_POOL_DEPTH) {
+		free(tlv);
+		return;
+	}
+
+	qmi_tlv_pool_register(pool);
 
-struct qmi_tlv *qmi_tlv_init(void)
+	entry->next = pool->tlvs;
+	pool->tlvs = entry;
+	pool->num_tlvs++;
+}
+
+/*
+ * Allocate a buffer of at least @size bytes, from the pool if it's enabled,
+ * and store the actual size of the buffer in @alloc_size.
+ */
+static void *qmi_tlv_pool_get_buf(size_t size, size_t *alloc_size)
+{
+	struct qmi_tlv_pool *pool = &qmi_tlv_pool;
+	struct qmi_tlv_pool_entry *entry;
+	unsigned i;
+
+	if (!qmi_tlv_pool_active()) {
+		*alloc_size = size;
+		return malloc(size);
+	}
+
+	for (i = 0; i < QMI_TLV_POOL_CLASSES; i++)
+		if (size <= qmi_tlv_pool_sizes[i])
+			break;
+
+	if (i == QMI_TLV_POOL_CLASSES)
+		return NULL;
+
+	*alloc_size = qmi_tlv_pool_sizes[i];
+
+	entry = pool->bufs[i];
+	if (!entry)
+		return malloc(qmi_tlv_pool_sizes[i]);
+
+	pool->bufs[i] = entry->next;
+	pool->num_bufs[i]--;
+
+	return entry;
+}
+
+static void qmi_tlv_pool_put_buf(void *buf, size_t alloc_size)
+{
+	struct qmi_tlv_pool *pool = &qmi_tlv_pool;
+	struct qmi_tlv_pool_entry *entry = buf;
+	unsigned i;
+
+	if (!buf)
+		return;
+
+	/* Only buffers of exactly a class size came from the pool */
+	for (i = 0; i < QMI_TLV_POOL_CLASSES; i++)
+		if (alloc_size == qmi_tlv_pool_sizes[i])
+			break;
+
+	if (!qmi_tlv_pool_active() || i == QMI_TLV_POOL_CLASSES ||
+	    pool->num_bufs[i] >= QMI_TLV_POOL_DEPTH ||
+	    (pool->num_bufs[i] + 1) * alloc_size > QMI_TLV_POOL_BYTES) {
+		free(buf);
+		return;
+	}
+
+	qmi_tlv_pool_register(pool);
+
+	entry->next = pool->bufs[i];
+	pool->bufs[i] = entry;
+	pool->num_bufs[i]++;
+}
+
+static void *qmi_tlv_payload(struct qmi_tlv *tlv)
+{
+	return tlv->buf + sizeof(struct qmi_header);
+}
+
+struct qmi_tlv *qmi_tlv_init(unsigned txn, unsigned msg_id, unsigned type)
 {
+	struct qmi_header *pkt;
 	struct qmi_tlv *tlv;
 
-	tlv = malloc(sizeof(struct qmi_tlv));
+	tlv = qmi_tlv_pool_get_tlv();
+	if (!tlv)
+		return NULL;
 	memset(tlv, 0, sizeof(struct qmi_tlv));
 
+	tlv->size = sizeof(struct qmi_header);
+	tlv->allocated = qmi_tlv_pool_get_buf(tlv->size, &tlv->allocated_size);
+	if (!tlv->allocated) {
+		qmi_tlv_pool_put_tlv(tlv);
+		return NULL;
+	}
+	tlv->buf = tlv->allocated;
+
+	pkt = tlv->buf;
+	pkt->type = type;
+	pkt->txn_id = txn;
+	pkt->msg_id = msg_id;
+	pkt->msg_len = 0;
+
 	return tlv;
 }
 
-struct qmi_tlv *qmi_tlv_decode(void *buf, size_t len)
+/*
+ * Build a message inside a caller provided buffer, e.g. a stack array. The
+ * qmi_tlv object is placed at the start of the buffer and the message follows
+ * it, so nothing is allocated and qmi_tlv_free() has nothing to release.
+ */
+struct qmi_tlv *qmi_tlv_init_buf(void *buf, size_t cap, unsigned txn, unsigned msg_id, unsigned type)
 {
-	struct qmi_tlv *tlv;
+	struct qmi_header *pkt;
+	struct qmi_tlv *tlv = buf;
+
+	if ((uintptr_t)buf % _Alignof(struct qmi_tlv))
+		return NULL;
+
+	if (cap < sizeof(struct qmi_tlv) + sizeof(struct qmi_header))
+		return NULL;
+
+	memset(tlv, 0, sizeof(struct qmi_tlv));
+
+	tlv->buf = buf + sizeof(struct qmi_tlv);
+	tlv->size = sizeof(struct qmi_header);
+	tlv->capacity = cap - sizeof(struct qmi_tlv);
+
+	pkt = tlv->buf;
+	pkt->type = type;
+	pkt->txn_id = txn;
+	pkt->msg_id = msg_id;
+	pkt->msg_len = 0;
+
+	return tlv;
+}
+
+/*
+ * Walk the items of a received message once, checking that each one fits
+ * within the buffer, and record where each TLV type starts so that later
+ * lookups don't have to scan. Like the scan it replaces, the first item of
+ * a given type wins.
+ */
+static int qmi_tlv_index(struct qmi_tlv *tlv)
+{
+	struct qmi_tlv_header *hdr;
+	size_t payload_len;
+	size_t offset = 0;
+
+	payload_len = tlv->size - sizeof(struct qmi_header);
+	if (payload_len > UINT16_MAX)
+		return -EMSGSIZE;
+
+	while (offset < payload_len) {
+		if (payload_len - offset < sizeof(struct qmi_tlv_header))
+			return -EINVAL;
+
+		hdr = qmi_tlv_payload(tlv) + offset;
+		if (payload_len - offset - sizeof(struct qmi_tlv_header) < hdr->len)
+			return -EINVAL;
+
+		if (!tlv->index[hdr->key])
+			tlv->index[hdr->key] = offset + 1;
+
+		offset += sizeof(struct qmi_tlv_header) + hdr->len;
+	}
+
+	return 0;
+}
+
+static bool qmi_tlv_check_header(const void *buf, size_t len, unsigned type)
+{
+	const struct qmi_header *pkt = buf;
+
+	if (len < sizeof(struct qmi_header) || pkt->type != type)
+		return false;
+
+	return pkt->msg_len <= len - sizeof(struct qmi_header);
+}
+
+static int qmi_tlv_attach(struct qmi_tlv *tlv, const void *buf, unsigned *txn)
+{
+	const struct qmi_header *pkt = buf;
+	int ret;
 
-	tlv = malloc(sizeof(struct qmi_tlv));
 	memset(tlv, 0, sizeof(struct qmi_tlv));
 
-	tlv->buf = buf;
-	tlv->size = len;
+	tlv->buf = (void *)buf;
+	tlv->size = sizeof(struct qmi_header) + pkt->msg_len;
+
+	ret = qmi_tlv_index(tlv);
+	if (ret < 0)
+		return ret;
+
+	if (txn)
+		*txn = pkt->txn_id;
+
+	return 0;
+}
+
+struct qmi_tlv *qmi_tlv_decode(void *buf, size_t len, unsigned *txn, unsigned type)
+{
+	struct qmi_tlv *tlv;
+
+	if (!qmi_tlv_check_header(buf, len, type))
+		return NULL;
+
+	tlv = qmi_tlv_pool_get_tlv();
+	if (!tlv)
+		return NULL;
+
+	if (qmi_tlv_attach(tlv, buf, txn) < 0) {
+		qmi_tlv_pool_put_tlv(tlv);
+		return NULL;
+	}
+
+	return tlv;
+}
+
+/*
+ * Like qmi_tlv_decode(), but set up the caller provided @tlv rather than
+ * allocating one, so that parsing a message does no heap operations. The
+ * result refers to @buf, which must outlive it, and is read-only: it's
+ * treated as a caller provided buffer which is already full.
+ */
+struct qmi_tlv *qmi_tlv_decode_into(struct qmi_tlv *tlv, const void *buf, size_t len,
+				    unsigned *txn, unsigned type)
+{
+	if (!qmi_tlv_check_header(buf, len, type))
+		return NULL;
+
+	if (qmi_tlv_attach(tlv, buf, txn) < 0)
+		return NULL;
+
+	tlv->capacity = tlv->size;
 
 	return tlv;
 }
 
 void *qmi_tlv_encode(struct qmi_tlv *tlv, size_t *len)
 {
+	struct qmi_header *pkt;
+	uint16_t msg_len;
+
+	if (!tlv)
+		return NULL;
+
+	/* Received messages have it right already, and may be read-only */
+	pkt = tlv->buf;
+	msg_len = tlv->size - sizeof(struct qmi_header);
+	if (pkt->msg_len != msg_len)
+		pkt->msg_len = msg_len;
+
 	*len = tlv->size;
 	return tlv->buf;
 }
 
 void qmi_tlv_free(struct qmi_tlv *tlv)
 {
-	free(tlv->allocated);
-	free(tlv);
+	if (tlv->capacity)
+		return;
+
+	qmi_tlv_pool_put_buf(tlv->allocated, tlv->allocated_size);
+	qmi_tlv_pool_put_tlv(tlv);
 }
 
 static struct qmi_tlv_header *qmi_tlv_get_item(struct qmi_tlv *tlv, unsigned id)
 {
-	struct qmi_tlv_header *hdr;
-	unsigned offset = 0;
+	unsigned offset;
 
-	while (offset < tlv->size) {
-		hdr = tlv->buf + offset;
-		if (hdr->key == id)
-			return tlv->buf + offset;
+	if (id > UINT8_MAX || !tlv->index[id])
+		return NULL;
 
-		offset += sizeof(struct qmi_tlv_header) + hdr->len;
-	}
-	return NULL;
+	offset = tlv->index[id] - 1;
+	return qmi_tlv_payload(tlv) + offset;
 }
 
 void *qmi_tlv_get(struct qmi_tlv *tlv, unsigned id, size_t *len)
@@ -61,10 +426,10 @@ void *qmi_tlv_get(struct qmi_tlv *tlv, unsigned id, size_t *len)
 	return hdr->data;
 }
 
-void *qmi_tlv_get_array(struct qmi_tlv *tlv, unsigned id, size_t *len, size_t *size)
+void *qmi_tlv_get_array(struct qmi_tlv *tlv, unsigned id, unsigned len_size, size_t *len, size_t *size)
 {
 	struct qmi_tlv_header *hdr;
-	uint8_t count;
+	unsigned count;
 	void *ptr;
 
 	hdr = qmi_tlv_get_item(tlv, id);
@@ -72,17 +437,33 @@ void *qmi_tlv_get_array(struct qmi_tlv *tlv, unsigned id, size_t *len, size_t *s
 		return NULL;
 
 	ptr = hdr->data;
-	count = *(uint8_t*)ptr++;
+	if (len_size == 2) {
+		uint16_t count16;
+
+		if (hdr->len < sizeof(uint16_t))
+			return NULL;
+		/* Items aren't aligned in the message */
+		memcpy(&count16, ptr, sizeof(count16));
+		count = count16;
+		ptr += sizeof(uint16_t);
+	} else {
+		if (hdr->len < sizeof(uint8_t))
+			return NULL;
+		count = *(uint8_t*)ptr;
+		ptr += sizeof(uint8_t);
+	}
 
 	*len = count;
-	*size = (hdr->len - 1) / count;
+	*size = count ? (hdr->len - (ptr - (void *)hdr->data)) / count : 0;
 
 	return ptr;
 }
 
-static struct qmi_tlv_header *qmi_tlv_alloc_item(struct qmi_tlv *tlv, unsigned id, size_t len)
+static int qmi_tlv_alloc_item(struct qmi_tlv *tlv, unsigned id, size_t len,
+			      struct qmi_tlv_header **item)
 {
 	struct qmi_tlv_header *hdr;
+	size_t alloc_size;
 	size_t new_size;
 	bool migrate;
 	void *newp;
@@ -90,53 +471,102 @@ static struct qmi_tlv_header *qmi_tlv_alloc_item(struct qmi_tlv *tlv, unsigned i
 	/* If using user provided buffer, migrate data */
 	migrate = !tlv->allocated;
 
+	if (len > UINT16_MAX)
+		return -EMSGSIZE;
+
 	new_size = tlv->size + sizeof(struct qmi_tlv_header) + len;
-	newp = realloc(tlv->allocated, new_size);
-	if (!newp)
-		return NULL;
+	if (new_size - sizeof(struct qmi_header) > UINT16_MAX)
+		return -EMSGSIZE;
+
+	if (tlv->capacity) {
+		/* Caller provided buffer, which can't grow */
+		if (new_size > tlv->capacity)
+			return -ENOSPC;
+
+		newp = tlv->buf;
+	} else if (new_size <= tlv->allocated_size) {
+		/* Still fits in the buffer taken from the pool */
+		newp = tlv->allocated;
+	} else if (qmi_tlv_pool_active()) {
+		newp = qmi_tlv_pool_get_buf(new_size, &alloc_size);
+		if (!newp)
+			return -ENOMEM;
 
-	if (migrate)
 		memcpy(newp, tlv->buf, tlv->size);
+		qmi_tlv_pool_put_buf(tlv->allocated, tlv->allocated_size);
+
+		tlv->allocated = newp;
+		tlv->allocated_size = alloc_size;
+	} else {
+		newp = realloc(tlv->allocated, new_size);
+		if (!newp)
+			return -ENOMEM;
+
+		if (migrate)
+			memcpy(newp, tlv->buf, tlv->size);
+
+		tlv->allocated = newp;
+		tlv->allocated_size = new_size;
+	}
 
 	hdr = newp + tlv->size;
 	hdr->key = id;
 	hdr->len = len;
 
-	tlv->buf = tlv->allocated = newp;
+	if (!tlv->index[hdr->key])
+		tlv->index[hdr->key] = tlv->size - sizeof(struct qmi_header) + 1;
+
+	tlv->buf = newp;
 	tlv->size = new_size;
 
-	return hdr;
+	*item = hdr;
+	return 0;
 }
 
 int qmi_tlv_set(struct qmi_tlv *tlv, unsigned id, void *buf, size_t len)
 {
 	struct qmi_tlv_header *hdr;
+	int ret;
 
-	hdr = qmi_tlv_alloc_item(tlv, id, len);
-	if (!hdr)
-		return -ENOMEM;
+	ret = qmi_tlv_alloc_item(tlv, id, len, &hdr);
+	if (ret < 0)
+		return ret;
 
 	memcpy(hdr->data, buf, len);
 
 	return 0;
 }
 
-int qmi_tlv_set_array(struct qmi_tlv *tlv, unsigned id, void *buf, size_t len, size_t size)
+int qmi_tlv_set_array(struct qmi_tlv *tlv, unsigned id, unsigned len_size, void *buf, size_t len, size_t size)
 {
 	struct qmi_tlv_header *hdr;
 	size_t array_size;
+	uint16_t count;
 	void *ptr;
+	int ret;
+
+	if (len_size != 2)
+		len_size = 1;
+
+	/* The count has to fit its prefix, and the item's size a size_t */
+	if (len > (len_size == 1 ? UINT8_MAX : UINT16_MAX))
+		return -EINVAL;
+	if (size && len > (SIZE_MAX - len_size) / size)
+		return -EINVAL;
 
 	array_size = len * size;
-	hdr = qmi_tlv_alloc_item(tlv, id, sizeof(uint8_t) + array_size);
-	if (!hdr)
-		return -ENOMEM;
+	ret = qmi_tlv_alloc_item(tlv, id, len_size + array_size, &hdr);
+	if (ret < 0)
+		return ret;
 
 	ptr = hdr->data;
-	*(uint8_t*)ptr++ = len;
+	count = len;
+	if (len_size == 2)
+		memcpy(ptr, &count, sizeof(count));
+	else
+		*(uint8_t*)ptr = count;
+	ptr += len_size;
 	memcpy(ptr, buf, array_size);
 
 	return 0;
 }
-
-
@@ -0,0 +1,137 @@
+#ifndef __QMI_TLV_H__
+#define __QMI_TLV_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Runtime of the accessor style sources, see qmi_tlv.c. The generated
+ * headers include this one, so that there's a single definition of
+ * struct qmi_tlv to keep in sync with the code using it.
+ */
+
+/* Header of a message on the wire, laid out as libqrtr's */
+struct qmi_header {
+	uint8_t type;
+	uint16_t txn_id;
+	uint16_t msg_id;
+	uint16_t msg_len;
+} __attribute__((__packed__));
+
+/* Header of each item following it */
+struct qmi_tlv_header {
+	uint8_t key;
+	uint16_t len;
+	uint8_t data[];
+} __attribute__((__packed__));
+
+struct qmi_tlv {
+	void *allocated;
+	/* Size of the allocated buffer, which may be more than is used */
+	size_t allocated_size;
+	void *buf;
+	size_t size;
+	/* Non-zero if the message lives in a caller provided buffer */
+	size_t capacity;
+
+	/*
+	 * Offset of each item from the start of the payload, plus one, keyed
+	 * by TLV type. Zero means the item is not present. The payload of a
+	 * QMI message is limited to 64KiB, so the offsets fit in 16 bits.
+	 */
+	uint16_t index[256];
+};
+
+/*
+ * Strings and arrays of a message returned by the _view() getters, which
+ * point into the message rather than copying and are valid for as long
+ * as it is. Strings aren't NUL-terminated. Absent items have a NULL ptr.
+ */
+#ifndef QMI_STRVIEW_DEFINED
+#define QMI_STRVIEW_DEFINED
+struct qmi_strview {
+	const char *ptr;
+	size_t len;
+};
+#endif
+
+/*
+ * Array items aren't necessarily aligned in the message, so the spans of
+ * integer arrays point to the raw little-endian elements, which are read
+ * with qmi_span_uN_at() rather than through a typed pointer
+ */
+struct qmi_span_u8 {
+	const uint8_t *ptr;
+	size_t len;
+};
+
+struct qmi_span_u16 {
+	const uint8_t *ptr;
+	size_t len;
+};
+
+struct qmi_span_u32 {
+	const uint8_t *ptr;
+	size_t len;
+};
+
+struct qmi_span_u64 {
+	const uint8_t *ptr;
+	size_t len;
+};
+
+static inline uint8_t qmi_span_u8_at(struct qmi_span_u8 span, size_t i)
+{
+	return span.ptr[i];
+}
+
+static inline uint16_t qmi_span_u16_at(struct qmi_span_u16 span, size_t i)
+{
+	uint16_t v;
+
+	memcpy(&v, span.ptr + i * sizeof(v), sizeof(v));
+	return v;
+}
+
+static inline uint32_t qmi_span_u32_at(struct qmi_span_u32 span, size_t i)
+{
+	uint32_t v;
+
+	memcpy(&v, span.ptr + i * sizeof(v), sizeof(v));
+	return v;
+}
+
+static inline uint64_t qmi_span_u64_at(struct qmi_span_u64 span, size_t i)
+{
+	uint64_t v;
+
+	memcpy(&v, span.ptr + i * sizeof(v), sizeof(v));
+	return v;
+}
+
+/* Size of a buffer for *_init_buf() able to hold @len bytes of TLVs */
+#define QMI_TLV_BUF_SIZE(len) (sizeof(struct qmi_tlv) + sizeof(struct qmi_header) + (len))
+
+/*
+ * Declare @name as a buffer for *_init_buf() able to hold @len bytes of
+ * TLVs, aligned as it requires, e.g. on the stack
+ */
+#define QMI_TLV_BUF(name, len) \
+	_Alignas(struct qmi_tlv) unsigned char name[QMI_TLV_BUF_SIZE(len)]
+
+struct qmi_tlv *qmi_tlv_init(unsigned txn, unsigned msg_id, unsigned type);
+struct qmi_tlv *qmi_tlv_init_buf(void *buf, size_t cap, unsigned txn, unsigned msg_id, unsigned type);
+struct qmi_tlv *qmi_tlv_decode(void *buf, size_t len, unsigned *txn, unsigned type);
+struct qmi_tlv *qmi_tlv_decode_into(struct qmi_tlv *tlv, const void *buf, size_t len, unsigned *txn, unsigned type);
+void *qmi_tlv_encode(struct qmi_tlv *tlv, size_t *len);
+void qmi_tlv_free(struct qmi_tlv *tlv);
+void qmi_tlv_pool_init(void);
+void qmi_tlv_pool_flush(void);
+
+void *qmi_tlv_get(struct qmi_tlv *tlv, unsigned id, size_t *len);
+void *qmi_tlv_get_array(struct qmi_tlv *tlv, unsigned id, unsigned len_size, size_t *len, size_t *size);
+int qmi_tlv_set(struct qmi_tlv *tlv, unsigned id, void *buf, size_t len);
+int qmi_tlv_set_array(struct qmi_tlv *tlv, unsigned id, unsigned len_size, void *buf, size_t len, size_t size);
+
+#endif
@@ -2,20 +2,22 @@
 #include <ctype.h>
 #include <err.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 
 #include "list.h"
 #include "qmic.h"
 
-FILE *sourcefile;
-
 const char *sz_simple_types[] = {
 	[TYPE_U8] = "uint8_t",
 	[TYPE_U16] = "uint16_t",
@@ -24,28 +26,40 @@ const char *sz_simple_types[] = {
 	[TYPE_STRING] = "char *",
 };
 
-void qmi_const_header(FILE *fp)
+const char *sz_native_types[] = {
+	[TYPE_U8] = "uint8_t",
+	[TYPE_U16] = "uint16_t",
+	[TYPE_U32] = "uint32_t",
+	[TYPE_U64] = "uint64_t",
+	[TYPE_I8] = "int8_t",
+	[TYPE_I16] = "int16_t",
+	[TYPE_I32] = "int32_t",
+	[TYPE_I64] = "int64_t",
+	[TYPE_CHAR] = "char",
+};
+
+void qmi_const_header(struct qmi_ctx *ctx, FILE *fp)
 {
 	struct qmi_const *qc;
 
-	if (list_empty(&qmi_consts))
+	if (list_empty(&ctx->consts))
 		return;
 
-	list_for_each_entry(qc, &qmi_consts, node)
+	list_for_each_entry(qc, &ctx->consts, node)
 		fprintf(fp, "#define %s %lld\n", qc->name, qc->value);
 
 	fprintf(fp, "\n");
 }
 
-void qmi_enum_header(FILE *fp)
+void qmi_enum_header(struct qmi_ctx *ctx, FILE *fp)
 {
 	struct qmi_enum *qe;
 	struct qmi_const *qc;
 
-	if (list_empty(&qmi_enums))
+	if (list_empty(&ctx->enums))
 		return;
 
-	list_for_each_entry(qe, &qmi_enums, node) {
+	list_for_each_entry(qe, &ctx->enums, node) {
 		fprintf(fp, "enum %s {\n", qe->name);
 		list_for_each_entry(qc, &qe->members, node) {
 			fprintf(fp, "\t%s = %lld,\n", qc->name, qc->value);
@@ -78,6 +92,8 @@ void guard_header(FILE *fp, const char *package)
 	fprintf(fp, "#ifndef __QMI_%s_H__\n", upper);
 	fprintf(fp, "#define __QMI_%s_H__\n", upper);
 	fprintf(fp, "\n");
+
+	free(upper);
 }
 
 void guard_footer(FILE *fp)
@@ -85,93 +101,543 @@ void guard_footer(FILE *fp)
 	fprintf(fp, "#endif\n");
 }
 
+uint64_t qmi_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void usage(void)
 {
 	extern const char *__progname;
 
-	fprintf(stderr, "Usage: %s [-ak] [-f FILE] [-o dir]\n", __progname);
+	fprintf(stderr, "Usage: %s [-aikcVmrPsdbt] [-j N] [-f FILE]... [-o dir] [-M depfile] [FILE]...\n", __progname);
 	fprintf(stderr, "    -a        Emit accessor style sources for use with qmi_tlv\n");
+	fprintf(stderr, "    -i        Like -a, with the accessors static inline in the header\n");
 	fprintf(stderr, "    -k        Emit kernel style sources\n");
-	fprintf(stderr, "    -f FILE   Read from file (defaults to stdin)\n");
+	fprintf(stderr, "    -c        Emit kernel style sources with compiled encoders/decoders\n");
+	fprintf(stderr, "    -V        Like -c, also emitting zero-copy views of received messages\n");
+	fprintf(stderr, "    -m        Like -c, with a presence bitmask in place of the _valid flags\n");
+	fprintf(stderr, "    -r        Like -c, with relocation-free const tables in place of the ei tables\n");
+	fprintf(stderr, "    -P        Reorder kernel style struct members to save padding, reporting the savings\n");
+	fprintf(stderr, "    -s        Share the tables of kernel style structs of the same shape\n");
+	fprintf(stderr, "    -d        Also emit <pkg>_lookup(), finding the descriptor of a message\n");
+	fprintf(stderr, "    -b        Also emit qmi_<pkg>_bench.c, benchmarking every message\n");
+	fprintf(stderr, "    -f FILE   Read from file, may be repeated (defaults to stdin)\n");
+	fprintf(stderr, "    -j N      Compile up to N files in parallel (defaults to number of CPUs)\n");
 	fprintf(stderr, "    -o DIR    Output directory to write to\n");
+	fprintf(stderr, "    -M FILE   Write Make dependency rules for the outputs to FILE, touching them\n");
+	fprintf(stderr, "    -t        Report time spent in each phase and peak memory use\n");
 	exit(1);
 }
 
-int main(int argc, char **argv)
+struct qmic_options {
+	const char *outdir;
+	mode_t umask;
+	bool timing;
+	bool bench;
+	/* Bump the mtime of unchanged outputs, for the rules of -M */
+	bool touch;
+	unsigned flags;
+	int method;
+};
+
+/* Sources generated from an IDL, held until all of them are known good */
+struct qmic_output {
+	char *package;
+	char *sbuf;
+	size_t slen;
+	char *hbuf;
+	size_t hlen;
+	/* NULL without -b */
+	char *bbuf;
+	size_t blen;
+};
+
+struct qmic_jobs {
+	const struct qmic_options *opts;
+	const char **sources;
+	/* Outputs of each source, once compiled */
+	struct qmic_output *outputs;
+	unsigned count;
+	unsigned next;
+};
+
+/*
+ * Replace @fname with @len bytes of @buf, unless it already holds exactly
+ * that content. Leaving unchanged outputs alone keeps their mtime, so
+ * nothing that includes them gets rebuilt; the new content is written to a
+ * temporary file and renamed into place, so readers never see a partial
+ * file.
+ *
+ * With -M though, the rules written say that the outputs are older than
+ * their IDL whenever qmic needs to run, so make would run it again and
+ * again after an edit which doesn't change the outputs, like one to a
+ * comment. Bump their mtime then, so that the rules are satisfied.
+ */
+static void output_commit(const struct qmic_options *opts, const char *fname,
+			  const char *buf, size_t len)
 {
-	char fname[256];
-	const char* source = NULL;
-	const char* outdir = NULL;
+	char tmpname[PATH_MAX];
 	struct stat sb;
+	char *old;
+	ssize_t n;
+	size_t off;
+	bool same = false;
+	int ret;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd >= 0) {
+		if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && (size_t)sb.st_size == len) {
+			old = memalloc(len + 1);
+			for (off = 0; off < len; off += n) {
+				n = read(fd, old + off, len - off);
+				if (n <= 0)
+					break;
+			}
+			same = off == len && !memcmp(old, buf, len);
+			free(old);
+		}
+		close(fd);
+	}
+
+	if (same) {
+		if (opts->touch && utimensat(AT_FDCWD, fname, NULL, 0) < 0)
+			err(1, "failed to touch %s", fname);
+		return;
+	}
+
+	ret = snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname);
+	if (ret < 0 || (size_t)ret >= sizeof(tmpname))
+		errx(1, "output path %s too long", fname);
+
+	fd = mkstemp(tmpname);
+	if (fd < 0)
+		err(1, "failed to create %s", tmpname);
+
+	/* mkstemp() creates the file 0600, give it the mode fopen() would */
+	if (fchmod(fd, 0666 & ~opts->umask) < 0)
+		err(1, "failed to set mode of %s", tmpname);
+
+	for (off = 0; off < len; off += n) {
+		n = write(fd, buf + off, len - off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			unlink(tmpname);
+			err(1, "failed to write %s", tmpname);
+		}
+	}
+
+	if (close(fd) < 0) {
+		unlink(tmpname);
+		err(1, "failed to write %s", tmpname);
+	}
+
+	if (rename(tmpname, fname) < 0) {
+		unlink(tmpname);
+		err(1, "failed to rename %s to %s", tmpname, fname);
+	}
+}
+
+/* Parse @source and generate its outputs into memory, in @out */
+static void qmic_compile(const struct qmic_options *opts, const char *source,
+			 struct qmic_output *out)
+{
+	struct qmi_ctx *ctx;
+	uint64_t start = 0;
+	FILE *fp;
+	FILE *bfp;
 	FILE *hfp;
 	FILE *sfp;
-	int method = 0;
+
+	ctx = memalloc(sizeof(struct qmi_ctx));
+	ctx->source = source;
+	ctx->stats.enabled = opts->timing;
+	ctx->share_shapes = opts->flags & KERNEL_SHARE;
+	list_init(&ctx->consts);
+	list_init(&ctx->messages);
+	list_init(&ctx->structs);
+	list_init(&ctx->enums);
+
+	if (source) {
+		fp = fopen(source, "r");
+		if (!fp)
+			err(1, "failed to open %s", source);
+	} else {
+		fp = stdin;
+	}
+
+	qmi_parse(ctx, fp);
+
+	if (fp != stdin)
+		fclose(fp);
+
+	/* Generate into memory, to be compared with what's already there */
+	sfp = open_memstream(&out->sbuf, &out->slen);
+	hfp = open_memstream(&out->hbuf, &out->hlen);
+	if (!sfp || !hfp)
+		err(1, "failed to allocate output buffers");
+
+	if (opts->timing)
+		start = qmi_clock_ns();
+
+	switch (opts->method) {
+	case 0:
+		accessor_emit_c(ctx, sfp, ctx->package.name, opts->flags);
+		accessor_emit_h(ctx, hfp, ctx->package.name, opts->flags);
+		break;
+	case 1:
+		kernel_emit_c(ctx, sfp, opts->flags);
+		kernel_emit_h(ctx, hfp, opts->flags);
+		break;
+	}
+
+	if (fclose(hfp) || fclose(sfp))
+		err(1, "failed to generate output for %s", ctx->package.name);
+
+	if (opts->timing) {
+		ctx->stats.emit = qmi_clock_ns() - start;
+
+		fprintf(stderr, "%s: lex %.3f ms, parse %.3f ms, names %.3f ms, emit %.3f ms\n",
+			source ? source : "<stdin>",
+			ctx->stats.lex / 1e6, ctx->stats.parse / 1e6,
+			ctx->stats.names / 1e6, ctx->stats.emit / 1e6);
+	}
+
+	if (opts->bench) {
+		bfp = open_memstream(&out->bbuf, &out->blen);
+		if (!bfp)
+			err(1, "failed to allocate output buffer");
+
+		if (opts->method == 0)
+			bench_emit_accessor(ctx, bfp);
+		else
+			bench_emit_kernel(ctx, bfp, opts->flags);
+
+		if (fclose(bfp))
+			err(1, "failed to generate benchmark for %s", ctx->package.name);
+	}
+
+	out->package = strdup(ctx->package.name);
+	if (!out->package)
+		err(1, "failed to allocate package name");
+
+	arena_free(&ctx->arena);
+	free(ctx);
+}
+
+/* Write the outputs of a source to the output directory */
+static void qmic_commit(const struct qmic_options *opts, struct qmic_output *out)
+{
+	char fname[256];
+
+	snprintf(fname, sizeof(fname), "%s/qmi_%s.c", opts->outdir, out->package);
+	output_commit(opts, fname, out->sbuf, out->slen);
+
+	snprintf(fname, sizeof(fname), "%s/qmi_%s.h", opts->outdir, out->package);
+	output_commit(opts, fname, out->hbuf, out->hlen);
+
+	if (out->bbuf) {
+		snprintf(fname, sizeof(fname), "%s/qmi_%s_bench.c", opts->outdir, out->package);
+		output_commit(opts, fname, out->bbuf, out->blen);
+	}
+}
+
+/* For package_cmp(), which qsort() gives no context */
+static struct qmic_output *package_outputs;
+
+/* Write @path escaped for use in a Make rule */
+static void depfile_path(FILE *fp, const char *path)
+{
+	for (; *path; path++) {
+		if (*path == ' ' || *path == '#')
+			fputc('\\', fp);
+		else if (*path == '$')
+			fputc('$', fp);
+		fputc(*path, fp);
+	}
+}
+
+/*
+ * Emit one rule per compiled source, stating that the generated sources and
+ * header depend on the IDL they were generated from.
+ */
+static void depfile_write(const struct qmic_options *opts, const char *depfile,
+			  struct qmic_jobs *jobs)
+{
+	char fname[256];
+	unsigned i;
+	size_t len;
+	char *buf;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	if (!fp)
+		err(1, "failed to allocate output buffer");
+
+	for (i = 0; i < jobs->count; i++) {
+		snprintf(fname, sizeof(fname), "%s/qmi_%s.c", opts->outdir, jobs->outputs[i].package);
+		depfile_path(fp, fname);
+		fputc(' ', fp);
+
+		snprintf(fname, sizeof(fname), "%s/qmi_%s.h", opts->outdir, jobs->outputs[i].package);
+		depfile_path(fp, fname);
+
+		if (opts->bench) {
+			fputc(' ', fp);
+			snprintf(fname, sizeof(fname), "%s/qmi_%s_bench.c", opts->outdir,
+				 jobs->outputs[i].package);
+			depfile_path(fp, fname);
+		}
+		fputc(':', fp);
+
+		/* Nothing to depend on when reading stdin */
+		if (jobs->sources[i]) {
+			fputc(' ', fp);
+			depfile_path(fp, jobs->sources[i]);
+		}
+		fputc('\n', fp);
+	}
+
+	if (fclose(fp))
+		err(1, "failed to generate %s", depfile);
+
+	output_commit(opts, depfile, buf, len);
+	free(buf);
+}
+
+static int package_cmp(const void *a, const void *b)
+{
+	const unsigned *ia = a;
+	const unsigned *ib = b;
+
+	return strcmp(package_outputs[*ia].package, package_outputs[*ib].package);
+}
+
+/*
+ * Sources declaring the same package would be compiled into the same
+ * outputs, so check for them before writing any
+ */
+static bool packages_unique(struct qmic_jobs *jobs)
+{
+	unsigned *order;
+	unsigned i;
+	bool ok = true;
+
+	order = memalloc(jobs->count * sizeof(*order));
+	for (i = 0; i < jobs->count; i++)
+		order[i] = i;
+
+	package_outputs = jobs->outputs;
+	qsort(order, jobs->count, sizeof(*order), package_cmp);
+
+	for (i = 1; i < jobs->count; i++) {
+		if (strcmp(jobs->outputs[order[i - 1]].package, jobs->outputs[order[i]].package))
+			continue;
+
+		fprintf(stderr, "%s and %s both declare package %s\n",
+			jobs->sources[order[i - 1]] ? jobs->sources[order[i - 1]] : "<stdin>",
+			jobs->sources[order[i]] ? jobs->sources[order[i]] : "<stdin>",
+			jobs->outputs[order[i]].package);
+		ok = false;
+	}
+
+	free(order);
+
+	return ok;
+}
+
+/* Worker thread, claiming input files until there are none left */
+static void *qmic_worker(void *data)
+{
+	struct qmic_jobs *jobs = data;
+	unsigned idx;
+
+	for (;;) {
+		idx = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+		if (idx >= jobs->count)
+			break;
+
+		qmic_compile(jobs->opts, jobs->sources[idx], &jobs->outputs[idx]);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct qmic_options opts = {};
+	struct qmic_jobs jobs = {};
+	const char *depfile = NULL;
+	const char **sources;
+	unsigned nsources = 0;
+	pthread_t *threads;
+	struct rusage ru;
+	struct stat sb;
+	uint64_t start;
+	long njobs = 0;
+	char *end;
 	int opt;
+	int ret;
+	long i;
 
-	while ((opt = getopt(argc, argv, "akf:o:")) != -1) {
+	sources = memalloc(argc * sizeof(*sources));
+
+	while ((opt = getopt(argc, argv, "aikcVmrPsdbf:j:o:M:t")) != -1) {
 		switch (opt) {
 		case 'a':
-			method = 0;
+			opts.method = 0;
+			break;
+		case 'i':
+			opts.method = 0;
+			opts.flags |= ACCESSOR_INLINE;
 			break;
 		case 'k':
-			method = 1;
+			opts.method = 1;
+			break;
+		case 'c':
+			opts.method = 1;
+			opts.flags |= KERNEL_CODEC;
+			break;
+		case 'V':
+			opts.method = 1;
+			opts.flags |= KERNEL_CODEC | KERNEL_VIEW;
+			break;
+		case 'm':
+			opts.method = 1;
+			opts.flags |= KERNEL_CODEC | KERNEL_MASK;
+			break;
+		case 'r':
+			opts.method = 1;
+			opts.flags |= KERNEL_CODEC | KERNEL_CONST;
+			break;
+		case 'P':
+			opts.flags |= KERNEL_PACK;
+			break;
+		case 's':
+			opts.flags |= KERNEL_SHARE;
+			break;
+		case 'd':
+			opts.flags |= KERNEL_DISPATCH;
 			break;
 		case 'f':
-			source = optarg;
+			sources[nsources++] = optarg;
+			break;
+		case 'j':
+			njobs = strtol(optarg, &end, 0);
+			if (*end || njobs <= 0)
+				usage();
 			break;
 		case 'o':
-			outdir = optarg;
+			opts.outdir = optarg;
+			break;
+		case 'M':
+			depfile = optarg;
+			opts.touch = true;
+			break;
+		case 't':
+			opts.timing = true;
+			break;
+		case 'b':
+			opts.bench = true;
 			break;
 		default:
 			usage();
 		}
 	}
 
-	if (source) {
-		sourcefile = fopen(source, "r");
-		if (!sourcefile) {
-			fprintf(stderr, "Failed to open '%s' (%d: %s)\n", source,
+	/* The relocation-free tables have no way to refer to the mask bits */
+	if ((opts.flags & KERNEL_MASK) && (opts.flags & KERNEL_CONST))
+		usage();
+
+	while (optind < argc)
+		sources[nsources++] = argv[optind++];
+
+	for (i = 0; i < nsources; i++) {
+		if (access(sources[i], R_OK)) {
+			fprintf(stderr, "Failed to open '%s' (%d: %s)\n", sources[i],
 				errno, strerror(errno));
 			return EXIT_FAILURE;
 		}
-	} else {
-		sourcefile = stdin;
 	}
 
-	if (outdir && !(stat(outdir, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+	if (opts.outdir && !(stat(opts.outdir, &sb) == 0 && S_ISDIR(sb.st_mode))) {
 		fprintf(stderr, "Specified output directory '%s' either doesn't"
-			" exist or isn't a directory\n", outdir);
+			" exist or isn't a directory\n", opts.outdir);
 		return EXIT_FAILURE;
 	}
 
-	if (!outdir)
-		outdir = ".";
+	if (!opts.outdir)
+		opts.outdir = ".";
 
-	qmi_parse();
+	/* umask() can only be read by setting it, so do it before any threads */
+	opts.umask = umask(0);
+	umask(opts.umask);
 
-	snprintf(fname, sizeof(fname), "%s/qmi_%s.c", outdir, qmi_package.name);
-	sfp = fopen(fname, "w");
-	if (!sfp)
-		err(1, "failed to open %s", fname);
+	/* Read from stdin if no sources were given */
+	if (!nsources)
+		sources[nsources++] = NULL;
 
-	snprintf(fname, sizeof(fname), "%s/qmi_%s.h", outdir, qmi_package.name);
-	hfp = fopen(fname, "w");
-	if (!hfp)
-		err(1, "failed to open %s", fname);
+	if (!njobs)
+		njobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (njobs > nsources)
+		njobs = nsources;
+	if (njobs < 1)
+		njobs = 1;
 
-	switch (method) {
-	case 0:
-		accessor_emit_c(sfp, qmi_package.name);
-		accessor_emit_h(hfp, qmi_package.name);
-		break;
-	case 1:
-		kernel_emit_c(sfp);
-		kernel_emit_h(hfp);
-		break;
+	start = qmi_clock_ns();
+
+	jobs.opts = &opts;
+	jobs.sources = sources;
+	jobs.count = nsources;
+	jobs.outputs = memalloc(nsources * sizeof(*jobs.outputs));
+
+	/* The calling thread is one of the workers */
+	threads = memalloc(njobs * sizeof(*threads));
+	for (i = 1; i < njobs; i++) {
+		ret = pthread_create(&threads[i], NULL, qmic_worker, &jobs);
+		if (ret) {
+			errno = ret;
+			err(1, "failed to create worker thread");
+		}
 	}
 
-	fclose(hfp);
-	fclose(sfp);
+	qmic_worker(&jobs);
+
+	for (i = 1; i < njobs; i++)
+		pthread_join(threads[i], NULL);
+
+	if (!packages_unique(&jobs))
+		return EXIT_FAILURE;
+
+	for (i = 0; i < nsources; i++)
+		qmic_commit(&opts, &jobs.outputs[i]);
+
+	if (depfile)
+		depfile_write(&opts, depfile, &jobs);
+
+	if (opts.timing) {
+		getrusage(RUSAGE_SELF, &ru);
+		fprintf(stderr, "total %.3f ms, peak RSS %ld KiB\n",
+			(qmi_clock_ns() - start) / 1e6, ru.ru_maxrss);
+	}
+
+	for (i = 0; i < nsources; i++) {
+		free(jobs.outputs[i].package);
+		free(jobs.outputs[i].sbuf);
+		free(jobs.outputs[i].hbuf);
+		free(jobs.outputs[i].bbuf);
+	}
+	free(jobs.outputs);
+	free(threads);
+	free(sources);
 
 	return 0;
 }
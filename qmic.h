@@ -3,6 +3,9 @@
 
 #include <err.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "list.h"
 
@@ -32,14 +35,14 @@ enum message_type {
 };
 
 extern const char *sz_simple_types[];
+extern const char *sz_native_types[];
+extern const char *sz_data_types[];
 
 struct qmi_package {
 	const char *name;
 	unsigned short service_id;
 };
 
-extern struct qmi_package qmi_package;
-
 struct qmi_const {
 	const char *name;
 	long long value;
@@ -68,6 +71,9 @@ struct qmi_message {
 	const char *name;
 	unsigned msg_id;
 
+	/* Index of the first entry in the relocation-free tables, see desc.c */
+	unsigned rec_index;
+
 	struct list_head node;
 
 	struct list_head members;
@@ -101,6 +107,12 @@ struct qmi_struct {
 	 */
 	struct qmi_struct_member *member;
 
+	/* Index of the first entry in the relocation-free tables, see desc.c */
+	unsigned rec_index;
+
+	/* First struct of the same shape, whose ei table is shared */
+	struct qmi_struct *shape;
+
 	struct list_head node;
 
 	struct list_head members;
@@ -113,25 +125,122 @@ struct qmi_enum {
 	struct list_head members;
 };
 
-extern struct list_head qmi_consts;
-extern struct list_head qmi_messages;
-extern struct list_head qmi_structs;
-extern struct list_head qmi_enums;
-extern FILE *sourcefile;
+/* Bump allocator, releasing everything allocated from it at once */
+struct arena {
+	struct arena_chunk *chunks;
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_free(struct arena *arena);
+
+/* Time spent in each phase of a compilation, in nanoseconds */
+struct qmi_stats {
+	bool enabled;
+
+	uint64_t lex;
+	uint64_t parse;
+	uint64_t names;
+	uint64_t emit;
+};
+
+uint64_t qmi_clock_ns(void);
+
+/*
+ * Everything known about a single compilation. Nothing here is shared with
+ * other compilations, so several of them can run in parallel.
+ */
+struct qmi_ctx {
+	/* Name of the input, for diagnostics; NULL when reading stdin */
+	const char *source;
 
-void qmi_parse(void);
+	struct qmi_package package;
+
+	struct list_head consts;
+	struct list_head messages;
+	struct list_head structs;
+	struct list_head enums;
+
+	/* Owns the parsed representation of the source */
+	struct arena arena;
+
+	struct qmi_stats stats;
+
+	/* Let structs of the same shape share their tables, see -s */
+	bool share_shapes;
+
+	/* Message dispatch table, built by dispatch.c on first use */
+	struct dispatch *dispatch;
+};
+
+void qmi_parse(struct qmi_ctx *ctx, FILE *fp);
 
 void emit_source_includes(FILE *fp, const char *package);
 void guard_header(FILE *fp, const char *package);
 void guard_footer(FILE *fp);
-void qmi_const_header(FILE *fp);
-void qmi_enum_header(FILE *fp);
+void qmi_const_header(struct qmi_ctx *ctx, FILE *fp);
+void qmi_enum_header(struct qmi_ctx *ctx, FILE *fp);
 
-void accessor_emit_c(FILE *fp, const char *package);
-void accessor_emit_h(FILE *fp, const char *package);
+/* Optional parts of the accessor style sources, apart from the kernel ones */
+enum {
+	ACCESSOR_INLINE = 1 << 8,	/* static inline accessors in the header */
+};
+
+void accessor_emit_c(struct qmi_ctx *ctx, FILE *fp, const char *package, unsigned flags);
+void accessor_emit_h(struct qmi_ctx *ctx, FILE *fp, const char *package, unsigned flags);
+
+/* Optional parts of the kernel style sources */
+enum {
+	KERNEL_CODEC = 1 << 0,	/* Compiled encoders/decoders */
+	KERNEL_VIEW = 1 << 1,	/* Zero-copy views of received messages */
+	KERNEL_PACK = 1 << 2,	/* Reorder struct members to save padding */
+	KERNEL_MASK = 1 << 3,	/* Presence bitmask instead of _valid flags */
+	KERNEL_CONST = 1 << 4,	/* Relocation-free tables instead of ei tables */
+	KERNEL_SHARE = 1 << 5,	/* Share the tables of same shaped structs */
+	KERNEL_DISPATCH = 1 << 6,	/* <pkg>_lookup() of received messages */
+};
 
-void kernel_emit_c(FILE *fp);
-void kernel_emit_h(FILE *fp);
+void kernel_emit_c(struct qmi_ctx *ctx, FILE *fp, unsigned flags);
+void kernel_emit_h(struct qmi_ctx *ctx, FILE *fp, unsigned flags);
+
+void codec_emit_c(struct qmi_ctx *ctx, FILE *fp, unsigned flags);
+void codec_emit_h(struct qmi_ctx *ctx, FILE *fp);
+void codec_emit_size_c(struct qmi_ctx *ctx, FILE *fp, unsigned flags);
+void codec_emit_size_h(struct qmi_ctx *ctx, FILE *fp);
+void codec_emit_view_c(struct qmi_ctx *ctx, FILE *fp);
+void codec_emit_view_h(struct qmi_ctx *ctx, FILE *fp);
+
+void desc_emit_c(struct qmi_ctx *ctx, FILE *fp);
+void desc_emit_h(struct qmi_ctx *ctx, FILE *fp);
+
+void dispatch_emit_c(struct qmi_ctx *ctx, FILE *fp, unsigned flags);
+void dispatch_emit_h(struct qmi_ctx *ctx, FILE *fp, unsigned flags);
+
+/* Helpers shared with the other kernel style emitters */
+bool is_response_type(struct qmi_struct *qs);
+const char *struct_name(struct qmi_ctx *ctx, char *buf, size_t len, struct qmi_struct *qs);
+const char *struct_ei_name(struct qmi_ctx *ctx, char *buf, size_t len, struct qmi_struct *qs);
+bool message_member_is_array(struct qmi_message_member *qmm);
+const char *message_array_len_type(struct qmi_message_member *qmm);
+unsigned message_array_len_size(struct qmi_message_member *qmm);
+unsigned message_string_max(struct qmi_message_member *qmm);
+unsigned message_string_elem_len(struct qmi_message_member *qmm);
+unsigned struct_string_max(struct qmi_struct_member *qsm);
+unsigned struct_string_elem_len(struct qmi_struct_member *qsm);
+bool message_member_is_optional(struct qmi_message_member *qmm);
+unsigned message_member_ei_entries(struct qmi_message_member *qmm);
+unsigned message_optional_count(struct qmi_message *qm);
+const char *message_mask_type(struct qmi_message *qm);
+unsigned message_present_bit(struct qmi_message *qm, struct qmi_message_member *qmm);
+void emit_present_name(struct qmi_ctx *ctx, FILE *fp, struct qmi_message *qm,
+		       struct qmi_message_member *qmm);
+void emit_present_set(struct qmi_ctx *ctx, FILE *fp, const char *indent,
+		      struct qmi_message *qm, struct qmi_message_member *qmm,
+		      unsigned flags);
+void emit_upper(FILE *fp, const char *s);
+
+void bench_emit_accessor(struct qmi_ctx *ctx, FILE *fp);
+void bench_emit_kernel(struct qmi_ctx *ctx, FILE *fp, unsigned flags);
 
 /* Allocate and zero a block of memory; and exit if it fails */
 #define memalloc(size) ({						\
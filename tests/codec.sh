@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Check the compiled encoders and decoders of the kernel style sources.
+#
+# usage: codec.sh QMIC
+#
+# Runs qmic in each of the modes with compiled codecs over the IDLs in tests/
+# which are expected to compile, plus tests/codec/codec.qmi, with -d -b. The
+# benchmark of each message checks its codec against itself and against
+# tests/qmi_ei.c interpreting the ei tables, for a few random fills. Then
+# tests/codec/codec.c checks the behaviour of each mode on codec.qmi and
+# big.qmi.
+#
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 QMIC" >&2
+	exit 1
+fi
+
+qmic=$1
+srcdir=$(dirname "$0")/..
+cc=${CC:-cc}
+cflags="-Wall -Wextra -Werror -g -O1 -I$srcdir/tests/include"
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+for mode in c V m r cP cs rs; do
+	for idl in "$srcdir"/tests/*.qmi "$srcdir/tests/codec/codec.qmi"; do
+		name=$(basename "$idl" .qmi)
+		out=$tmp/$mode/$name
+		mkdir -p "$out"
+
+		# Skip the tests of invalid input
+		"$qmic" -$mode -d -b -o "$out" "$idl" 2> /dev/null || continue
+
+		$cc $cflags -I"$out" -o "$out/bench" "$out"/*.c \
+			"$srcdir/tests/qmi_ei.c" || exit 1
+
+		for seed in 1 2 3 4 5 6 7 8; do
+			if ! "$out/bench" 1 $seed > /dev/null; then
+				echo "$mode $name: seed $seed failed" >&2
+				exit 1
+			fi
+		done
+	done
+
+	# Behaviour tests of the mode, compiled along codec.qmi's sources and
+	# big.qmi's, whose messages are too big for the benchmarks
+	out=$tmp/$mode/codec
+	rm -f "$out/qmi_codec_bench.c"
+	"$qmic" -$mode -o "$out" "$srcdir/tests/codec/big.qmi" 2> /dev/null || exit 1
+	$cc $cflags -DMODE_$(echo $mode | cut -c1) -I"$out" -o "$out/test" \
+		"$srcdir/tests/codec/codec.c" "$out"/*.c \
+		"$srcdir/tests/qmi_ei.c" || exit 1
+	"$out/test" || exit 1
+
+	echo "$mode ok"
+done
@@ -0,0 +1,554 @@
+/*
+ * Behaviour tests of the kernel style sources with compiled codecs, built
+ * with the sources qmic emits for codec.qmi and big.qmi in one of the
+ * modes, see tests/codec.sh:
+ *
+ *   MODE_c  -c, or -c -P
+ *   MODE_V  -V, adding the zero-copy views
+ *   MODE_m  -m, with a presence bitmask in place of the _valid flags
+ *   MODE_r  -r, with const qmi_elem_rec tables in place of the ei tables
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qmi_big.h"
+#include "qmi_codec.h"
+
+#define QMI_REQUEST 0
+#define QMI_RESPONSE 2
+#define QMI_INDICATION 4
+
+static int failed;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		failed++;						\
+	}								\
+} while (0)
+
+/* Presence of the optional members, whichever way the mode records it */
+#ifdef MODE_m
+#define SET_PRESENT(msg, field, bit) ((msg)->present |= (bit))
+#define IS_PRESENT(msg, field, bit) (!!((msg)->present & (bit)))
+#else
+#define SET_PRESENT(msg, field, bit) ((msg)->field##_valid = true)
+#define IS_PRESENT(msg, field, bit) ((msg)->field##_valid)
+#endif
+
+#ifdef MODE_r
+static struct qmi_elem_info rec_ei[512];
+
+/*
+ * The entries of codec_elems[] from the 1-based @index as a qmi_elem_info
+ * table, as a user of -r without the tables would rebuild them
+ */
+static struct qmi_elem_info *elems_ei(unsigned index)
+{
+	const struct qmi_elem_rec *rec = &codec_elems[index - 1];
+	struct qmi_elem_info *ei = &rec_ei[index - 1];
+
+	for (;; rec++, ei++) {
+		if (ei >= rec_ei + sizeof(rec_ei) / sizeof(rec_ei[0]))
+			abort();
+
+		ei->data_type = rec->data_type;
+		ei->elem_len = rec->elem_len;
+		ei->elem_size = rec->elem_size;
+		ei->array_type = rec->array_type;
+		ei->tlv_type = rec->tlv_type;
+		ei->offset = rec->offset;
+		ei->ei_array = rec->ei_array ? elems_ei(rec->ei_array) : NULL;
+
+		if (rec->data_type == QMI_EOTI)
+			break;
+	}
+
+	return &rec_ei[index - 1];
+}
+#endif
+
+/* Table for qmi_encode_message() of a message, NULL if the mode has none */
+static struct qmi_elem_info *message_ei(unsigned type, unsigned msg_id)
+{
+#if defined(MODE_m)
+	(void)type;
+	(void)msg_id;
+	return NULL;
+#elif defined(MODE_r)
+	const struct qmi_message_rec *rec = codec_lookup(type, msg_id);
+
+	return rec ? elems_ei(rec->elems) : NULL;
+#else
+	struct qmi_message_desc *desc = codec_lookup(type, msg_id);
+
+	return desc ? desc->ei : NULL;
+#endif
+}
+
+/* Encode @msg with the reference encoder, returning the payload length */
+static int ref_encode(unsigned type, unsigned msg_id, const void *msg,
+		      uint8_t *buf, size_t len)
+{
+	uint8_t pkt_buf[sizeof(struct qmi_header) + CODEC_GET_RESP_MAX_WIRE_SIZE];
+	struct qrtr_packet pkt = { .data = pkt_buf, .data_len = sizeof(pkt_buf) };
+	ssize_t ret;
+
+	ret = qmi_encode_message(&pkt, type, msg_id, 0, msg, message_ei(type, msg_id));
+	if (ret < 0)
+		return ret;
+
+	ret -= sizeof(struct qmi_header);
+	if ((size_t)ret > len)
+		return -ENOSPC;
+	memcpy(buf, pkt_buf + sizeof(struct qmi_header), ret);
+
+	return ret;
+}
+
+static void fill_lte(struct codec_lte_t *lte, unsigned seed)
+{
+	unsigned i;
+
+	lte->earfcn = 0x01020304 * seed;
+	lte->cells_len = seed % 5;
+	for (i = 0; i < lte->cells_len; i++)
+		lte->cells[i] = seed + i;
+}
+
+static void fill_plmn(struct codec_plmn *plmn, unsigned seed)
+{
+	unsigned i;
+
+	plmn->mcc = 310 + seed;
+	plmn->mnc = 260 - seed;
+	plmn->name_len = 3;
+	memcpy(plmn->name, "abc", 3);
+	plmn->inner.a = seed;
+	plmn->inner.b = -1000 * (int)seed;
+	for (i = 0; i < 3; i++)
+		plmn->inner.fixed[i] = 0x1111 * (seed + i);
+	plmn->ltes_len = seed % 4;
+	for (i = 0; i < plmn->ltes_len; i++)
+		fill_lte(&plmn->ltes[i], seed + i);
+	snprintf(plmn->desc, sizeof(plmn->desc), "network %u", seed);
+	plmn->desc_len = strlen(plmn->desc);
+}
+
+static void fill_resp(struct codec_get_resp *resp)
+{
+	unsigned i;
+
+	memset(resp, 0, sizeof(*resp));
+	resp->res.result = 1;
+	resp->res.error = 0x30;
+
+	SET_PRESENT(resp, net, CODEC_GET_RESP_HAS_NET);
+	fill_plmn(&resp->net, 1);
+
+	SET_PRESENT(resp, nets, CODEC_GET_RESP_HAS_NETS);
+	resp->nets_len = 3;
+	for (i = 0; i < resp->nets_len; i++)
+		fill_plmn(&resp->nets[i], 2 + i);
+
+	SET_PRESENT(resp, pair, CODEC_GET_RESP_HAS_PAIR);
+	resp->pair_len = 2;
+	fill_lte(&resp->pair[0], 7);
+	fill_lte(&resp->pair[1], 8);
+
+	SET_PRESENT(resp, deltas, CODEC_GET_RESP_HAS_DELTAS);
+	resp->deltas_len = 4;
+	resp->deltas[0] = -1;
+	resp->deltas[1] = 2;
+	resp->deltas[2] = -32768;
+	resp->deltas[3] = 32767;
+}
+
+static void fill_req(struct codec_get_req *req)
+{
+	unsigned i;
+
+	memset(req, 0, sizeof(*req));
+	req->mode = 9;
+
+	/* Strings of messages hold up to 255 characters */
+	memset(req->operator, 'o', 255);
+	req->operator_len = 255;
+
+	SET_PRESENT(req, ids, CODEC_GET_REQ_HAS_IDS);
+	req->ids_len = 5;
+	for (i = 0; i < req->ids_len; i++)
+		req->ids[i] = 0xdeadbeef + i;
+
+	SET_PRESENT(req, raw, CODEC_GET_REQ_HAS_RAW);
+	for (i = 0; i < 6; i++)
+		req->raw[i] = 0xa0 + i;
+
+	SET_PRESENT(req, big, CODEC_GET_REQ_HAS_BIG);
+	req->big = -0x123456789abLL;
+}
+
+/* Whether a TLV of @buf starts at @off, walking from the start */
+static int tlv_boundary(const uint8_t *buf, size_t len, size_t off)
+{
+	size_t p = 0;
+
+	while (p < off && p + 3 <= len)
+		p += 3 + (buf[p + 1] | buf[p + 2] << 8);
+
+	return p == off;
+}
+
+/* The encoding of a known message, spelt out */
+static void test_wire(void)
+{
+	static const uint8_t expected[] = {
+		0x10, 0x02, 0x00, '8', '9',
+		0x11, 0x08, 0x00,
+		0x04, 0x03, 0x02, 0x01,
+		0x02, 0x00, 0x05, 0x06,
+	};
+	struct codec_get_ind ind;
+	uint8_t buf[CODEC_GET_IND_MAX_WIRE_SIZE];
+	uint8_t ref[CODEC_GET_IND_MAX_WIRE_SIZE];
+	int len;
+
+	memset(&ind, 0, sizeof(ind));
+	strcpy(ind.iccid, "89");
+	ind.iccid_len = 2;
+	SET_PRESENT(&ind, lte, CODEC_GET_IND_HAS_LTE);
+	ind.lte.earfcn = 0x01020304;
+	ind.lte.cells_len = 2;
+	ind.lte.cells[0] = 5;
+	ind.lte.cells[1] = 6;
+
+	len = codec_get_ind_encode(&ind, buf, sizeof(buf));
+	CHECK(len == sizeof(expected) && !memcmp(buf, expected, len));
+	CHECK(codec_get_ind_encoded_size(&ind) == sizeof(expected));
+
+	/* Exactly sized buffers do, one byte less doesn't */
+	CHECK(codec_get_ind_encode(&ind, buf, sizeof(expected)) == sizeof(expected));
+	CHECK(codec_get_ind_encode(&ind, buf, sizeof(expected) - 1) == -ENOSPC);
+
+	if (message_ei(QMI_INDICATION, 0x21)) {
+		len = ref_encode(QMI_INDICATION, 0x21, &ind, ref, sizeof(ref));
+		CHECK(len == sizeof(expected) && !memcmp(ref, expected, len));
+	}
+}
+
+/*
+ * Arrays of structs in structs, through the ei tables: elements after the
+ * first were read with the stride of the containing struct
+ */
+static void test_nested_ei(void)
+{
+	static const uint8_t expected[] = {
+		0x02, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x10, 0x20, 0x00,
+		0x02, 0x01, 0x04, 0x03,			/* mcc, mnc */
+		0x00,					/* name */
+		0x05, 0x06, 0x00, 0x00, 0x00,		/* inner */
+		0x07, 0x00, 0x08, 0x00, 0x09, 0x00,
+		0x02,					/* ltes */
+		0x0a, 0x00, 0x00, 0x00, 0x01, 0x00, 0x0b,
+		0x0c, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00,				/* desc */
+	};
+	static struct codec_get_resp resp;
+	static uint8_t buf[CODEC_GET_RESP_MAX_WIRE_SIZE];
+	int len;
+
+	if (!message_ei(QMI_RESPONSE, 0x20))
+		return;
+
+	memset(&resp, 0, sizeof(resp));
+	SET_PRESENT(&resp, net, CODEC_GET_RESP_HAS_NET);
+	resp.net.mcc = 0x0102;
+	resp.net.mnc = 0x0304;
+	resp.net.inner.a = 5;
+	resp.net.inner.b = 6;
+	resp.net.inner.fixed[0] = 7;
+	resp.net.inner.fixed[1] = 8;
+	resp.net.inner.fixed[2] = 9;
+	resp.net.ltes_len = 2;
+	resp.net.ltes[0].earfcn = 0x0a;
+	resp.net.ltes[0].cells_len = 1;
+	resp.net.ltes[0].cells[0] = 0x0b;
+	resp.net.ltes[1].earfcn = 0x0c;
+
+	len = ref_encode(QMI_RESPONSE, 0x20, &resp, buf, sizeof(buf));
+	CHECK(len == sizeof(expected) && !memcmp(buf, expected, len));
+
+	len = codec_get_resp_encode(&resp, buf, sizeof(buf));
+	CHECK(len == sizeof(expected) && !memcmp(buf, expected, len));
+}
+
+/* Encode, decode and encode again, and the same through the ei tables */
+static void test_roundtrip(void)
+{
+	static struct codec_get_resp resp;
+	static struct codec_get_resp out;
+	static struct codec_get_req req;
+	static struct codec_get_req req_out;
+	static uint8_t buf[CODEC_GET_RESP_MAX_WIRE_SIZE];
+	static uint8_t again[CODEC_GET_RESP_MAX_WIRE_SIZE];
+	unsigned i;
+	int len;
+
+	fill_resp(&resp);
+
+	/* Strings in structs hold as much as the tables tell libqrtr */
+	memset(resp.nets[1].desc, 'd', sizeof(resp.nets[1].desc) - 1);
+	CHECK(sizeof(resp.nets[1].desc) == 256);
+
+	len = codec_get_resp_encode(&resp, buf, sizeof(buf));
+	CHECK(len > 0 && (size_t)len == codec_get_resp_encoded_size(&resp));
+	if (len <= 0)
+		return;
+
+	memset(&out, 0, sizeof(out));
+	CHECK(codec_get_resp_decode(&out, buf, len) == 0);
+	CHECK(out.res.result == 1 && out.res.error == 0x30);
+	CHECK(IS_PRESENT(&out, net, CODEC_GET_RESP_HAS_NET));
+	CHECK(out.net.mcc == resp.net.mcc && out.net.inner.b == resp.net.inner.b);
+	CHECK(!strcmp(out.net.desc, "network 1"));
+	CHECK(out.nets_len == 3);
+	for (i = 0; i < out.nets_len; i++) {
+		CHECK(out.nets[i].ltes_len == resp.nets[i].ltes_len);
+		CHECK(!memcmp(out.nets[i].inner.fixed, resp.nets[i].inner.fixed,
+			      sizeof(out.nets[i].inner.fixed)));
+		CHECK(!strcmp(out.nets[i].desc, resp.nets[i].desc));
+	}
+	CHECK(out.nets[2].ltes[0].cells_len == resp.nets[2].ltes[0].cells_len);
+	CHECK(out.pair_len == 2 && out.pair[1].earfcn == resp.pair[1].earfcn);
+	CHECK(out.deltas_len == 4 && out.deltas[2] == -32768);
+
+	CHECK(codec_get_resp_encode(&out, again, sizeof(again)) == len);
+	CHECK(!memcmp(buf, again, len));
+
+	if (message_ei(QMI_RESPONSE, 0x20)) {
+		CHECK(ref_encode(QMI_RESPONSE, 0x20, &resp, again, sizeof(again)) == len);
+		CHECK(!memcmp(buf, again, len));
+	}
+
+	fill_req(&req);
+	len = codec_get_req_encode(&req, buf, sizeof(buf));
+	CHECK(len > 0);
+	if (len <= 0)
+		return;
+
+	memset(&req_out, 0, sizeof(req_out));
+	CHECK(codec_get_req_decode(&req_out, buf, len) == 0);
+	CHECK(strlen(req_out.operator) == 255);
+	CHECK(req_out.ids_len == 5 && req_out.ids[4] == 0xdeadbeef + 4);
+	CHECK(!memcmp(req_out.raw, req.raw, sizeof(req.raw)));
+	CHECK(req_out.big == -0x123456789abLL);
+
+	if (message_ei(QMI_REQUEST, 0x20)) {
+		CHECK(ref_encode(QMI_REQUEST, 0x20, &req, again, sizeof(again)) == len);
+		CHECK(!memcmp(buf, again, len));
+	}
+}
+
+/* Input cut short anywhere but between TLVs is rejected */
+static void test_truncated(void)
+{
+	static struct codec_get_resp resp;
+	static struct codec_get_resp out;
+	static struct codec_get_ind ind;
+	static uint8_t buf[CODEC_GET_RESP_MAX_WIRE_SIZE];
+	int cut_ok = 0;
+	int len;
+	int i;
+
+	fill_resp(&resp);
+	len = codec_get_resp_encode(&resp, buf, sizeof(buf));
+	CHECK(len > 0);
+
+	for (i = 0; i < len; i++) {
+		if (tlv_boundary(buf, len, i)) {
+			cut_ok += codec_get_resp_decode(&out, buf, i) == 0;
+			continue;
+		}
+
+		if (codec_get_resp_decode(&out, buf, i) != -EINVAL) {
+			fprintf(stderr, "%s: decode of %d of %d bytes\n", __func__, i, len);
+			failed++;
+		}
+	}
+
+	/* Before each of the 5 TLVs */
+	CHECK(cut_ok == 5);
+
+	/* A string longer than its buffer */
+	memcpy(buf, "\x10\x00\x01", 3);
+	memset(buf + 3, 'x', 256);
+	CHECK(codec_get_ind_decode(&ind, buf, 259) == -EINVAL);
+}
+
+/* Absent members are left out, and decoding tells which were there */
+static void test_presence(void)
+{
+	static struct codec_get_resp resp;
+	static struct codec_get_resp out;
+	static uint8_t buf[CODEC_GET_RESP_MAX_WIRE_SIZE];
+	int len;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.res.result = 1;
+	SET_PRESENT(&resp, r, CODEC_GET_RESP_HAS_R);
+	resp.r.error = 7;
+	SET_PRESENT(&resp, deltas, CODEC_GET_RESP_HAS_DELTAS);
+	resp.deltas_len = 1;
+
+	/* Filled in, but not marked present */
+	fill_plmn(&resp.net, 1);
+
+	len = codec_get_resp_encode(&resp, buf, sizeof(buf));
+	CHECK(len == 7 + 7 + 6);
+	CHECK(buf[0] == 0x02 && buf[7] == 0x12 && buf[14] == 0x14);
+
+	/* Flags left over from an earlier message are cleared */
+	memset(&out, 0xff, sizeof(out));
+	CHECK(codec_get_resp_decode(&out, buf, len) == 0);
+	CHECK(IS_PRESENT(&out, r, CODEC_GET_RESP_HAS_R) && out.r.error == 7);
+	CHECK(IS_PRESENT(&out, deltas, CODEC_GET_RESP_HAS_DELTAS));
+	CHECK(!IS_PRESENT(&out, net, CODEC_GET_RESP_HAS_NET));
+	CHECK(!IS_PRESENT(&out, nets, CODEC_GET_RESP_HAS_NETS));
+	CHECK(!IS_PRESENT(&out, pair, CODEC_GET_RESP_HAS_PAIR));
+#ifdef MODE_m
+	CHECK(out.present == (CODEC_GET_RESP_HAS_R | CODEC_GET_RESP_HAS_DELTAS));
+#endif
+
+	/* Items this side doesn't know of are skipped */
+	memcpy(buf + len, "\x30\x02\x00\x01\x02", 5);
+	CHECK(codec_get_resp_decode(&out, buf, len + 5) == 0);
+	CHECK(IS_PRESENT(&out, r, CODEC_GET_RESP_HAS_R));
+}
+
+/* TLVs longer than their 16 bit length can tell aren't sent */
+static void test_too_big(void)
+{
+	static struct big_cells_ind ind;
+	static uint8_t buf[BIG_CELLS_IND_MAX_WIRE_SIZE];
+
+	memset(&ind, 0, sizeof(ind));
+	SET_PRESENT(&ind, cells, BIG_CELLS_IND_HAS_CELLS);
+
+	/* 2 bytes of count and 6 of each cell */
+	ind.cells_len = (UINT16_MAX - 2) / 6;
+	CHECK(big_cells_ind_encode(&ind, buf, sizeof(buf)) == 3 + 2 + 6 * (int)ind.cells_len);
+
+	ind.cells_len++;
+	CHECK(big_cells_ind_encode(&ind, buf, sizeof(buf)) == -EMSGSIZE);
+}
+
+#ifdef MODE_V
+/* The views point into the buffer, which needn't be aligned */
+static void test_view(void)
+{
+	static struct codec_get_resp resp;
+	static struct codec_get_req req;
+	static uint8_t storage[CODEC_GET_RESP_MAX_WIRE_SIZE + 1];
+	uint8_t *buf = storage + 1;
+	struct codec_get_resp_view view;
+	struct codec_get_req_view req_view;
+	struct codec_plmn plmn;
+	struct codec_lte_t lte;
+	struct qmi_span span;
+	unsigned i;
+	int len;
+
+	fill_resp(&resp);
+	len = codec_get_resp_encode(&resp, buf, sizeof(storage) - 1);
+	CHECK(len > 0);
+	if (len <= 0)
+		return;
+
+	CHECK(codec_get_resp_decode_view(&view, buf, len) == 0);
+	CHECK(view.net_valid && view.net.mcc == resp.net.mcc);
+	CHECK(view.nets_valid && view.nets_len == 3);
+
+	span = view.nets;
+	CHECK((const uint8_t *)span.ptr > buf && (const uint8_t *)span.ptr < buf + len);
+	for (i = 0; i < view.nets_len; i++) {
+		CHECK(codec_plmn_view_next(&plmn, &span) == 0);
+		CHECK(plmn.mcc == resp.nets[i].mcc && plmn.ltes_len == resp.nets[i].ltes_len);
+		CHECK(!strcmp(plmn.desc, resp.nets[i].desc));
+	}
+	CHECK(span.len == 0);
+	CHECK(codec_plmn_view_next(&plmn, &span) == -EINVAL);
+
+	span = view.pair;
+	CHECK(codec_lte_t_view_next(&lte, &span) == 0 && lte.earfcn == resp.pair[0].earfcn);
+	CHECK(codec_lte_t_view_next(&lte, &span) == 0 && lte.earfcn == resp.pair[1].earfcn);
+
+	CHECK(view.deltas_valid && view.deltas_len == 4);
+	CHECK(view.deltas > buf && view.deltas < buf + len);
+	for (i = 0; i < view.deltas_len; i++)
+		CHECK(qmi_view_i16(view.deltas, i) == resp.deltas[i]);
+
+	CHECK(codec_get_resp_decode_view(&view, buf, len - 1) == -EINVAL);
+
+	fill_req(&req);
+	len = codec_get_req_encode(&req, buf, sizeof(storage) - 1);
+	CHECK(len > 0);
+	if (len <= 0)
+		return;
+
+	CHECK(codec_get_req_decode_view(&req_view, buf, len) == 0);
+	CHECK(req_view.operator.len == 255);
+	CHECK((const uint8_t *)req_view.operator.ptr > buf &&
+	      !memcmp(req_view.operator.ptr, req.operator, 255));
+	CHECK(req_view.ids_valid && req_view.ids_len == 5);
+	for (i = 0; i < req_view.ids_len; i++)
+		CHECK(qmi_view_u32(req_view.ids, i) == req.ids[i]);
+	CHECK(req_view.raw_valid && !memcmp(req_view.raw, req.raw, 6));
+	CHECK(req_view.big_valid && req_view.big == req.big);
+}
+#endif
+
+#ifdef MODE_r
+/* The descriptors and tables are plain data, with names by offset */
+static void test_const(void)
+{
+	const struct qmi_message_rec *rec;
+
+	rec = codec_lookup(QMI_RESPONSE, 0x20);
+	CHECK(rec && rec->size == sizeof(struct codec_get_resp));
+	CHECK(rec && !strcmp(codec_names + rec->name, "get_resp"));
+	CHECK(rec && codec_elems[rec->elems - 1].tlv_type == 0x02);
+
+	rec = codec_lookup(QMI_INDICATION, 0x21);
+	CHECK(rec && !strcmp(codec_names + rec->name, "get_ind"));
+
+	CHECK(!codec_lookup(QMI_INDICATION, 0x20));
+	CHECK(!codec_lookup(QMI_REQUEST, 0x22));
+}
+#endif
+
+int main(void)
+{
+	test_wire();
+	test_nested_ei();
+	test_roundtrip();
+	test_truncated();
+	test_presence();
+	test_too_big();
+#ifdef MODE_V
+	test_view();
+#endif
+#ifdef MODE_r
+	test_const();
+#endif
+
+	if (failed) {
+		fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
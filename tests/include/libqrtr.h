@@ -0,0 +1,83 @@
+#ifndef _LIBQRTR_H_
+#define _LIBQRTR_H_
+
+/*
+ * Just enough of libqrtr's API for the generated kernel style sources to
+ * compile, so that tests don't depend on libqrtr being installed.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+enum qmi_elem_type {
+	QMI_EOTI,
+	QMI_OPT_FLAG,
+	QMI_DATA_LEN,
+	QMI_UNSIGNED_1_BYTE,
+	QMI_UNSIGNED_2_BYTE,
+	QMI_UNSIGNED_4_BYTE,
+	QMI_UNSIGNED_8_BYTE,
+	QMI_SIGNED_1_BYTE,
+	QMI_SIGNED_2_BYTE,
+	QMI_SIGNED_4_BYTE,
+	QMI_SIGNED_8_BYTE,
+	QMI_STRUCT,
+	QMI_STRING,
+};
+
+enum qmi_array_type {
+	NO_ARRAY,
+	STATIC_ARRAY,
+	VAR_LEN_ARRAY,
+};
+
+struct qmi_elem_info {
+	enum qmi_elem_type data_type;
+	uint32_t elem_len;
+	uint32_t elem_size;
+	enum qmi_array_type array_type;
+	uint8_t tlv_type;
+	uint32_t offset;
+	struct qmi_elem_info *ei_array;
+};
+
+struct qmi_header {
+	uint8_t type;
+	uint16_t txn_id;
+	uint16_t msg_id;
+	uint16_t msg_len;
+} __attribute__((__packed__));
+
+struct qmi_message_header {
+	struct qmi_header qmi_header;
+	struct qmi_elem_info *ei;
+	uint32_t service;
+	const char *name;
+};
+
+struct qmi_response_type_v01 {
+	uint16_t result;
+	uint16_t error;
+};
+
+extern struct qmi_elem_info qmi_response_type_v01_ei[];
+
+struct qrtr_packet {
+	int type;
+	unsigned int node;
+	unsigned int port;
+	void *data;
+	size_t data_len;
+};
+
+ssize_t qmi_encode_message(struct qrtr_packet *pkt, int type, int msg_id,
+			   int txn_id, const void *c_struct,
+			   struct qmi_elem_info *ei);
+int qmi_decode_message(void *c_struct, unsigned int *txn,
+		       struct qrtr_packet *pkt, int type, int id,
+		       struct qmi_elem_info *ei);
+
+#endif
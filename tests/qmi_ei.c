@@ -0,0 +1,410 @@
+/*
+ * Reference interpreter of the qmi_elem_info tables, following the encoder
+ * and decoder of libqrtr (and of the kernel's qmi_encdec.c), so that the
+ * kernel style sources can be tested against it without libqrtr.
+ *
+ * It differs from libqrtr where that would only make the tests crash on bad
+ * input: all reads are bounds checked, failing with -EINVAL, and lengths are
+ * stored with the elem_size of their QMI_DATA_LEN entry rather than always as
+ * 32 bits. Strings are sized by their terminating NUL whatever their
+ * array_type.
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "libqrtr.h"
+
+#define TLV_HDR_SIZE 3
+#define OPTIONAL_TLV_TYPE_START 0x10
+
+struct qmi_elem_info qmi_response_type_v01_ei[] = {
+	{
+		.data_type = QMI_UNSIGNED_2_BYTE,
+		.elem_len = 1,
+		.elem_size = sizeof(uint16_t),
+		.offset = offsetof(struct qmi_response_type_v01, result),
+	},
+	{
+		.data_type = QMI_UNSIGNED_2_BYTE,
+		.elem_len = 1,
+		.elem_size = sizeof(uint16_t),
+		.offset = offsetof(struct qmi_response_type_v01, error),
+	},
+	{}
+};
+
+/* Skip the rest of the entries of an absent or empty item */
+static const struct qmi_elem_info *skip_to_next_elem(const struct qmi_elem_info *ei, int level)
+{
+	uint8_t tlv_type;
+
+	if (level > 1)
+		return ei + 1;
+
+	do {
+		tlv_type = ei->tlv_type;
+		ei++;
+	} while (tlv_type == ei->tlv_type);
+
+	return ei;
+}
+
+static ssize_t qmi_encode(const struct qmi_elem_info *ei, uint8_t *out, size_t out_len,
+			  const uint8_t *in, int level);
+
+static ssize_t qmi_encode_struct_elem(const struct qmi_elem_info *ei, uint8_t *out,
+				      size_t out_len, const uint8_t *in,
+				      uint32_t count, int level)
+{
+	size_t encoded = 0;
+	ssize_t ret;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		ret = qmi_encode(ei->ei_array, out + encoded, out_len - encoded,
+				 in + i * ei->elem_size, level);
+		if (ret < 0)
+			return ret;
+		encoded += ret;
+	}
+
+	return encoded;
+}
+
+static ssize_t qmi_encode_string_elem(const struct qmi_elem_info *ei, uint8_t *out,
+				      size_t out_len, const char *in, int level)
+{
+	size_t len_size = ei->elem_len <= UINT8_MAX ? 1 : 2;
+	size_t len = strlen(in);
+	uint16_t n = len;
+
+	if (len > ei->elem_len)
+		return -EINVAL;
+
+	/* Strings make up the whole of a TLV, or have a length if nested */
+	if (level == 1)
+		len_size = 0;
+
+	if (len_size + len > out_len)
+		return -ENOSPC;
+
+	memcpy(out, &n, len_size);
+	memcpy(out + len_size, in, len);
+
+	return len_size + len;
+}
+
+static ssize_t qmi_encode(const struct qmi_elem_info *ei, uint8_t *out, size_t out_len,
+			  const uint8_t *in, int level)
+{
+	uint8_t *tlv = out;
+	uint32_t data_len = 0;
+	size_t encoded = 0;
+	bool encode_tlv = false;
+	size_t avail;
+	uint16_t tlv_len = 0;
+	uint8_t tlv_type;
+	size_t len_size;
+	ssize_t ret;
+
+	/* Leave room for the header of the first TLV */
+	if (level == 1)
+		encoded = TLV_HDR_SIZE;
+
+	while (ei->data_type != QMI_EOTI) {
+		const uint8_t *src = in + ei->offset;
+
+		tlv_type = ei->tlv_type;
+		avail = encoded < out_len ? out_len - encoded : 0;
+
+		if (ei->array_type == NO_ARRAY) {
+			data_len = 1;
+		} else if (ei->array_type == STATIC_ARRAY) {
+			data_len = ei->elem_len;
+		} else if (ei->data_type != QMI_STRING &&
+			   (!data_len || data_len > ei->elem_len)) {
+			return -EINVAL;
+		}
+
+		switch (ei->data_type) {
+		case QMI_OPT_FLAG:
+			if (*src)
+				ei++;
+			else
+				ei = skip_to_next_elem(ei, level);
+			continue;
+
+		case QMI_DATA_LEN:
+			len_size = ei->elem_size == 1 ? 1 : 2;
+			data_len = 0;
+			memcpy(&data_len, src, ei->elem_size);
+			if (avail < len_size)
+				return -ENOSPC;
+			memcpy(out + encoded, &data_len, len_size);
+			ret = len_size;
+			break;
+
+		case QMI_STRUCT:
+			ret = qmi_encode_struct_elem(ei, out + encoded, avail,
+						     src, data_len, level + 1);
+			break;
+
+		case QMI_STRING:
+			ret = qmi_encode_string_elem(ei, out + encoded, avail,
+						     (const char *)src, level);
+			break;
+
+		default:
+			ret = (size_t)data_len * ei->elem_size;
+			if ((size_t)ret > avail)
+				return -ENOSPC;
+			memcpy(out + encoded, src, ret);
+			break;
+		}
+
+		if (ret < 0)
+			return ret;
+
+		encoded += ret;
+		tlv_len += ret;
+		encode_tlv = true;
+
+		if (ei->data_type == QMI_DATA_LEN && data_len)
+			encode_tlv = false;
+
+		if (ei->data_type == QMI_DATA_LEN && !data_len)
+			ei = skip_to_next_elem(ei + 1, level);
+		else
+			ei++;
+
+		if (encode_tlv && level == 1) {
+			tlv[0] = tlv_type;
+			memcpy(&tlv[1], &tlv_len, sizeof(tlv_len));
+
+			/* ...and for the header of the next one */
+			tlv = out + encoded;
+			tlv_len = 0;
+			encoded += TLV_HDR_SIZE;
+			encode_tlv = false;
+		}
+	}
+
+	/* The header reserved for a next TLV isn't part of the message */
+	if (level == 1)
+		encoded -= TLV_HDR_SIZE;
+
+	return encoded;
+}
+
+static const struct qmi_elem_info *find_ei(const struct qmi_elem_info *ei, uint8_t tlv_type)
+{
+	for (; ei->data_type != QMI_EOTI; ei++) {
+		if (ei->tlv_type == tlv_type)
+			return ei;
+	}
+
+	return NULL;
+}
+
+static ssize_t qmi_decode(const struct qmi_elem_info *ei, uint8_t *out,
+			  const uint8_t *in, size_t in_len, int level);
+
+static ssize_t qmi_decode_struct_elem(const struct qmi_elem_info *ei, uint8_t *out,
+				      const uint8_t *in, uint32_t count,
+				      size_t tlv_len, int level)
+{
+	size_t decoded = 0;
+	ssize_t ret;
+	uint32_t i;
+
+	for (i = 0; i < count && decoded < tlv_len; i++) {
+		ret = qmi_decode(ei->ei_array, out + i * ei->elem_size,
+				 in + decoded, tlv_len - decoded, level);
+		if (ret < 0)
+			return ret;
+		decoded += ret;
+	}
+
+	/* A TLV holds exactly its structs, nested ones must all be there */
+	if ((level <= 2 && decoded != tlv_len) || (level > 2 && i < count))
+		return -EINVAL;
+
+	return decoded;
+}
+
+static ssize_t qmi_decode_string_elem(const struct qmi_elem_info *ei, char *out,
+				      const uint8_t *in, size_t tlv_len, int level)
+{
+	size_t len_size = 0;
+	uint16_t len = 0;
+
+	if (level == 1) {
+		len = tlv_len;
+	} else {
+		len_size = ei->elem_len <= UINT8_MAX ? 1 : 2;
+		if (tlv_len < len_size)
+			return -EINVAL;
+		memcpy(&len, in, len_size);
+	}
+
+	if (len >= ei->elem_len || len > tlv_len - len_size)
+		return -EINVAL;
+
+	memcpy(out, in + len_size, len);
+	out[len] = '\0';
+
+	return len_size + len;
+}
+
+static ssize_t qmi_decode(const struct qmi_elem_info *ei_array, uint8_t *out,
+			  const uint8_t *in, size_t in_len, int level)
+{
+	const struct qmi_elem_info *ei = ei_array;
+	uint32_t data_len = 0;
+	size_t decoded = 0;
+	size_t tlv_len = 0;
+	size_t len_size;
+	uint16_t len16;
+	uint8_t tlv_type;
+	ssize_t ret;
+
+	while (decoded < in_len) {
+		if (level >= 2 && ei->data_type == QMI_EOTI)
+			return decoded;
+
+		if (level == 1) {
+			if (in_len - decoded < TLV_HDR_SIZE)
+				return -EINVAL;
+			tlv_type = in[decoded];
+			memcpy(&len16, &in[decoded + 1], sizeof(len16));
+			tlv_len = len16;
+			decoded += TLV_HDR_SIZE;
+
+			if (tlv_len > in_len - decoded)
+				return -EINVAL;
+
+			ei = find_ei(ei_array, tlv_type);
+			if (!ei && tlv_type < OPTIONAL_TLV_TYPE_START)
+				return -EINVAL;
+			if (!ei) {
+				decoded += tlv_len;
+				continue;
+			}
+		} else {
+			/* Nested items have no length, they get what remains */
+			tlv_len = in_len - decoded;
+		}
+
+		if (ei->data_type == QMI_OPT_FLAG) {
+			out[ei->offset] = 1;
+			ei++;
+		}
+
+		if (ei->data_type == QMI_DATA_LEN) {
+			len_size = ei->elem_size == 1 ? 1 : 2;
+			if (tlv_len < len_size)
+				return -EINVAL;
+			data_len = 0;
+			memcpy(&data_len, &in[decoded], len_size);
+			memcpy(out + ei->offset, &data_len, ei->elem_size);
+			decoded += len_size;
+			tlv_len -= len_size;
+			ei++;
+		}
+
+		if (ei->array_type == NO_ARRAY)
+			data_len = 1;
+		else if (ei->array_type == STATIC_ARRAY)
+			data_len = ei->elem_len;
+		else if (data_len > ei->elem_len)
+			return -EINVAL;
+
+		switch (ei->data_type) {
+		case QMI_STRUCT:
+			ret = qmi_decode_struct_elem(ei, out + ei->offset, &in[decoded],
+						     data_len, tlv_len, level + 1);
+			break;
+
+		case QMI_STRING:
+			ret = qmi_decode_string_elem(ei, (char *)out + ei->offset,
+						     &in[decoded], tlv_len, level);
+			break;
+
+		case QMI_EOTI:
+		case QMI_OPT_FLAG:
+		case QMI_DATA_LEN:
+			return -EINVAL;
+
+		default:
+			ret = (size_t)data_len * ei->elem_size;
+			if ((size_t)ret > tlv_len)
+				return -EINVAL;
+			memcpy(out + ei->offset, &in[decoded], ret);
+			break;
+		}
+
+		if (ret < 0)
+			return ret;
+
+		/* Items of a TLV must fill it exactly */
+		if (level == 1 && (size_t)ret != tlv_len)
+			return -EINVAL;
+
+		decoded += ret;
+		ei++;
+	}
+
+	return decoded;
+}
+
+ssize_t qmi_encode_message(struct qrtr_packet *pkt, int type, int msg_id,
+			   int txn_id, const void *c_struct,
+			   struct qmi_elem_info *ei)
+{
+	struct qmi_header hdr;
+	ssize_t ret;
+
+	if (pkt->data_len < sizeof(hdr))
+		return -ENOSPC;
+
+	ret = qmi_encode(ei, (uint8_t *)pkt->data + sizeof(hdr),
+			 pkt->data_len - sizeof(hdr), c_struct, 1);
+	if (ret < 0)
+		return ret;
+
+	hdr.type = type;
+	hdr.txn_id = txn_id;
+	hdr.msg_id = msg_id;
+	hdr.msg_len = ret;
+	memcpy(pkt->data, &hdr, sizeof(hdr));
+
+	pkt->data_len = sizeof(hdr) + ret;
+
+	return pkt->data_len;
+}
+
+int qmi_decode_message(void *c_struct, unsigned int *txn,
+		       struct qrtr_packet *pkt, int type, int id,
+		       struct qmi_elem_info *ei)
+{
+	struct qmi_header hdr;
+	ssize_t ret;
+
+	if (pkt->data_len < sizeof(hdr))
+		return -EINVAL;
+
+	memcpy(&hdr, pkt->data, sizeof(hdr));
+	if (hdr.type != type || hdr.msg_id != id ||
+	    hdr.msg_len > pkt->data_len - sizeof(hdr))
+		return -EINVAL;
+
+	ret = qmi_decode(ei, c_struct, (const uint8_t *)pkt->data + sizeof(hdr),
+			 hdr.msg_len, 1);
+	if (ret < 0)
+		return ret;
+
+	if (txn)
+		*txn = hdr.txn_id;
+
+	return 0;
+}
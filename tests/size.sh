@@ -0,0 +1,131 @@
+#!/bin/sh
+#
+# Track the object size and compile time of the generated sources.
+#
+# usage: size.sh [-u] QMIC BASELINE
+#
+# Runs qmic in each output mode, and with -s, over the IDLs in tests/ which
+# are expected to compile, plus a couple of synthetic ones from
+# bench/gen-idl.sh, compiles the results with $CC -O2 and adds up the .text,
+# .rodata and .data sections of each object. The results are compared with BASELINE, failing if any
+# section grew by more than $SIZE_TOLERANCE percent (default 0).
+#
+# Compile times depend on the host which last updated BASELINE, so they're
+# only reported, unless $TIME_TOLERANCE is set: then compiling a mode taking
+# more than that many percent longer fails as well.
+#
+# With -u, BASELINE is rewritten with the results instead.
+#
+
+update=0
+if [ "$1" = "-u" ]; then
+	update=1
+	shift
+fi
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 [-u] QMIC BASELINE" >&2
+	exit 1
+fi
+
+qmic=$1
+baseline=$2
+srcdir=$(dirname "$0")/..
+cc=${CC:-cc}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# Synthetic IDLs; the accessor style sources don't support structs
+sh "$srcdir/bench/gen-idl.sh" synth 50 20 3 200 20 > "$tmp/synth.qmi" || exit 1
+sh "$srcdir/bench/gen-idl.sh" -a synth_flat 50 0 0 200 20 > "$tmp/synth_flat.qmi" || exit 1
+
+now() {
+	date +%s%N
+}
+
+for mode in a k ks c; do
+	elapsed=0
+
+	case $mode in
+	a)	idls="$srcdir/tests/*.qmi $tmp/synth_flat.qmi" ;;
+	*)	idls="$srcdir/tests/*.qmi $tmp/synth.qmi" ;;
+	esac
+
+	for idl in $idls; do
+		name=$(basename "$idl" .qmi)
+		out=$tmp/$mode/$name
+		mkdir -p "$out"
+
+		# Skip the tests of invalid input
+		"$qmic" -$mode -o "$out" "$idl" 2> /dev/null || continue
+
+		for src in "$out"/*.c; do
+			start=$(now)
+			"$cc" -O2 -c -I"$srcdir" -I"$srcdir/tests/include" -I"$out" \
+				-o "$out/out.o" "$src" || exit 1
+			elapsed=$((elapsed + $(now) - start))
+		done
+
+		size -A "$out/out.o" | awk -v mode=$mode -v name=$name '
+			$1 ~ /^\.text/ { text += $2 }
+			$1 ~ /^\.rodata/ { rodata += $2 }
+			$1 ~ /^\.data/ { data += $2 }
+			END { print mode, name, text + 0, rodata + 0, data + 0 }'
+	done
+
+	echo "$mode compile-ms $((elapsed / 1000000))"
+done > "$tmp/results"
+
+if [ $update -eq 1 ]; then
+	{
+		echo "# mode idl .text .rodata .data, or mode compile-ms ms"
+		cat "$tmp/results"
+	} > "$baseline"
+	exit 0
+fi
+
+awk -v size_tol=${SIZE_TOLERANCE:-0} -v time_tol=${TIME_TOLERANCE:--1} '
+	FNR == NR {
+		if ($1 !~ /^#/)
+			base[$1 " " $2] = $0
+		next
+	}
+
+	{
+		key = $1 " " $2
+		if (!(key in base)) {
+			printf "%-40s new\n", key
+			next
+		}
+
+		split(base[key], b)
+		delete base[key]
+
+		if ($2 == "compile-ms") {
+			limit = b[3] * (100 + time_tol) / 100
+			if (time_tol < 0)
+				status = "info"
+			else
+				status = $3 > limit ? "FAIL" : "ok"
+			printf "%-40s %8d ms (baseline %d ms) %s\n", key, $3, b[3], status
+		} else {
+			status = "ok"
+			for (i = 3; i <= 5; i++)
+				if ($i > b[i] * (100 + size_tol) / 100)
+					status = "FAIL"
+			printf "%-40s %8d %8d %8d (baseline %d %d %d) %s\n", key,
+			       $3, $4, $5, b[3], b[4], b[5], status
+		}
+
+		if (status == "FAIL")
+			failed = 1
+	}
+
+	END {
+		for (key in base) {
+			printf "%-40s missing FAIL\n", key
+			failed = 1
+		}
+		exit failed
+	}' "$baseline" "$tmp/results"
@@ -0,0 +1,309 @@
+/*
+ * Tests of the accessor style runtime in qmi_tlv.c, see "make check"
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "qmi_tlv.h"
+
+#define QMI_RESPONSE 2
+
+static int failed;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		failed++;						\
+	}								\
+} while (0)
+
+/* A received message, built up a TLV at a time */
+struct msg {
+	uint8_t buf[256];
+	size_t len;
+};
+
+static void msg_init(struct msg *msg, unsigned type, unsigned txn, unsigned msg_id)
+{
+	msg->buf[0] = type;
+	msg->buf[1] = txn & 0xff;
+	msg->buf[2] = txn >> 8;
+	msg->buf[3] = msg_id & 0xff;
+	msg->buf[4] = msg_id >> 8;
+	msg->len = 7;
+}
+
+static void msg_add(struct msg *msg, unsigned key, unsigned len, const void *data)
+{
+	msg->buf[msg->len++] = key;
+	msg->buf[msg->len++] = len & 0xff;
+	msg->buf[msg->len++] = len >> 8;
+	memcpy(&msg->buf[msg->len], data, len);
+	msg->len += len;
+}
+
+/* Set the msg_len of the header from the TLVs added */
+static void msg_finish(struct msg *msg)
+{
+	msg->buf[5] = (msg->len - 7) & 0xff;
+	msg->buf[6] = (msg->len - 7) >> 8;
+}
+
+static void test_lookup(void)
+{
+	struct qmi_tlv *tlv;
+	struct msg msg;
+	unsigned txn = 0;
+	size_t size;
+	size_t len;
+	uint8_t *p;
+
+	msg_init(&msg, QMI_RESPONSE, 0x1234, 0x20);
+	msg_add(&msg, 0x01, 1, "\x05");
+	msg_add(&msg, 0x10, 3, "\x02\xaa\xbb");
+	msg_add(&msg, 0x11, 0, "");
+	msg_add(&msg, 0x01, 2, "\x06\x07");
+	msg_add(&msg, 0xff, 1, "\x08");
+	msg_finish(&msg);
+
+	/* Wrong message type */
+	CHECK(!qmi_tlv_decode(msg.buf, msg.len, &txn, 4));
+
+	tlv = qmi_tlv_decode(msg.buf, msg.len, &txn, QMI_RESPONSE);
+	CHECK(tlv);
+	if (!tlv)
+		return;
+	CHECK(txn == 0x1234);
+
+	/* The first of duplicated items wins */
+	p = qmi_tlv_get(tlv, 0x01, &len);
+	CHECK(p && len == 1 && p[0] == 5);
+
+	p = qmi_tlv_get_array(tlv, 0x10, 1, &len, &size);
+	CHECK(p && len == 2 && size == 1 && p[0] == 0xaa && p[1] == 0xbb);
+
+	p = qmi_tlv_get(tlv, 0x11, &len);
+	CHECK(p && len == 0);
+
+	p = qmi_tlv_get(tlv, 0xff, &len);
+	CHECK(p && len == 1 && p[0] == 8);
+
+	CHECK(!qmi_tlv_get(tlv, 0x12, &len));
+	CHECK(!qmi_tlv_get(tlv, 0x100, &len));
+
+	qmi_tlv_free(tlv);
+}
+
+static void test_truncated(void)
+{
+	struct qmi_tlv tlv;
+	struct msg msg;
+	size_t size;
+	size_t len;
+
+	/* Item longer than the message */
+	msg_init(&msg, QMI_RESPONSE, 1, 0x20);
+	msg_add(&msg, 0x01, 4, "\x01\x02\x03\x04");
+	msg.buf[8] = 5;
+	msg_finish(&msg);
+	CHECK(!qmi_tlv_decode(msg.buf, msg.len, NULL, QMI_RESPONSE));
+	CHECK(!qmi_tlv_decode_into(&tlv, msg.buf, msg.len, NULL, QMI_RESPONSE));
+
+	/* Partial item header */
+	msg_init(&msg, QMI_RESPONSE, 1, 0x20);
+	msg_add(&msg, 0x01, 1, "\x01");
+	msg.buf[msg.len++] = 0x02;
+	msg.buf[msg.len++] = 0x00;
+	msg_finish(&msg);
+	CHECK(!qmi_tlv_decode(msg.buf, msg.len, NULL, QMI_RESPONSE));
+
+	/* msg_len claiming more than was received */
+	msg_init(&msg, QMI_RESPONSE, 1, 0x20);
+	msg_add(&msg, 0x01, 1, "\x01");
+	msg_finish(&msg);
+	CHECK(!qmi_tlv_decode(msg.buf, msg.len - 1, NULL, QMI_RESPONSE));
+
+	/* Shorter than the QMI header */
+	CHECK(!qmi_tlv_decode(msg.buf, 6, NULL, QMI_RESPONSE));
+
+	/* An array which is too short for its count is still rejected on get */
+	msg_init(&msg, QMI_RESPONSE, 1, 0x20);
+	msg_add(&msg, 0x10, 1, "\x01");
+	msg_finish(&msg);
+	CHECK(qmi_tlv_decode_into(&tlv, msg.buf, msg.len, NULL, QMI_RESPONSE));
+	CHECK(!qmi_tlv_get_array(&tlv, 0x10, 2, &len, &size));
+}
+
+static void test_init_buf(void)
+{
+	QMI_TLV_BUF(buf, 8);
+	struct qmi_tlv *tlv;
+	uint8_t *msg;
+	uint8_t *p;
+	size_t len;
+
+	/* Unaligned, or too small for even the header */
+	CHECK(!qmi_tlv_init_buf(buf + 1, sizeof(buf) - 1, 1, 0x20, 0));
+	CHECK(!qmi_tlv_init_buf(buf, sizeof(struct qmi_tlv) + 6, 1, 0x20, 0));
+
+	tlv = qmi_tlv_init_buf(buf, sizeof(buf), 1, 0x20, 0);
+	CHECK(tlv);
+	if (!tlv)
+		return;
+
+	/* 3 bytes of header and 5 of data fill the buffer exactly */
+	CHECK(!qmi_tlv_set(tlv, 0x10, "abcde", 5));
+	CHECK(qmi_tlv_set(tlv, 0x11, "", 0) == -ENOSPC);
+	CHECK(qmi_tlv_set_array(tlv, 0x12, 1, "", 0, 1) == -ENOSPC);
+
+	p = qmi_tlv_get(tlv, 0x10, &len);
+	CHECK(p && len == 5 && !memcmp(p, "abcde", 5));
+	CHECK(!qmi_tlv_get(tlv, 0x11, &len));
+
+	msg = qmi_tlv_encode(tlv, &len);
+	CHECK(msg == (uint8_t *)buf + sizeof(struct qmi_tlv));
+	CHECK(len == 15 && msg[5] == 8 && msg[6] == 0);
+
+	/* Nothing was allocated, so there's nothing to free */
+	qmi_tlv_free(tlv);
+}
+
+static void test_decode_into(void)
+{
+	struct qmi_tlv tlv;
+	struct msg msg;
+	struct msg copy;
+	size_t len;
+	uint8_t *p;
+	void *ro;
+
+	msg_init(&msg, QMI_RESPONSE, 1, 0x20);
+	msg_add(&msg, 0x01, 2, "\x01\x02");
+	msg_finish(&msg);
+	copy = msg;
+
+	CHECK(qmi_tlv_decode_into(&tlv, msg.buf, msg.len, NULL, QMI_RESPONSE) == &tlv);
+
+	p = qmi_tlv_get(&tlv, 0x01, &len);
+	CHECK(p == &msg.buf[10] && len == 2);
+
+	/* The result is read-only, neither growing nor touching the buffer */
+	CHECK(qmi_tlv_set(&tlv, 0x10, "x", 1) == -ENOSPC);
+	CHECK(qmi_tlv_set(&tlv, 0x11, "", 0) == -ENOSPC);
+	CHECK(!qmi_tlv_get(&tlv, 0x10, &len));
+	CHECK(tlv.size == msg.len);
+
+	qmi_tlv_free(&tlv);
+	CHECK(!memcmp(msg.buf, copy.buf, msg.len));
+
+	/* Encoding it again hands back the buffer, even a read-only one */
+	ro = mmap(NULL, sizeof(msg.buf), PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CHECK(ro != MAP_FAILED);
+	if (ro == MAP_FAILED)
+		return;
+
+	memcpy(ro, msg.buf, msg.len);
+	CHECK(!mprotect(ro, sizeof(msg.buf), PROT_READ));
+
+	CHECK(qmi_tlv_decode_into(&tlv, ro, msg.len, NULL, QMI_RESPONSE) == &tlv);
+	CHECK(qmi_tlv_encode(&tlv, &len) == ro && len == msg.len);
+
+	munmap(ro, sizeof(msg.buf));
+}
+
+static void test_array(void)
+{
+	static const uint8_t data[300];
+	struct qmi_tlv *tlv;
+	uint16_t *p;
+	size_t size;
+	size_t len;
+
+	tlv = qmi_tlv_init(1, 0x20, 0);
+	CHECK(tlv);
+	if (!tlv)
+		return;
+
+	/* After the 7 byte header and two 3 byte item headers, at an odd offset */
+	CHECK(!qmi_tlv_set(tlv, 0x01, "", 0));
+	CHECK(!qmi_tlv_set_array(tlv, 0x10, 2, "\x01\x02\x03\x04", 2, 2));
+	p = qmi_tlv_get_array(tlv, 0x10, 2, &len, &size);
+	CHECK(p && len == 2 && size == 2);
+	CHECK(p && !memcmp(p, "\x01\x02\x03\x04", 4));
+
+	/* Counts which don't fit their prefix */
+	CHECK(qmi_tlv_set_array(tlv, 0x11, 1, (void *)data, 256, 1) == -EINVAL);
+	CHECK(qmi_tlv_set_array(tlv, 0x11, 2, (void *)data, 65536, 0) == -EINVAL);
+	CHECK(!qmi_tlv_set_array(tlv, 0x11, 1, (void *)data, 255, 1));
+
+	/* ...or sizes which overflow */
+	CHECK(qmi_tlv_set_array(tlv, 0x12, 2, (void *)data, 2, SIZE_MAX / 2 + 1) == -EINVAL);
+	CHECK(qmi_tlv_set_array(tlv, 0x12, 2, (void *)data, 1, SIZE_MAX - 1) == -EINVAL);
+	CHECK(qmi_tlv_set_array(tlv, 0x12, 2, (void *)data, 2, 40000) == -EMSGSIZE);
+	CHECK(!qmi_tlv_get(tlv, 0x12, &len));
+
+	qmi_tlv_free(tlv);
+}
+
+static void test_pool(void)
+{
+	static const uint8_t data[100];
+	struct qmi_tlv *tlv;
+	void *allocated;
+	void *first;
+	size_t len;
+
+	qmi_tlv_pool_init();
+
+	tlv = qmi_tlv_init(1, 0x20, 0);
+	CHECK(tlv);
+	if (!tlv)
+		return;
+	CHECK(!qmi_tlv_set(tlv, 0x10, "abc", 3));
+	first = tlv;
+	allocated = tlv->allocated;
+	qmi_tlv_free(tlv);
+
+	/* The object and the buffer of its size class are reused */
+	tlv = qmi_tlv_init(2, 0x21, 0);
+	CHECK(tlv == first);
+	CHECK(tlv && tlv->allocated == allocated);
+	if (!tlv)
+		return;
+
+	/* ...and are reset */
+	CHECK(!qmi_tlv_get(tlv, 0x10, &len));
+	qmi_tlv_encode(tlv, &len);
+	CHECK(len == 7);
+
+	/* Growing past the size class moves to a bigger buffer */
+	CHECK(!qmi_tlv_set(tlv, 0x10, (void *)data, sizeof(data)));
+	CHECK(tlv->allocated != allocated && tlv->allocated_size == 256);
+	qmi_tlv_free(tlv);
+
+	qmi_tlv_pool_flush();
+}
+
+int main(void)
+{
+	test_lookup();
+	test_truncated();
+	test_init_buf();
+	test_decode_into();
+	test_array();
+
+	/* Last, as the pools can't be disabled again */
+	test_pool();
+
+	if (failed) {
+		fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}